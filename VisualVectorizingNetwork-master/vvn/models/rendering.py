@@ -1,6 +1,10 @@
 import numpy as np
 import tensorflow as tf
 
+occ = tf.load_op_library('../ops/src/tf_particle_occlusion.so')
+smp = tf.load_op_library('../ops/src/tf_image_sampling.so')
+pts = tf.load_op_library('../ops/src/tf_point_sampling.so')
+
 def read_rendering_matrix(mat, out_shape=[4,4]):
     mat_shape = mat.shape.as_list()
     assert len(mat_shape) == 3
@@ -158,37 +162,16 @@ def occlude_particles_in_camera_volume(particles_image_coordinates, particles_de
 
     returns:
     not_occluded_mask [B,T,N,1] mask of particles which are NOT occluded
-    '''
-    # particles behind camera shouldn't occlude anything
-    # if particles_mask is not None:
-    #     pim_coordinates = mask_tensor(particles_image_coordinates, particles_mask, mask_value=-100.0*p_radius)
-    # else:
-    #     pim_coordinates = particles_image_coordinates
-    # ps_in_front_of_camera = tf.cast(particles_depths < 0.0, tf.float32)
-    # if particles_mask is not None:
-        # ps_in_front_of_camera = ps_in_front_of_camera * particles_mask
-    # ps_in_front_of_camera = tf.cast(particles_depths < 0.0, dtype=tf.float32)
-    # coord_mask_val = -100.0 * p_radius * tf.range(1, 1+particles_depths.shape.as_list()[2], dtype=tf.float32)
-    # coord_mask_val = tf.reshape(coord_mask_val, [1,1,-1,1]) # now masked particles won't occlude each other
-    coord_mask_val=-100.0*p_radius
-    mask = particles_mask * tf.cast(particles_depths < 0.0, tf.float32)
-    pim_coordinates = mask_tensor(particles_image_coordinates, mask=mask, mask_value=coord_mask_val)
-    # pim_coordinates = mask_tensor(particles_image_coordinates, mask=ps_in_front_of_camera, mask_value=coord_mask_val)
-    # if particles_mask is not None:
-    #     pim_coordinates = mask_tensor(pim_coordinates, mask=particles_mask, mask_value=-100.0*p_radius)
-
-    p_q_hw_dist2 = tf.reduce_sum(tf.square(tf.expand_dims(pim_coordinates, 3) - tf.expand_dims(pim_coordinates, 2)), axis=4) # [B,T,N,N]
-    q_disc_includes_p = p_q_hw_dist2 < tf.square(tf.cast(p_radius, dtype=tf.float32))
-    q_in_front_of_p = tf.transpose(particles_depths, [0,1,3,2]) > particles_depths # [B,T,N,N] last axis is potential occluders
-
-    q_occluding_p = tf.cast(tf.logical_and(q_disc_includes_p, q_in_front_of_p), dtype=tf.float32) # [B,T,N,N]
-    p_occluded = tf.reduce_max(q_occluding_p, axis=3, keepdims=True) # [B,T,N,1]
-
-    not_occluded_mask = 1.0 - p_occluded
 
+    This is the wrapper for the OccludeParticles C++ op, which tests each particle only against nearer
+    particles in neighbouring cells of a screen-space grid instead of building [B,T,N,N] pairwise tensors.
+    '''
+    # particles behind camera or masked out are moved off screen and can only occlude each other;
     # all fake particles are occluded
-    if particles_mask is not None:
-        not_occluded_mask *= particles_mask
+    if particles_mask is None:
+        particles_mask = tf.ones_like(particles_depths)
+    not_occluded_mask = occ.occlude_particles(particles_image_coordinates, particles_depths, particles_mask,
+                                              p_radius=float(p_radius))
 
     return not_occluded_mask
 
@@ -214,50 +197,65 @@ def project_and_occlude_particles(particles, im_size,
     returns
     particles_im_indices: [B,T,N,2] of int32 indices into H and W dimensions of an image of size H,W
     not_occluded_mask: [B,T,N,1] float32 where 1.0 indicates the particle wasn't occluded at radius p_radius, 0.0 otherwise
+    particles_im_coordinates: [B,T,N,2] float32 image coordinates clipped to [-coord_max, coord_max]
+
+    This is the wrapper for the ProjectAndOccludeParticles C++ op, which does all of the above in one pass per frame.
     '''
     B,T,N,D = particles.shape.as_list()
     H,W = im_size
     if p_radius is None:
         p_radius = 3.0 * (np.minimum(H,W).astype(float) / 256.0)
         print("p radius", p_radius)
-    # get indices into image
-    particles_xyz = particles[...,xyz_dims[0]:xyz_dims[1]]
+    assert xyz_dims[1] - xyz_dims[0] == 3, xyz_dims
     if not particles_agent_centered:
         assert camera_matrix is not None, "need a camera matrix to put into agent coordinates"
-        particles_agent = raw_to_agent_particles(particles_xyz, Vmat=camera_matrix)
     else:
-        particles_agent = particles_xyz
-
-    # [B,T,N,2] <tf.float32> values in range [0,H]x[0,W]
-    particles_depths = particles_agent[...,-1:]
-    particles_im_coordinates = agent_particles_to_image_coordinates(particles_agent,
-                                                                    Pmat=projection_matrix,
-                                                                    H_out=H, W_out=W,
-                                                                    to_integers=False)
-
-
-    # clip coordinates
-    particles_im_coordinates = tf.where(tf.logical_or(tf.is_nan(particles_im_coordinates), tf.is_inf(particles_im_coordinates)),
-                                        coord_max * tf.ones_like(particles_im_coordinates), # true
-                                        particles_im_coordinates # false
-    )
-    particles_im_coordinates = tf.maximum(tf.minimum(particles_im_coordinates, coord_max), -coord_max)
-
-    # particles_depths = tf.Print(particles_depths, [particles_depths.shape[2], tf.reduce_max(particles_depths), tf.reduce_min(particles_im_coordinates), tf.reduce_max(particles_im_coordinates)], message='p_depth/coords')
-
-    # resolve occlusions
-    not_occluded_mask = occlude_particles_in_camera_volume(particles_im_coordinates,
-                                                           particles_depths,
-                                                           p_radius=p_radius,
-                                                           particles_mask=particles_mask
-                                                           # particles_mask=None
-    )
-    particles_im_indices = tf.cast(tf.round(particles_im_coordinates), dtype=tf.int32)
-    particles_im_indices = tf.minimum(tf.maximum(particles_im_indices, 0),
-                                      tf.reshape(tf.constant(np.array([H-1,W-1]), dtype=tf.int32), [1,1,1,2]))
+        camera_matrix = tf.eye(4, dtype=tf.float32) # unused
+    if particles_mask is None:
+        particles_mask = tf.ones([B,T,N,1], dtype=tf.float32)
+
+    # projection, coordinate clipping, occlusion and rounding to indices in one op
+    particles_im_indices, not_occluded_mask, particles_im_coordinates = occ.project_and_occlude_particles(
+        particles, projection_matrix, camera_matrix, particles_mask,
+        im_size=[int(H),int(W)], p_radius=float(p_radius), xyz_dim=xyz_dims[0],
+        agent_centered=particles_agent_centered, coord_max=float(coord_max))
 
     return particles_im_indices, not_occluded_mask, particles_im_coordinates # last is float
 
+def farthest_point_sample_particles(particles, num_points, particles_mask=None, xyz_dims=[0,3]):
+    '''
+    Downsamples particles to a fixed number by farthest-point sampling on their xyz_dims,
+    so that examples with many particles can be capped rather than filtered out.
+
+    particles: [B,[T],N,D]
+    num_points: int P
+    particles_mask: [B,[T],N,1] float32, 1.0 for real particles; all real if None
+
+    returns
+    sampled_particles: [B,[T],P,D]
+    sampled_mask: [B,[T],P,1] float32, 0.0 where there were fewer than P real particles
+    inds: [B,[T],P] int32 indices into the N particles; all 0 (and masked) if N == 0
+    '''
+    shape = particles.shape.as_list()
+    N,D = shape[-2:]
+    if N == 0: # nothing to gather; every sample is padding
+        return (tf.zeros(shape[:-2] + [num_points,D], dtype=particles.dtype),
+                tf.zeros(shape[:-2] + [num_points,1], dtype=tf.float32),
+                tf.zeros(shape[:-2] + [num_points], dtype=tf.int32))
+    if particles_mask is None:
+        particles_mask = tf.ones(shape[:-1] + [1], dtype=tf.float32)
+    inds, sampled_mask = pts.farthest_point_sample(
+        tf.reshape(particles[...,xyz_dims[0]:xyz_dims[1]], [-1,N,xyz_dims[1]-xyz_dims[0]]),
+        tf.reshape(tf.cast(particles_mask, tf.float32), [-1,N]),
+        num_points=num_points)
+    BT = inds.shape.as_list()[0]
+    b_inds = tf.tile(tf.range(BT, dtype=tf.int32)[:,tf.newaxis], [1,num_points])
+    sampled_particles = tf.gather_nd(tf.reshape(particles, [-1,N,D]), tf.stack([b_inds, inds], axis=-1)) # [BT,P,D]
+    sampled_particles = tf.reshape(sampled_particles, shape[:-2] + [num_points,D])
+    sampled_mask = tf.reshape(sampled_mask, shape[:-2] + [num_points,1])
+    inds = tf.reshape(inds, shape[:-2] + [num_points])
+    return sampled_particles, sampled_mask, inds
+
 def nodes_from_spatial_inds(nodes, spatial_inds, segment_ids, im_size):
     B,T,N,D = nodes.shape.as_list()
     _,_,H,W = segment_ids.shape.as_list()
@@ -365,31 +363,18 @@ def sample_image_inds(out_shape, im_size, train, **kwargs):
 
     return spatial_inds
 
-def sample_delta_image_inds(images, num_points, static=False, rgb_max=255.0, eps=1e-6, use_cpu=True, **kwargs):
+def sample_delta_image_inds(images, num_points, static=False, rgb_max=255.0, eps=1e-6, use_cpu=True, seed=0, **kwargs):
     '''
     preferentially sample indices from parts of the image where im[:,t+1] - im[:,t] is high
+
+    This is the wrapper for the SampleDeltaImageInds C++ op, which builds an alias table per frame pair
+    and draws each sample in O(1). It always runs on the CPU; frame pairs with no change are sampled uniformly.
+
+    returns
+    points: [B,T-1,num_points,2] <tf.int32> (h,w) indices
     '''
-    B,T,H,W,C = images.shape.as_list()
-    images = tf.cast(images, tf.float32) / rgb_max
-    delta_ims = tf.reduce_sum(tf.square(images[:,1:] - images[:,:-1]), axis=-1, keepdims=False)
-    delta_ims = tf.reshape(delta_ims, [B,T-1,-1])
-    if static:
-        delta_max = tf.reduce_max(delta_ims, axis=-1, keepdims=True)
-        delta_ims = delta_max - delta_ims # invert so that sample is from the non-moving parts
-    probs = tf.div(tf.maximum(0.0, delta_ims), tf.reduce_sum(delta_ims, axis=-1, keepdims=True) + eps) # [B,T-1,HW]
-
-    if use_cpu:
-        with tf.device("/cpu:0"):
-            dist = tf.distributions.Categorical(probs=probs, dtype=tf.int32)
-            points = dist.sample(num_points) # [num_points, B, T-1]
-            points = tf.transpose(points, [1,2,0]) # [B,T-1,num_points] <tf.int32>
-    else:
-        dist = tf.distributions.Categorical(probs=probs, dtype=tf.int32)
-        points = dist.sample(num_points) # [num_points, B, T-1]
-        points = tf.transpose(points, [1,2,0]) # [B,T-1,num_points] <tf.int32>
-
-    # turn back into indices
-    points_h = tf.minimum(tf.maximum(tf.floordiv(points, W), 0), H-1)
-    points_w = tf.minimum(tf.maximum(tf.floormod(points, W), 0), W-1)
-    points = tf.stack([points_h, points_w], axis=-1) # [B,T-1,P,2]
+    if images.dtype not in [tf.uint8, tf.float32]:
+        images = tf.cast(images, tf.float32)
+    points = smp.sample_delta_image_inds(images, num_points=num_points, static=static, rgb_max=float(rgb_max),
+                                         seed=seed, seed2=kwargs.get('seed2', 0))
     return points
@@ -221,6 +221,49 @@ def build_convrnn_inputs(
 
     return inp_ims_list, Dims # list in temporal order for input to TNN model
 
+def fc_variables(input_dim,
+                 num_feature,
+                 scope,
+                 kernel_initializer = tf.contrib.layers.xavier_initializer(seed = 0),
+                 bias_initializer = tf.constant_initializer(0.),
+                 dtype = tf.float32,
+                 trainable = True,
+                 **kwargs):
+    '''
+    Gets or creates the [input_dim, num_feature] kernel and [num_feature] bias of a fully connected layer
+    '''
+    with tf.compat.v1.variable_scope(scope, reuse=tf.AUTO_REUSE):
+        # Initialize kernel variable
+        kernel = tf.compat.v1.get_variable(
+                initializer = kernel_initializer,
+                shape = [input_dim, num_feature],
+                dtype = dtype,
+                name = 'weights',
+                trainable = trainable,
+                )
+
+        # Initialize bias variable
+        bias = tf.compat.v1.get_variable(
+                initializer = bias_initializer,
+                shape = [num_feature],
+                dtype = dtype,
+                name = 'bias',
+                trainable = trainable,
+                )
+    return kernel, bias
+
+def mlp_variables(input_dim, num_features, scope = 'fc', share_weights = False, **kwargs):
+    '''
+    The (kernel, bias) pairs that mlp would use for an input with input_dim features,
+    for ops that apply the layers themselves
+    '''
+    variables = []
+    for i, num_feature in enumerate(num_features):
+        iscope = scope if share_weights else scope + str(i)
+        variables.append(fc_variables(input_dim, num_feature, iscope, **kwargs))
+        input_dim = num_feature
+    return variables
+
 def mlp(inp,
         num_features=[],
         activations = None,
@@ -251,31 +294,13 @@ def mlp(inp,
 
     for i, (num_feature, activation) in enumerate(zip(num_features, activations)):
         iscope = scope if share_weights else scope + str(i)
-        with tf.compat.v1.variable_scope(iscope, reuse=tf.AUTO_REUSE):
-            # Infer kernel shape
-            kernel_shape = inp.get_shape().as_list()
-            kernel_shape = kernel_shape[:-2] + kernel_shape[-1:] + [num_feature]
-            # Initialize kernel variable
-            kernel = tf.compat.v1.get_variable(
-                    initializer = kernel_initializer,
-                    shape = kernel_shape,
-                    dtype = inp.dtype,
-                    name = 'weights',
-                    trainable = trainable,
-                    )
-
-            # Initialize bias variable
-            bias = tf.compat.v1.get_variable(
-                    initializer = bias_initializer,
-                    shape = [num_feature],
-                    dtype = inp.dtype,
-                    name = 'bias',
-                    trainable = trainable,
-                    )
-            # Compute fully connected
-            inp = activation(tf.matmul(inp, kernel) + bias)
-            if dropout is not None:
-                inp = tf.nn.dropout(inp, dropout, seed)
+        kernel, bias = fc_variables(inp.get_shape().as_list()[-1], num_feature, iscope,
+                                    kernel_initializer=kernel_initializer, bias_initializer=bias_initializer,
+                                    dtype=inp.dtype, trainable=trainable)
+        # Compute fully connected
+        inp = activation(tf.matmul(inp, kernel) + bias)
+        if dropout is not None:
+            inp = tf.nn.dropout(inp, dropout, seed)
 
     # restore inp shape
     if len(inp_shape) != 2:
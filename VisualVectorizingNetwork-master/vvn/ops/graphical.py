@@ -8,13 +8,17 @@ from collections import OrderedDict
 import os
 import sys
 
-from vvn.ops.convolutional import mlp, shared_spatial_mlp
+from vvn.ops.convolutional import mlp, mlp_variables, shared_spatial_mlp
 from vvn.ops.dimensions import DimensionDict
 from vvn.ops.utils import inversion_map, mask_tensor
 
 #lp = tf.load_op_library('../ops/src/tf_labelprop.so')
 #lpfc = tf.load_op_library('../ops/src/tf_labelprop_fc.so')
 #hung = tf.load_op_library('../ops/src/hungarian.so')
+gc = tf.load_op_library('../ops/src/tf_graphconv.so')
+seg = tf.load_op_library('../ops/src/tf_segment_reduce.so')
+ec = tf.load_op_library('../ops/src/tf_edge_correction.so')
+hier = tf.load_op_library('../ops/src/tf_hierarchy.so')
 import vvn.ops.tf_nndistance # chamfer/nn distances
 
 PRINT = False
@@ -123,6 +127,25 @@ def euclidean_dist2(v1, v2, thresh=None, **kwargs):
 
     return adjacency
 
+def euclidean_affinity(v1, v2, thresh=None, **kwargs):
+    '''
+    Soft version of euclidean_dist2 for LabelPropSoft: exp(-dists2 / thresh) in (0,1]
+    '''
+    B,N,C,F = v2.shape.as_list()
+    assert v1.shape.as_list() == [B,N,C,1]
+
+    dists2 = tf.reduce_sum(tf.square(v1-v2), axis=2, keepdims=False) # [B,N,F]
+
+    if thresh is None:
+        channel_means = tf.reduce_mean(v1, axis=[1,3], keepdims=True) # [B,1,C,1]
+        thresh = tf.reduce_sum(tf.square(v1 - channel_means), axis=2, keepdims=False) # [B,N,1]
+    elif thresh == 'mean':
+        thresh = tf.reduce_mean(dists2, axis=[1,2], keepdims=True)
+
+    affinity = tf.exp(-dists2 / tf.maximum(thresh, 1e-8))
+
+    return affinity
+
 def compute_adjacency_from_features(features, k=1, metric=euclidean_dist2, metric_kwargs={}, symmetric=False):
     '''
     Inputs
@@ -199,12 +222,60 @@ def compute_adjacency_from_features(features, k=1, metric=euclidean_dist2, metri
     # TODO: Deal with literal edge/corner cases -- though this may be handled by LabelProp for some metrics
     return adjacency
 
+def compute_spacetime_adjacency_from_features(features, k=1, kt=1, metric=euclidean_dist2, metric_kwargs={}):
+    '''
+    Like compute_adjacency_from_features but over a [T,H,W] video, for LabelProp3D.
+
+    features: [B,T,H,W,C] <tf.float32>
+    k: int, spatial half width of the neighborhood
+    kt: int, temporal half width of the neighborhood
+
+    returns
+    adjacency: [B,T*H*W,(2kt+1)*(2k+1)**2] <tf.bool> whether feature at (t,h,w) is connected
+               to a feature in its (2kt+1)x(2k+1)x(2k+1) neighborhood, ordered (t,h,w)
+    '''
+    B,T,H,W,C = features.shape.as_list()
+    ksize = 2*k + 1
+    ktsize = 2*kt + 1
+    K = ktsize * ksize**2
+
+    # patches are [ktsize,ksize,ksize,C] with C fastest
+    neighbors = tf.extract_volume_patches(features, ksizes=[1,ktsize,ksize,ksize,1], strides=[1,1,1,1,1], padding='SAME')
+    neighbors = tf.transpose(tf.reshape(neighbors, [B,T*H*W,K,C]), [0,1,3,2]) # [B,THW,C,K]
+
+    adjacency = metric(
+        tf.reshape(features, [B,T*H*W,C,1]),
+        neighbors,
+        **metric_kwargs
+    ) # [B,THW,K]
+
+    return adjacency
+
+@tf.RegisterGradient("SegmentReduceCsr")
+def _segment_reduce_csr_grad(op, grad_output):
+    values, offsets, order = op.inputs
+    grad_values = seg.segment_reduce_csr_grad(values, offsets, order, op.outputs[0], grad_output,
+                                              reduction=op.get_attr('reduction'))
+    return [grad_values, None, None]
+
+def receiver_csr(receiver_idxs, batch_size, time, num_nodes):
+    """
+    Groups a list of (batch_index, time_index, receiver_index) by receiver so that
+    sum_effects over the same receivers doesn't have to regroup them.
+
+    :return offsets: Tensor(batch_size * time * num_nodes + 1) <tf.int32>
+    :return order: Tensor(?) <tf.int32> effect indices grouped by receiver
+    """
+    receiver_idxs = tf.cast(tf.reshape(receiver_idxs, [-1, 3]), tf.int32)
+    return seg.receiver_csr(receiver_idxs, batch_size=batch_size, time=time, num_nodes=num_nodes)
+
 def sum_effects(effects,
                 receiver_idxs,
                 batch_size,
                 time,
                 num_nodes,
                 agg_type='sum',
+                receiver_csr_inds=None,
                 **kwargs):
     """
     Constructs a node list in which effects with the same receiver index are summed into
@@ -215,39 +286,36 @@ def sum_effects(effects,
     :param batch_size: int, batch size
     :param time: int, number of time steps
     :param num_nodes: int, number of nodes
+    :param agg_type: str, one of 'sum', 'mean' or 'max'
+    :param receiver_csr_inds: optional (offsets, order) from receiver_csr(receiver_idxs, ...)
 
     :return node_effects: Tensor(batch_size, time, num_nodes, effect_dim),
         summed per node effects
+
+    Effects are reduced deterministically by the SegmentReduceCsr C++ op.
     """
     effect_dim = effects.get_shape().as_list()[1]
     receiver_nidxs = receiver_idxs.get_shape().as_list()[-1]
     assert receiver_nidxs == 3, ('receiver_idxs must be a list of ' + \
             '(batch_index, time_index, receiver_node_index)')
-    # Assign same identifier to effects that have the same receiver
-    receiver_idxs_sum = \
-            tf.reshape(receiver_idxs, [-1, receiver_nidxs])
-    cum = tf.math.cumprod([batch_size, time, num_nodes], axis=-1,
-            reverse=True, exclusive=True)
-    cum = tf.cast(cum, receiver_idxs_sum.dtype)
-    receiver_idxs_sum = tf.matmul(receiver_idxs_sum, tf.expand_dims(cum, axis=-1))
-    receiver_idxs_sum = tf.reshape(receiver_idxs_sum, [-1])
-    if agg_type == 'sum':
-        # Sum across all effects with the same identifier
-        node_effects = \
-                tf.math.unsorted_segment_sum(effects, receiver_idxs_sum,
-                        batch_size * time * num_nodes)
-    elif agg_type == 'mean':
-        # Sum across all effects with the same identifier
-        node_effects = \
-                tf.math.unsorted_segment_mean(effects, receiver_idxs_sum,
-                        batch_size * time * num_nodes)
-    else:
-        raise ValueError("agg_type must be in ['sum', 'mean'] but is %s" % agg_type)
+    if agg_type not in ['sum', 'mean', 'max']:
+        raise ValueError("agg_type must be in ['sum', 'mean', 'max'] but is %s" % agg_type)
+    # Group effects by receiver, then reduce each receiver's effects
+    if receiver_csr_inds is None:
+        receiver_csr_inds = receiver_csr(receiver_idxs, batch_size, time, num_nodes)
+    offsets, order = receiver_csr_inds
+    node_effects = seg.segment_reduce_csr(effects, offsets, order, reduction=agg_type)
     # Reshape back into original node shape
     node_effects = tf.reshape(node_effects,
             [batch_size, time, num_nodes, effect_dim])
     return node_effects
 
+@tf.RegisterGradient("GraphConvPairwise")
+def _graph_conv_pairwise_grad(op, grad_effects):
+    attrs = {k: op.get_attr(k) for k in ['activation', 'agg_type', 'right_receivers', 'scale_diffs_by_effects']}
+    grad_nodes, grad_w1, grad_b1, grad_w2, grad_b2 = gc.graph_conv_pairwise_grad(*(list(op.inputs) + [grad_effects]), **attrs)
+    return [grad_nodes, None, grad_w1, grad_b1, grad_w2, grad_b2]
+
 def graphconv_pairwise(nodes,
                        adjacency,
                        node_dims,
@@ -293,6 +361,19 @@ def graphconv_pairwise(nodes,
     # Gather node, node pairs
     n2n_idxs = tf.cast(tf.where(adjacency[:, :, :, :, 0]), tf.int32)
     # n2n_idxs = tf.Print(n2n_idxs, [tf.shape(n2n_idxs)[0]], message='num_edges')
+
+    # single hidden layer without edge features runs in the fused C++ op
+    fused_activations = {tf.identity: 'identity', tf.nn.relu: 'relu'}
+    if (len(node_dims) == 2) and (adjacency.get_shape().as_list()[-1] == 1) and (activation in fused_activations) \
+       and (not share_weights) and (kwargs.get('dropout', None) is None):
+        (w1, b1), (w2, b2) = mlp_variables(4*nodes.shape.as_list()[-1], node_dims, scope=scope, **kwargs)
+        effects = gc.graph_conv_pairwise(nodes, n2n_idxs, w1, b1, w2, b2,
+                                         activation=fused_activations[activation],
+                                         agg_type=kwargs.get('agg_type', 'sum'),
+                                         right_receivers=right_receivers,
+                                         scale_diffs_by_effects=scale_diffs_by_effects)
+        return effects
+
     batch_time_idxs = n2n_idxs[:, 0:2]
     lidxs = n2n_idxs[:, 2:3]
     ridxs = n2n_idxs[:, 3:4]
@@ -476,6 +557,12 @@ def compute_same_parent_within_layer_edges(n2n_idxs,
     batch_size, time, lN, rN, nidxs = n2n_idxs.shape
     assert nidxs == 4, nidxs
 
+    # single parent per leaf: group leaves by parent natively
+    if rN == 1:
+        _, _, lledges = compose_ancestors([n2n_idxs[:, :, :, 0, 3]], same_parent_level=0,
+                                          remove_self_connections=remove_self_connections)
+        return tf.cast(lledges, n2n_idxs.dtype)
+
     # Construct all possible combinations of edge connections
     # lledge format: batch_index, time_index, lindex1, lindex2, rindex2, rindex1
     lledges = tf.reshape(tf.tile(n2n_idxs[:, :, :, tf.newaxis, :, :],
@@ -588,6 +675,31 @@ def compute_edges_spacetime_nn(lnodes, rnodes, scope, dists_k=1.0, dists_p=1.0,
 
     return edges, edge_idxs
 
+def compose_ancestors(parent_idxs_list, same_parent_level=None, remove_self_connections=True):
+    """
+    Composes per-level child to parent index maps into the ancestor of every
+    base node at every level in a single op.
+
+    :param parent_idxs_list: list([Tensor(batch_size, time, N_l) <tf.int32>, ...]),
+        index of each level l node's parent among the level l+1 nodes
+    :param same_parent_level: int or None, if given also returns the edges between
+        base nodes that share an ancestor at this level
+    :param remove_self_connections: bool, removes self connections between base nodes
+
+    :return ancestor_idxs: Tensor(batch_size, time, N_0, len(parent_idxs_list)) <tf.int32>
+    :return offsets: Tensor(batch_size * time * N_0 + 1) <tf.int32>, CSR offsets of each base node's edges
+    :return lledges: Tensor(?, 4) <tf.int32>, same parent base node edges
+        formatted as batch_index, time_index, lindex, lindex
+    """
+    parent_idxs_list = [tf.cast(p, tf.int32) for p in parent_idxs_list]
+    ancestor_idxs, offsets, lledges = hier.compose_ancestors(
+        parent_idxs_list,
+        same_parent_level=(-1 if same_parent_level is None else same_parent_level),
+        remove_self_connections=remove_self_connections)
+    if same_parent_level is None:
+        return ancestor_idxs
+    return ancestor_idxs, offsets, lledges
+
 def get_grandparents(l0r1edges, l1r2edges):
     """
     Takes edges between l0nodes <-> r1nodes and l1nodes <-> r2nodes and
@@ -627,6 +739,18 @@ def get_ancestors(lredges_hierarchy):
         [batch_index, time_index, lindex, rindex, edge_features]), ...]),
         ordered edges describing hierarchy with leaf to ancestor edges
     """
+    # single parent per node and no edge features: compose all levels natively
+    if all(e.shape.as_list()[3:] == [1,4] for e in lredges_hierarchy):
+        l0r1edges = lredges_hierarchy[0]
+        ancestor_idxs = compose_ancestors([e[:, :, :, 0, 3] for e in lredges_hierarchy]) # [B,T,lN,L]
+        ancestor_idxs = tf.cast(ancestor_idxs, l0r1edges.dtype)
+        l0rXedges = [l0r1edges]
+        for X in range(1, len(lredges_hierarchy)):
+            l0rXedges.append(tf.concat([
+                l0r1edges[:, :, :, :, 0:2],
+                ancestor_idxs[:, :, :, tf.newaxis, X-1:X+1]], axis=-1))
+        return l0rXedges
+
     l0rXedges = [lredges_hierarchy[0]]
     for lXrYedges in lredges_hierarchy[1:]:
         l0rXedges.append(get_grandparents(l0rXedges[-1], lXrYedges))
@@ -1026,6 +1150,8 @@ def build_edge_corrections(
         recon_false_edges=True,
         border_false_edges=False,
         to_hsv=False,
+        stencil_edges=None,
+        k=1,
         **kwargs
 ):
     '''
@@ -1035,6 +1161,8 @@ def build_edge_corrections(
     img_lvl1: [B,[T],H,W,C] <tf.float32> an image decoded from the lvl1 segments and nodes
     img_gt: [B,[T],Him,Wim,C] <?> the gt image; will be preprocessed if not correct size and tf.dtype,
     valid_nodes: [B,[T],N,1] <tf.bool> indicating which nodes are valid (and how many)
+    stencil_edges: [B,[T],H*W,(2k+1)**2] <tf.bool> optional pixel edges the segments came from; if given, segment and
+                   image edges are read off them instead of sobel filters and everything runs in one CorrectSegmentEdges op
     '''
 
     # check and preprocess
@@ -1056,6 +1184,14 @@ def build_edge_corrections(
         img_gt = tf.reshape(tf.image.resize_images(
             tf.reshape(img_gt, [-1,Him,Wim,C]), [H,W]), img_gt.shape.as_list()[:-3] + [H,W,C]) # [B,[T],H,W,C]
 
+    if stencil_edges is not None:
+        edges_prev = tf.zeros(valid_nodes.shape.as_list()[:-1] + [N], dtype=tf.bool)
+        _, false_edges, true_edges = correct_edges(
+            edges_prev, stencil_edges, segments_lvl0, segments_lvl1, img_lvl1, img_gt, valid_nodes, k=k,
+            thresh_gate=thresh_gate0, thresh=thresh0, num_pixels_thresh=num_pixels_thresh, image_edges_weight=img_edges_weight,
+            recon_false_edges=recon_false_edges, border_false_edges=border_false_edges)
+        return false_edges, true_edges
+
     # assert img_gt.shape == img_lvl1.shape, "resized gt images and decoded images must all be same shape"
     # assert img_gt.dtype == img_lvl1.dtype, "gt images and decoded images must be the same dtype"
 
@@ -1095,6 +1231,8 @@ def update_edges(edges_prev, false_edges, true_edges, conflict_resolution='uncha
     edges_prev: [...,N,N] tf.bool
     false_edges: [...,N,N] tf.bool (True where edges should become 0)
     true_edges: [...,N,N] tf.bool (True where edges should become 1)
+
+    correct_edges does this and build_edge_corrections in one op, given the stencil edges
     '''
     conflicts = tf.logical_and(false_edges, true_edges)
     edges_next = tf.logical_or(edges_prev, true_edges)
@@ -1114,6 +1252,46 @@ def update_edges(edges_prev, false_edges, true_edges, conflict_resolution='uncha
 
     return edges_next
 
+def correct_edges(edges_prev, stencil_edges, segments_lvl0, segments_lvl1, image_pred, image_gt, valid_nodes, k=1,
+                  thresh_gate=0.25, thresh=0.25, dist_func=tf.abs, num_pixels_thresh=2, image_edges_weight=1.0,
+                  recon_false_edges=True, border_false_edges=False, conflict_resolution='unchanged', **kwargs):
+    '''
+    Fused build_edge_corrections + update_edges in a single CPU op, with segment and image edges read off the
+    stencil edges: a pixel is on a segment edge if a stencil neighbor is in another lvl1 segment, and on an image
+    edge if its stencil edge to an in-image neighbor is off.
+
+    edges_prev: [B,[T],N,N] <tf.bool>
+    stencil_edges: [B,[T],H*W,(2k+1)**2] <tf.bool> pixel edges, e.g. from compute_adjacency_from_features
+    segments_lvl0, segments_lvl1: [B,[T],H,W] <tf.int32>
+    image_pred, image_gt: [B,[T],H,W,C] <tf.float32>
+    valid_nodes: [B,[T],N,1] <tf.bool>
+
+    returns
+    edges_next: [B,[T],N,N] <tf.bool> as update_edges gives
+    false_edges: [B,[T],N,N] <tf.bool> edges that should become 0
+    true_edges: [B,[T],N,N] <tf.bool> edges that should become 1
+    '''
+    if dist_func not in [tf.abs, tf.square]:
+        raise ValueError("dist_func must be tf.abs or tf.square")
+    shape = edges_prev.shape.as_list()
+    N = shape[-1]
+    H,W,C = image_pred.shape.as_list()[-3:]
+    K = (2*k + 1)**2
+    edges_next, false_edges, true_edges = ec.correct_segment_edges(
+        tf.reshape(tf.cast(edges_prev, tf.bool), [-1,N,N]),
+        tf.reshape(tf.cast(stencil_edges, tf.bool), [-1,H*W,K]),
+        tf.reshape(segments_lvl0, [-1,H,W]),
+        tf.reshape(segments_lvl1, [-1,H,W]),
+        tf.reshape(tf.cast(image_pred, tf.float32), [-1,H,W,C]),
+        tf.reshape(tf.cast(image_gt, tf.float32), [-1,H,W,C]),
+        tf.reshape(valid_nodes, [-1,N,1]),
+        k=k, thresh_gate=thresh_gate, thresh=thresh, num_pixels_thresh=num_pixels_thresh,
+        image_edges_weight=float(image_edges_weight),
+        recon_false_edges=recon_false_edges, border_false_edges=border_false_edges,
+        dist_func=('abs' if dist_func == tf.abs else 'square'),
+        conflict_resolution=conflict_resolution)
+    return tf.reshape(edges_next, shape), tf.reshape(false_edges, shape), tf.reshape(true_edges, shape)
+
 def update_edges_soft(errors_prev, false_edges, true_edges, conflict_resolution='unchanged', edge_memory=0.5, **kwargs):
     '''
     errors_prev: in range (0,1)
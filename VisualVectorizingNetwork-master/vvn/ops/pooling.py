@@ -16,29 +16,58 @@ from .graphical import *
 lp = tf.load_op_library('../ops/src/tf_labelprop.so')
 lpfc = tf.load_op_library('../ops/src/tf_labelprop_fc.so')
 hung = tf.load_op_library('../ops/src/hungarian.so')
+hg = tf.load_op_library('../ops/src/tf_hierarchical_grouping.so')
+trk = tf.load_op_library('../ops/src/tf_segment_tracker.so')
 from .tf_nndistance import * # chamfer/nn distances
 
 PRINT = False
 
-def compute_segments_by_label_prop(edges, size, num_steps=10, defensive=False, synchronous=False, mode='index'):
+def compute_segments_by_label_prop(edges, size, num_steps=10, defensive=False, synchronous=False, mode='index', k=None, tile_size=0,
+                                   return_segment_pixels=False, max_segments=0, debug_stats=False, seed=0):
     '''
     This is the wrapper for the LabelProp C++ op.
     Computes unique labels for each feature vector in a [B,H,W,C] tensor.
 
     Inputs
     edges: [B,HW,(2k+1)**2] <tf.bool> tensor of edges in a [(2k+1),(2k+1)]
-                                      neighborhood of each feature in h,w space
+                                      neighborhood of each feature in h,w space,
+           or [B,HW] or [B,H,W] <tf.uint32/tf.uint64> edges packed by pack_stencil_edges, which only the
+           asynchronous LabelProp op takes
     size: [2] <tf.int32> of [H,W]
     num_steps: int, number of steps to run the label prop algorithm for per example
+    k: int, stencil half width, required for packed edges
+    tile_size: int, if > 0 run asynchronous LP in parallel tile_size x tile_size tiles; ~128 suits 1-4 megapixel frames
+    return_segment_pixels: bool, also return the pixels of each segment in CSR form (asynchronous LP only)
+    max_segments: int, if > 0 merge each example's smallest segments into their most connected neighbor until
+                  at most max_segments remain, e.g. the Nmax of downstream [B,Nmax,C] buffers (asynchronous LP only)
+    debug_stats: bool, also return per-example timings and label changes per sweep (asynchronous LP only)
+    seed: int, if nonzero the sweep orders of asynchronous LP are shuffled from it, giving the same labels on every run
 
     Outputs
     labels: [B,HW] <tf.int32> segment ids numbered 0 through (num_segments).sum(). Really should be thought of as a
                    single [BHW]-length vector, as segment ids increase over examples.
     num_segments: [B] <tf.int32> the number of segments in each example.
+    if return_segment_pixels:
+    segment_offsets: [(num_segments).sum()+1] <tf.int32> segment s is pixel_indices[segment_offsets[s]:segment_offsets[s+1]]
+    pixel_indices: [BHW] <tf.int32> flat indices into the [BHW] labels, grouped by segment and increasing within each
+    if debug_stats:
+    debug: [B,5+num_steps] <tf.float32> total, graph building, propagation and relabeling seconds, sweeps run,
+                                        then the number of labels changed by each sweep
 
     '''
     shape = edges.shape.as_list()
+    if edges.dtype in [tf.uint32, tf.uint64]:
+        assert k is not None, "packed edges require the stencil half width k"
+        assert not synchronous, "packed edges need the asynchronous LabelProp op, so synchronous and mode don't apply"
+        B = shape[0]
+        outputs = lp.label_prop(tf.reshape(edges, [B,-1]), size, num_steps=num_steps, defensive=defensive, k=k, tile_size=tile_size,
+                                segment_pixels=return_segment_pixels, max_segments=max_segments, debug_stats=debug_stats,
+                                seed=seed)
+        outputs = list(outputs[:4] if return_segment_pixels else outputs[:2]) + ([outputs[4]] if debug_stats else [])
+        return tuple(outputs)
+
     if synchronous:
+        assert not (return_segment_pixels or max_segments or debug_stats), "segment pixels, max_segments and debug_stats need the asynchronous LabelProp op"
         print("synchronous image LP")
         if len(shape) == 3:
             B,N,K = edges.shape.as_list()
@@ -50,18 +79,179 @@ def compute_segments_by_label_prop(edges, size, num_steps=10, defensive=False, s
         print("Asynchronous image LP")
         if len(shape) == 4:
             B,H,W,K = edges.shape.as_list()
-            segment_ids, num_segments = lp.label_prop(tf.reshape(edges, [B,H*W,K]), size, num_steps=num_steps, defensive=defensive)
-        elif len(shape) == 3:
-            segment_ids, num_segments = lp.label_prop(edges, size, num_steps=num_steps, defensive=defensive)
+            edges = tf.reshape(edges, [B,H*W,K])
+        outputs = lp.label_prop(edges, size, num_steps=num_steps, defensive=defensive, tile_size=tile_size,
+                                segment_pixels=return_segment_pixels, max_segments=max_segments, debug_stats=debug_stats,
+                                seed=seed)
+        if return_segment_pixels or debug_stats:
+            outputs = list(outputs[:4] if return_segment_pixels else outputs[:2]) + ([outputs[4]] if debug_stats else [])
+            return tuple(outputs)
+        segment_ids, num_segments = outputs[:2]
 
     return segment_ids, num_segments
 
-def labelprop_fc(num_nodes_per_ex, edges_list, num_steps=5, sort_edges=True):
+def pack_stencil_edges(edges, dtype=tf.uint64):
+    '''
+    Packs the [(2k+1),(2k+1)] stencil edges of each feature into the bits of one integer,
+    bit e set where edges[...,e] is true. (2k+1)**2 must fit in dtype, i.e. k <= 2 for tf.uint32
+    and k <= 3 for tf.uint64.
+
+    Inputs
+    edges: [B,HW,(2k+1)**2] or [B,H,W,(2k+1)**2] <tf.bool>
+    dtype: tf.uint32 or tf.uint64
+
+    Outputs
+    packed_edges: [B,HW] <dtype>
+    '''
+    shape = edges.shape.as_list()
+    if len(shape) == 4:
+        B,H,W,K = shape
+        edges = tf.reshape(edges, [B,H*W,K])
+    return lp.pack_stencil_edges(edges, out_type=dtype)
+
+def compute_segments_by_soft_label_prop(affinities, size, num_steps=10, min_affinity=0.0, method='labelprop', scale=1.0, min_size=0,
+                                        seed=0):
+    '''
+    This is the wrapper for the LabelPropSoft C++ op.
+    Like compute_segments_by_label_prop, but each neighbor votes for its label with its affinity.
+
+    Inputs
+    affinities: [B,HW,(2k+1)**2] or [B,H,W,(2k+1)**2] <tf.float32> nonnegative affinities in a [(2k+1),(2k+1)]
+                neighborhood of each feature in h,w space, e.g. from compute_adjacency_from_features(metric=euclidean_affinity)
+    size: [2] <tf.int32> of [H,W]
+    num_steps: int, number of steps to run the label prop algorithm for per example
+    min_affinity: float, affinities below this don't vote
+    method: 'labelprop' or 'felzenszwalb', the latter merges segments deterministically along edges of weight 1 - affinity
+    scale: float, felzenszwalb only; larger values give larger segments
+    min_size: int, felzenszwalb only; smaller segments are merged into a neighbor
+    seed: int, labelprop only; if nonzero the sweep orders are shuffled from it as in compute_segments_by_label_prop
+
+    Outputs
+    labels: [B,HW] <tf.int32> segment ids numbered 0 through (num_segments).sum()
+    num_segments: [B] <tf.int32> the number of segments in each example.
+    '''
+    shape = affinities.shape.as_list()
+    if len(shape) == 4:
+        B,H,W,K = shape
+        affinities = tf.reshape(affinities, [B,H*W,K])
+    segment_ids, num_segments = lp.label_prop_soft(tf.cast(affinities, tf.float32), size, num_steps=num_steps, min_affinity=float(min_affinity),
+                                                   method=method, scale=float(scale), min_size=min_size, seed=seed)
+    return segment_ids, num_segments
+
+def compute_segments_by_label_prop_3d(edges, size, num_steps=10, kt=1, defensive=False, seed=0):
+    '''
+    This is the wrapper for the LabelProp3D C++ op.
+    Computes labels that are consistent over time for each feature vector in a [B,T,H,W,C] tensor.
+
+    Inputs
+    edges: [B,THW,(2kt+1)*(2k+1)**2] or [B,T,H,W,(2kt+1)*(2k+1)**2] <tf.bool> tensor of edges in a
+           (2kt+1)x(2k+1)x(2k+1) neighborhood of each feature in t,h,w space
+    size: [3] <tf.int32> of [T,H,W]
+    num_steps: int, number of steps to run the label prop algorithm for per example
+    kt: int, temporal half width of the neighborhood
+    seed: int, if nonzero the sweep orders are shuffled from it as in compute_segments_by_label_prop
+
+    Outputs
+    labels: [B,THW] <tf.int32> segment ids numbered 0 through (num_segments).sum(), the same for a segment in every frame
+    num_segments: [B] <tf.int32> the number of segments in each example.
+    '''
+    shape = edges.shape.as_list()
+    if len(shape) == 5:
+        B,T,H,W,K = shape
+        edges = tf.reshape(edges, [B,T*H*W,K])
+    segment_ids, num_segments = lp.label_prop3d(edges, size, num_steps=num_steps, kt=kt, defensive=defensive, seed=seed)
+    return segment_ids, num_segments
+
+def track_segments(labels, num_segments, reset, iou_thresh=0.5, shared_name=None):
+    '''
+    This is the wrapper for the TrackSegments C++ op.
+    Gives the segments of consecutive frames temporally stable ids, by matching each frame's segments to the
+    previous frame's tracks by pixel overlap IoU. The state is kept across session.run calls; each example is
+    its own stream.
+
+    Inputs
+    labels: [B,HW] or [B,H,W] <tf.int32> segment ids from compute_segments_by_label_prop for the current frame
+    num_segments: [B] <tf.int32>
+    reset: scalar <tf.bool>, True on the first frame of new streams
+    iou_thresh: float, min IoU for a segment to continue a track
+    shared_name: str, name under which ops share the tracker state; if None each op has its own
+
+    Outputs
+    track_ids: [B,HW] <tf.int32> track of each pixel, in [0,num_tracks[b])
+    segment_tracks: [(num_segments).sum()] <tf.int32> track of each label
+    num_tracks: [B] <tf.int32> tracks started so far in each stream
+    '''
+    B = labels.shape.as_list()[0]
+    return trk.track_segments(tf.reshape(labels, [B,-1]), num_segments, tf.cast(reset, tf.bool),
+                              iou_thresh=float(iou_thresh), shared_name=(shared_name or ''))
+
+def segment_adjacency(segment_ids, num_segments, edges, size):
+    '''
+    This is the wrapper for the SegmentAdjacency C++ op.
+    Builds the region adjacency graph of the segments output by LabelProp.
+
+    Inputs
+    segment_ids: [B,HW] <tf.int32> labels output by compute_segments_by_label_prop
+    num_segments: [B] <tf.int32> output by compute_segments_by_label_prop
+    edges: [B,HW,(2k+1)**2] or [B,H,W,(2k+1)**2] <tf.bool> the edges LabelProp was run on
+    size: [2] <tf.int32> of [H,W]
+
+    Outputs
+    rag_edges: [E,3] <tf.int32> (example_idx, Lnode_idx, Rnode_idx) in both directions, ready for labelprop_fc
+    rag_offsets: [sum(num_segments)+1] <tf.int32> CSR offsets of each segment's edges
+    boundary_counts: [E] <tf.int32> number of neighbouring pixel pairs between the segments
+    edge_agreement: [E] <tf.float32> fraction of those pairs' stencil edges that are on
+    '''
+    shape = edges.shape.as_list()
+    if len(shape) == 4:
+        B,H,W,K = shape
+        edges = tf.reshape(edges, [B,H*W,K])
+    return lp.segment_adjacency(segment_ids, num_segments, edges, size)
+
+def hierarchical_grouping(features, pixel_max_nodes, levels, k=1, pixel_num_steps=10, pixel_thresh_scale=1.0, seed=0):
+    '''
+    This is the wrapper for the HierarchicalGrouping C++ op.
+    Runs pixel-level LabelProp and then len(levels) levels of LabelPropFc with mean pooling in between,
+    all in one op.
+
+    Inputs
+    features: [B,H,W,C] <tf.float32> base features
+    pixel_max_nodes: int, Nmax of the pixel-level segments
+    levels: list of dicts with keys
+            'num_steps': int, LabelPropFc steps
+            'thresh_scale': float, edges are where dists2 < thresh_scale * mean(dists2) as in euclidean_dist2_fc
+            'max_nodes': int, Nmax of the level
+    k: int, half width of the pixel stencil
+    pixel_num_steps: int, LabelProp steps on the pixels
+    pixel_thresh_scale: float, scales the euclidean_dist2 pixel threshold
+    seed: int, if nonzero every level's labelprop is shuffled from it as in compute_segments_by_label_prop
+
+    Outputs
+    segment_ids: [B,H,W] <tf.int32> level 0 node of each pixel, in [0,pixel_max_nodes)
+    nodes: list of [B,Nmax_l,C+1] <tf.float32> pooled features and a valid flag, level 0 first
+    parent_idxs: list of [B,Nmax_{l-1}] <tf.int32> parent of each node at the next level
+    num_nodes: [B,len(levels)+1] <tf.int32> valid nodes per level
+    '''
+    assert len(levels) >= 1
+    segment_ids, pixel_nodes, nodes, parent_idxs, num_nodes = hg.hierarchical_grouping(
+        features,
+        L=len(levels), k=k, pixel_num_steps=pixel_num_steps, pixel_thresh_scale=float(pixel_thresh_scale),
+        pixel_max_nodes=pixel_max_nodes,
+        num_steps=[lev['num_steps'] for lev in levels],
+        thresh_scales=[float(lev['thresh_scale']) for lev in levels],
+        max_nodes=[lev['max_nodes'] for lev in levels],
+        seed=seed)
+    return segment_ids, [pixel_nodes] + list(nodes), list(parent_idxs), num_nodes
+
+def labelprop_fc(num_nodes_per_ex, edges_list, num_steps=5, sort_edges=True, max_segments=0, debug_stats=False, seed=0):
 
     assert len(num_nodes_per_ex.shape.as_list()) == 1
     assert edges_list.shape.as_list()[1] == 3
 
-    labels, num_segments = lpfc.label_prop_fc(num_nodes_per_ex, edges_list, num_steps=num_steps, sort_edges=sort_edges)
+    labels, num_segments, debug = lpfc.label_prop_fc(num_nodes_per_ex, edges_list, num_steps=num_steps, sort_edges=sort_edges,
+                                                     max_segments=max_segments, debug_stats=debug_stats, seed=seed)
+    if debug_stats:
+        return labels, num_segments, debug # debug: [B,5+num_steps] as for compute_segments_by_label_prop
     return labels, num_segments
 
 def labelprop_fc_sync(valid_nodes, edges, num_steps=10, noise=0.001, seed=0, tau=0.0, labels_init=None):
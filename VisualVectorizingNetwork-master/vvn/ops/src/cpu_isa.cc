@@ -0,0 +1,48 @@
+#include "cpu_isa.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+static CpuIsa supportedIsa(){
+#ifdef VVN_MULTIVERSION
+    __builtin_cpu_init();
+    bool avx2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") && __builtin_cpu_supports("bmi2");
+    if (avx2 && __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vl") &&
+	__builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("avx512dq"))
+	return CPU_ISA_AVX512;
+    if (avx2)
+	return CPU_ISA_AVX2;
+#endif
+    return CPU_ISA_BASELINE;
+}
+
+static CpuIsa selectIsa(){
+    CpuIsa supported = supportedIsa();
+    const char *name = std::getenv("VVN_ISA");
+    if (name == NULL || *name == '\0')
+	return supported;
+    for (int isa=CPU_ISA_BASELINE; isa<=CPU_ISA_AVX512; isa++){
+	if (std::strcmp(name, cpuIsaName(CpuIsa(isa))) != 0)
+	    continue;
+	if (isa > supported){
+	    fprintf(stderr, "VVN_ISA=%s is not supported by this CPU, using %s\n", name, cpuIsaName(supported));
+	    return supported;
+	}
+	return CpuIsa(isa);
+    }
+    fprintf(stderr, "VVN_ISA=%s is not one of baseline, avx2 or avx512, using %s\n", name, cpuIsaName(supported));
+    return supported;
+}
+
+CpuIsa cpuIsa(){
+    static const CpuIsa isa = selectIsa();
+    return isa;
+}
+
+const char *cpuIsaName(CpuIsa isa){
+    switch (isa){
+    case CPU_ISA_AVX2: return "avx2";
+    case CPU_ISA_AVX512: return "avx512";
+    default: return "baseline";
+    }
+}
@@ -0,0 +1,37 @@
+// Instruction set levels that the hot loops of graphs.cc and nndistance.cc are
+// compiled for, in increasing order. Every level's clone of a loop is built
+// into the same library with target attributes, so no -m flags are needed,
+// and a table of kernels picks one when the library is loaded.
+enum CpuIsa
+{
+    CPU_ISA_BASELINE = 0, // the build target, SSE2 on x86-64
+    CPU_ISA_AVX2 = 1, // AVX2, FMA and BMI2 (Haswell and later)
+    CPU_ISA_AVX512 = 2 // AVX-512 F, VL, BW and DQ (Skylake-SP, Ice Lake)
+};
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define VVN_MULTIVERSION 1
+#define VVN_TARGET_AVX2 __attribute__((target("avx2,fma,bmi,bmi2,popcnt")))
+#define VVN_TARGET_AVX512 __attribute__((target("avx512f,avx512vl,avx512bw,avx512dq,avx2,fma,bmi,bmi2,popcnt")))
+
+// float and int vectors of L lanes, 8 for the AVX2 clones and 16 for the
+// AVX-512 ones; vector_size can't depend on a template argument
+template <int L> struct Lanes;
+template <> struct Lanes<8>
+{
+    typedef float floatv __attribute__((vector_size(32)));
+    typedef int intv __attribute__((vector_size(32)));
+};
+template <> struct Lanes<16>
+{
+    typedef float floatv __attribute__((vector_size(64)));
+    typedef int intv __attribute__((vector_size(64)));
+};
+#endif
+
+// The level the kernels run at: the highest this CPU supports, or the one
+// named by the VVN_ISA environment variable (baseline, avx2 or avx512) if it
+// is set and supported. Read once per library, when its ops are registered, so
+// set VVN_ISA before loading them.
+CpuIsa cpuIsa();
+const char *cpuIsaName(CpuIsa isa);
@@ -0,0 +1,408 @@
+#include "graphs.h"
+#include "nndistance.h"
+#include "cpu_isa.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <new>
+#include <random>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+// Benchmarks the CPU graph and distance kernels without TensorFlow. Every
+// configuration runs one independent instance per thread for each thread
+// count, keeps the fastest of reps runs, and is printed as one JSON object
+// in a JSON array on stdout:
+//     {"bench": ..., "params": {...}, "threads": T, "seconds": s,
+//      "throughput": x, "unit": "nodes/s" | "pairs/s", "allocs": a, "isa": i}
+// where throughput counts the work of all T instances and allocs is the
+// number of operator new calls per instance in the last rep. Each thread
+// reuses one GraphScratch or nnsearch scratch across reps, as the kernels do
+// across calls, so that counts steady-state allocations. isa is the level the
+// kernels were dispatched to; run with VVN_ISA=baseline, avx2 or avx512 to
+// compare them.
+//
+// With --verify, nothing is timed: labelprop is checked to give the same
+// labels from bool, packed, tabled and tabled packed edges, then the kernels'
+// outputs on fixed inputs and seeds are digested at every level this CPU
+// supports, each in a run of this executable under VVN_ISA. The exit status
+// is nonzero unless all match.
+//
+// usage: graph_benchmarks [--quick] [--threads=1,2,4] [--reps=3] | --verify
+
+static thread_local long long num_allocs = 0; // by this thread
+
+void *operator new(size_t size){
+    num_allocs++;
+    void *p = std::malloc(size ? size : 1);
+    if (!p)
+	throw std::bad_alloc();
+    return p;
+}
+
+void operator delete(void *p) noexcept {
+    std::free(p);
+}
+
+struct BenchResult
+{
+    double seconds; // wall time of the fastest run
+    long long allocs; // per instance
+};
+
+// runs work(thread) on each of threads threads at once, reps times
+static BenchResult runThreads(int threads, int reps, const std::function<void(int)> &work){
+    BenchResult result = {0.0, 0};
+    for (int r=0; r<reps; r++){
+	std::atomic<long long> allocs(0);
+	auto start = std::chrono::steady_clock::now();
+	std::vector<std::thread> pool;
+	for (int t=0; t<threads; t++)
+	    pool.push_back(std::thread([&](int t){
+			long long allocs_before = num_allocs;
+			work(t);
+			allocs += num_allocs - allocs_before;
+		    }, t));
+	for (size_t t=0; t<pool.size(); t++)
+	    pool[t].join();
+	auto end = std::chrono::steady_clock::now();
+	double seconds = std::chrono::duration<double>(end - start).count();
+	if (r == 0 || seconds < result.seconds)
+	    result.seconds = seconds;
+	result.allocs = allocs / threads;
+    }
+    return result;
+}
+
+static bool first_record = true;
+
+static void printRecord(const std::string &bench, const std::vector<std::pair<std::string,long long> > &params,
+			int threads, const BenchResult &result, double work_per_thread, const char *unit){
+    printf("%s\n  {\"bench\": \"%s\", \"params\": {", first_record ? "[" : ",", bench.c_str());
+    for (size_t i=0; i<params.size(); i++)
+	printf("%s\"%s\": %lld", i ? ", " : "", params[i].first.c_str(), params[i].second);
+    printf("}, \"threads\": %d, \"seconds\": %.6g, \"throughput\": %.6g, \"unit\": \"%s\", \"allocs\": %lld, \"isa\": \"%s\"}",
+	   threads, result.seconds, work_per_thread*threads / std::max(result.seconds, 1e-9), unit, result.allocs, cpuIsaName(cpuIsa()));
+    fflush(stdout);
+    first_record = false;
+}
+
+static void benchPixGraph(bool quick, const std::vector<int> &thread_counts, int reps){
+    std::vector<int> sizes = quick ? std::vector<int>{64} : std::vector<int>{64, 128, 256};
+    std::vector<int> radii = quick ? std::vector<int>{1} : std::vector<int>{1, 2, 3};
+    std::vector<int> step_counts = quick ? std::vector<int>{5} : std::vector<int>{5, 10};
+    for (int size : sizes)
+	for (int k : radii)
+	    for (int num_steps : step_counts)
+		for (int defensive=0; defensive<2; defensive++)
+		    for (int topology=0; topology<2; topology++){
+			int H = size; int W = size; int K = (2*k + 1)*(2*k + 1);
+			std::unique_ptr<bool[]> A(new bool[H*W*K]);
+			std::mt19937 rng(0);
+			for (int i=0; i<H*W*K; i++)
+			    A[i] = (rng() % 10) < 7;
+			StencilTopology topo(H, W, k);
+			for (int threads : thread_counts){
+			    std::vector<GraphScratch> scratches(threads);
+			    auto sweep = [&](PixGraph &G){
+				for (int n=0; n<num_steps; n++)
+				    G.labelPropStep(defensive);
+				G.setNumLabels(true, true, 0);
+			    };
+			    BenchResult result = runThreads(threads, reps, [&](int t){
+				    if (topology){
+					PixGraph G(topo, A.get(), &scratches[t]);
+					sweep(G);
+				    }
+				    else{
+					PixGraph G(H, W, k, A.get(), &scratches[t]);
+					sweep(G);
+				    }
+				});
+			    printRecord("pixgraph_labelprop", {{"H", H}, {"W", W}, {"k", k}, {"steps", num_steps},
+					{"defensive", defensive}, {"topology", topology}},
+				threads, result, double(H)*W*num_steps, "nodes/s");
+			}
+		    }
+}
+
+static void benchGraph(bool quick, const std::vector<int> &thread_counts, int reps){
+    std::vector<int> node_counts = quick ? std::vector<int>{1000} : std::vector<int>{1000, 10000, 100000};
+    std::vector<int> degrees = quick ? std::vector<int>{4} : std::vector<int>{4, 16};
+    int num_steps = 5;
+    for (int V : node_counts)
+	for (int degree : degrees){
+	    std::vector<int> senders(V*degree); std::vector<int> receivers(V*degree);
+	    std::mt19937 rng(0);
+	    for (int e=0; e<V*degree; e++){
+		senders[e] = e / degree;
+		receivers[e] = rng() % V;
+	    }
+	    for (int threads : thread_counts){
+		std::vector<GraphScratch> scratches(threads);
+		BenchResult result = runThreads(threads, reps, [&](int t){
+			Graph G(V, true, &scratches[t]);
+			for (int e=0; e<V*degree; e++)
+			    G.addEdge(senders[e], receivers[e]);
+			for (int n=0; n<num_steps; n++)
+			    G.labelPropStep(false);
+			G.setNumLabels(true, 0);
+		    });
+		printRecord("graph_labelprop", {{"nodes", V}, {"edges", (long long)V*degree}, {"steps", num_steps}},
+			    threads, result, double(V)*num_steps, "nodes/s");
+	    }
+	}
+}
+
+static void benchConnectedComponents(bool quick, const std::vector<int> &thread_counts, int reps){
+    std::vector<int> node_counts = quick ? std::vector<int>{256} : std::vector<int>{256, 1024, 4096};
+    for (int N : node_counts){
+	// sparse enough to leave many components, as with particle graphs
+	std::unique_ptr<bool[]> edges(new bool[(long long)N*N]);
+	std::mt19937 rng(0);
+	for (long long i=0; i<(long long)N*N; i++)
+	    edges[i] = (rng() % N) < 2;
+	for (int threads : thread_counts){
+	    std::vector<GraphScratch> scratches(threads);
+	    std::vector<std::vector<char> > visited(threads, std::vector<char>(N));
+	    BenchResult result = runThreads(threads, reps, [&](int t){
+		    // as ccsearch does for one example
+		    std::fill(visited[t].begin(), visited[t].end(), false);
+		    Graph G(N, false, &scratches[t]);
+		    for (int v=0; v<N; v++)
+			for (int w=0; w<=v; w++)
+			    if (edges[(long long)v*N + w])
+				G.addEdge(v, w);
+		    G.connectedComponents(reinterpret_cast<bool*>(visited[t].data()));
+		});
+	    printRecord("connected_components", {{"N", N}}, threads, result, double(N)*N, "pairs/s");
+	}
+    }
+}
+
+static void benchNnDistance(bool quick, const std::vector<int> &thread_counts, int reps){
+    std::vector<std::vector<int> > shapes = quick ? std::vector<std::vector<int> >{{1024, 1024, 3}} :
+	std::vector<std::vector<int> >{{1024, 1024, 3}, {4096, 4096, 3}, {1024, 1024, 6}, {1024, 1024, 12}};
+    for (const std::vector<int> &shape : shapes){
+	int n = shape[0]; int m = shape[1]; int D = shape[2];
+	std::vector<float> xyz1(n*D); std::vector<float> xyz2(m*D);
+	std::mt19937 rng(0);
+	std::uniform_real_distribution<float> uniform(-1.0f, 1.0f);
+	for (float &x : xyz1) x = uniform(rng);
+	for (float &x : xyz2) x = uniform(rng);
+	for (int threads : thread_counts){
+	    std::vector<std::vector<float> > dists(threads, std::vector<float>(n));
+	    std::vector<std::vector<int> > idxs(threads, std::vector<int>(n));
+	    std::vector<std::vector<float> > scratches(threads);
+	    BenchResult result = runThreads(threads, reps, [&](int t){
+		    nnsearch(1, n, m, D, xyz1.data(), xyz2.data(), dists[t].data(), idxs[t].data(), &scratches[t]);
+		});
+	    printRecord("nndistance", {{"n", n}, {"m", m}, {"D", D}}, threads, result, double(n)*m, "pairs/s");
+	}
+    }
+}
+
+// FNV-1a over bytes, continuing from h
+static uint64_t digestBytes(uint64_t h, const void *data, size_t bytes){
+    const unsigned char *c = static_cast<const unsigned char*>(data);
+    for (size_t i=0; i<bytes; i++)
+	h = (h ^ c[i])*0x100000001b3ull;
+    return h;
+}
+
+template <typename T>
+static uint64_t digestVector(uint64_t h, const std::vector<T> &v){
+    return digestBytes(h, v.data(), v.size()*sizeof(T));
+}
+
+// stencil edges of B examples as bools, each kept with probability 0.7
+static std::vector<char> randomStencilEdges(int B, int H, int W, int k, unsigned seed){
+    int K = (2*k + 1)*(2*k + 1);
+    std::vector<char> edges(size_t(B)*H*W*K);
+    std::mt19937 rng(seed);
+    for (char &e : edges)
+	e = (rng() % 10) < 7;
+    return edges;
+}
+
+// the same edges packed as PackStencilEdges does
+static std::vector<uint64_t> packStencilEdges(const std::vector<char> &edges, int K){
+    std::vector<uint64_t> masks(edges.size() / K);
+    for (size_t i=0; i<masks.size(); i++)
+	for (int e=0; e<K; e++)
+	    masks[i] |= uint64_t(edges[i*K + e] != 0) << e;
+    return masks;
+}
+
+// labels and num_segments of assignLabels on edges in one of the forms the
+// drivers take: bools or packed masks, with or without stencil tables
+static std::vector<int> labelPropOutputs(int B, int H, int W, int k, bool defensive, bool packed, bool tables,
+					 const std::vector<char> &edges, unsigned seed){
+    int K = (2*k + 1)*(2*k + 1);
+    std::vector<int> outputs(size_t(B)*H*W + B);
+    int *labels = outputs.data(); int *num_segments = &outputs[size_t(B)*H*W];
+    StencilTopology topo(H, W, k);
+    const StencilTopology *topology = tables ? &topo : NULL;
+    if (packed){
+	std::vector<uint64_t> masks = packStencilEdges(edges, K);
+	assignLabels(B, H, W, k, 5, defensive, topology, masks.data(), labels, num_segments, seed);
+    }
+    else
+	assignLabels(B, H, W, k, 5, defensive, topology, reinterpret_cast<const bool*>(edges.data()), labels, num_segments, seed);
+    return outputs;
+}
+
+// Digest of the outputs of every kernel that is dispatched by level, on fixed
+// inputs and seeds: labelprop in each edge form, fc labelprop, and nn
+// distances with NaN coordinates mixed in.
+static uint64_t kernelDigest(){
+    uint64_t h = 0xcbf29ce484222325ull;
+    int B = 2; int H = 40; int W = 48;
+    for (int k=1; k<=3; k++){
+	std::vector<char> edges = randomStencilEdges(B, H, W, k, k);
+	for (int defensive=0; defensive<2; defensive++)
+	    for (int form=0; form<4; form++)
+		h = digestVector(h, labelPropOutputs(B, H, W, k, defensive, form & 1, form & 2, edges, 1234));
+    }
+
+    int V = 500; int E = 4*V;
+    std::vector<int> num_nodes(B, V); std::vector<int> fc_edges(size_t(B)*E*3);
+    std::mt19937 rng(0);
+    for (int e=0; e<B*E; e++){
+	fc_edges[e*3] = e / E;
+	fc_edges[e*3 + 1] = (e % E) / 4;
+	fc_edges[e*3 + 2] = rng() % V;
+    }
+    std::vector<int> fc_outputs(B*V + B);
+    assignLabelsFC(B, B*E, num_nodes.data(), fc_edges.data(), fc_outputs.data(), &fc_outputs[B*V], 5, false, 1234);
+    h = digestVector(h, fc_outputs);
+
+    std::uniform_real_distribution<float> uniform(-1.0f, 1.0f);
+    std::vector<std::vector<int> > shapes = {{2, 100, 37, 3}, {1, 64, 1000, 6}, {3, 33, 17, 12}, {1, 10, 16, 1}, {1, 5, 3, 3}};
+    for (const std::vector<int> &shape : shapes){
+	int b = shape[0]; int n = shape[1]; int m = shape[2]; int D = shape[3];
+	std::vector<float> xyz1(size_t(b)*n*D); std::vector<float> xyz2(size_t(b)*m*D);
+	for (float &x : xyz1) x = uniform(rng);
+	for (float &x : xyz2) x = std::round(4*uniform(rng)) / 4; // quantized for ties
+	for (size_t i=0; i<xyz2.size(); i+=5*D)
+	    xyz2[i] = NAN;
+	xyz1[std::min(3*D, n*D - 1)] = NAN;
+	std::vector<float> dist(size_t(b)*n); std::vector<int> idx(size_t(b)*n);
+	nnsearch(b, n, m, D, xyz1.data(), xyz2.data(), dist.data(), idx.data());
+	h = digestVector(digestVector(h, dist), idx);
+    }
+    return h;
+}
+
+// checks that every edge form gives the bool form's labels for k=1..3 with
+// defensive off and on; returns the number that differ
+static int verifyEdgeForms(){
+    const char *form_names[] = {"bool", "packed", "tables", "tables+packed"};
+    int B = 2; int H = 40; int W = 48;
+    int mismatches = 0;
+    for (int k=1; k<=3; k++){
+	std::vector<char> edges = randomStencilEdges(B, H, W, k, k);
+	for (int defensive=0; defensive<2; defensive++){
+	    std::vector<int> expected = labelPropOutputs(B, H, W, k, defensive, false, false, edges, 1234);
+	    for (int form=1; form<4; form++){
+		if (labelPropOutputs(B, H, W, k, defensive, form & 1, form & 2, edges, 1234) == expected)
+		    continue;
+		printf("edge forms: k=%d defensive=%d %s labels DIFFER from bool\n", k, defensive, form_names[form]);
+		mismatches++;
+	    }
+	}
+    }
+    if (mismatches == 0)
+	printf("edge forms: bool, packed, tables and tables+packed agree for k=1..3, defensive off and on\n");
+    return mismatches;
+}
+
+// runs this executable with --digest under each level and compares their
+// digests to the baseline's; returns the number that differ or failed
+static int verifyLevels(){
+    char self[4096];
+    ssize_t len = readlink("/proc/self/exe", self, sizeof(self) - 1);
+    if (len <= 0){
+	fprintf(stderr, "graph_benchmarks: cannot find this executable to rerun it\n");
+	return 1;
+    }
+    self[len] = '\0';
+    std::string baseline;
+    int mismatches = 0;
+    for (int isa=CPU_ISA_BASELINE; isa<=CPU_ISA_AVX512; isa++){
+	const char *name = cpuIsaName(CpuIsa(isa));
+	std::string command = std::string("VVN_ISA=") + name + " '" + self + "' --digest 2>/dev/null";
+	FILE *child = popen(command.c_str(), "r");
+	char ran[32] = ""; char digest[32] = "";
+	bool read = child && fscanf(child, "%31s %31s", ran, digest) == 2;
+	if (child)
+	    pclose(child);
+	if (!read){
+	    printf("%s: failed to run\n", name);
+	    mismatches++;
+	}
+	else if (std::strcmp(ran, name) != 0)
+	    printf("%s: not supported by this CPU, skipped\n", name);
+	else if (isa == CPU_ISA_BASELINE){
+	    baseline = digest;
+	    printf("%s: %s\n", name, digest);
+	}
+	else{
+	    bool match = (baseline == digest);
+	    printf("%s: %s %s\n", name, digest, match ? "matches baseline" : "DIFFERS from baseline");
+	    mismatches += !match;
+	}
+    }
+    return mismatches;
+}
+
+int main(int argc, char **argv){
+    bool quick = false;
+    int reps = 3;
+    std::vector<int> thread_counts;
+    for (int i=1; i<argc; i++){
+	std::string arg(argv[i]);
+	if (arg == "--quick")
+	    quick = true;
+	else if (arg == "--digest"){
+	    printf("%s %016llx\n", cpuIsaName(cpuIsa()), (unsigned long long)kernelDigest());
+	    return 0;
+	}
+	else if (arg == "--verify")
+	    return (verifyEdgeForms() + verifyLevels()) ? 1 : 0;
+	else if (arg.compare(0, 7, "--reps=") == 0)
+	    reps = std::max(1, std::atoi(arg.c_str() + 7));
+	else if (arg.compare(0, 10, "--threads=") == 0){
+	    for (const char *c=arg.c_str() + 10; *c; ){
+		thread_counts.push_back(std::max(1, std::atoi(c)));
+		while (*c && *c != ',') c++;
+		if (*c) c++;
+	    }
+	}
+	else{
+	    fprintf(stderr, "usage: %s [--quick] [--threads=1,2,4] [--reps=3] | --verify\n", argv[0]);
+	    return 1;
+	}
+    }
+    if (thread_counts.empty()){
+	// powers of two up to the hardware concurrency, and that
+	int max_threads = std::max(1u, std::thread::hardware_concurrency());
+	for (int t=1; t<max_threads; t*=2)
+	    thread_counts.push_back(t);
+	thread_counts.push_back(max_threads);
+    }
+
+    benchPixGraph(quick, thread_counts, reps);
+    benchGraph(quick, thread_counts, reps);
+    benchConnectedComponents(quick, thread_counts, reps);
+    benchNnDistance(quick, thread_counts, reps);
+    printf("%s\n]\n", first_record ? "[" : "");
+    return 0;
+}
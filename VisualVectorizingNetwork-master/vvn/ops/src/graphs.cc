@@ -1,19 +1,47 @@
 #include "graphs.h"
+#include "cpu_isa.h"
 #include "math.h"
 #include <algorithm>
 #include <bits/stdc++.h>
 #include <chrono>
+#include <cstring>
+#include <cstdint>
+#ifdef VVN_MULTIVERSION
+#include <immintrin.h>
+#endif
 
 using namespace std;
 
-int mostCommonElement(std::vector<int> vect){
+// grows buf to at least n elements, never shrinking it, and returns its data
+template <typename T>
+static T *growTo(std::vector<T> &buf, size_t n){
+    if (buf.size() < n)
+	buf.resize(n);
+    return buf.data();
+}
+
+std::unique_ptr<GraphScratch> ScratchPool::acquire(){
+    std::lock_guard<std::mutex> l(mu);
+    if (idle.empty())
+	return std::unique_ptr<GraphScratch>(new GraphScratch());
+    std::unique_ptr<GraphScratch> scratch = std::move(idle.back());
+    idle.pop_back();
+    return scratch;
+}
 
-    // sort vector
-    std::sort(vect.begin(), vect.end());
+void ScratchPool::release(std::unique_ptr<GraphScratch> scratch){
+    std::lock_guard<std::mutex> l(mu);
+    idle.push_back(std::move(scratch));
+}
+
+static int mostCommonSorted(int *votes, int n){
+
+    // sort votes in place
+    std::sort(votes, votes+n);
 
     int mode = -1; int max_count = 0; int count = 0;
-    int current = *vect.begin();
-    for (std::vector<int>::iterator w=vect.begin(); w !=vect.end(); ++w){
+    int current = *votes;
+    for (int *w=votes; w!=votes+n; ++w){
 	if (*w == current){
 	    count++;
 	    if (count > max_count){
@@ -28,12 +56,80 @@ int mostCommonElement(std::vector<int> vect){
     return mode;
 }
 
-Graph::Graph(int v, bool labelprop=false)
-    : num_labels{v}, labelprop{labelprop}
+#ifdef VVN_MULTIVERSION
+static const int max_lane_votes = 128; // more votes than this are sorted
+
+// mostCommonSorted without the sort: counts each vote's copies with L votes
+// per compare. The sorted scan counts the run of the least vote in full and
+// every later run one short, and keeps the first (least) vote to reach the
+// most, so the counts are adjusted to match it.
+template <int L>
+static inline __attribute__((always_inline)) int mostCommonLanes(int *votes, int n){
+    typedef typename Lanes<L>::intv intv;
+    if (n > max_lane_votes)
+	return mostCommonSorted(votes, n);
+    int blocks = (n + L - 1) / L;
+    intv lanes[max_lane_votes / L]; intv counts[max_lane_votes / L];
+    lanes[blocks-1] = intv{}; // lanes past n are counted but never read
+    std::memcpy(lanes, votes, n*sizeof(int));
+    for (int j=0; j<blocks; j++)
+	counts[j] = intv{};
+    int least = votes[0];
+    for (int i=0; i<n; i++){
+	least = std::min(least, votes[i]);
+	for (int j=0; j<blocks; j++)
+	    counts[j] += (lanes[j] == votes[i]); // -1 where equal
+    }
+    int mode = -1; int max_count = -1;
+    for (int i=0; i<n; i++){
+	int count = -counts[i / L][i % L] - (votes[i] != least);
+	if (count > max_count || (count == max_count && votes[i] < mode)){
+	    max_count = count;
+	    mode = votes[i];
+	}
+    }
+    return mode;
+}
+
+VVN_TARGET_AVX2 static int mostCommonAvx2(int *votes, int n){
+    return mostCommonLanes<8>(votes, n);
+}
+
+VVN_TARGET_AVX512 static int mostCommonAvx512(int *votes, int n){
+    return mostCommonLanes<16>(votes, n);
+}
+#endif
+
+typedef int (*VoteKernel)(int*, int);
+
+static VoteKernel selectVoteKernel(CpuIsa isa){
+#ifdef VVN_MULTIVERSION
+    if (isa == CPU_ISA_AVX512)
+	return mostCommonAvx512;
+    if (isa == CPU_ISA_AVX2)
+	return mostCommonAvx2;
+#endif
+    return mostCommonSorted;
+}
+
+// picked when the library is loaded, along with the ops' registrations
+static const VoteKernel vote_kernel = selectVoteKernel(cpuIsa());
+
+// the most common element of vect, as mostCommonSorted counts them; may reorder vect
+int mostCommonElement(std::vector<int> &vect){
+    return vote_kernel(vect.data(), vect.size());
+}
+
+Graph::Graph(int v, bool labelprop=false, GraphScratch *scratch)
+    : labelprop{labelprop}, owned_scratch{scratch ? NULL : new GraphScratch()}
+    , scratch{scratch ? scratch : owned_scratch.get()}, num_labels{v}, cc_sizes(this->scratch->cc_sizes)
 {
     this->V = v;
-    this->adj = new std::vector<int>[v];
-    this->cc_ids = new int[v];
+    this->adj = growTo(this->scratch->lists, v);
+    for (int i=0; i<V; i++)
+	adj[i].clear(); // keeps their capacity
+    this->cc_ids = growTo(this->scratch->labels, v);
+    cc_sizes.clear();
     // initialization for labelprop
     if (labelprop){
 	// init labels and self-edges
@@ -42,7 +138,7 @@ Graph::Graph(int v, bool labelprop=false)
 	    adj[i].push_back(i);
 	}
 	// init order
-	this->order = new int[V];
+	this->order = growTo(this->scratch->order, V);
 	for (int i=0; i<V; i++)
 	    order[i] = i;
 
@@ -50,17 +146,11 @@ Graph::Graph(int v, bool labelprop=false)
     else{
 	for (int i=0; i<V; i++)
 	    cc_ids[i] = 0;
-	int cc_size_counter = 0;
-	std::vector<int> cc_sizes;
     }
 
 }
 
 Graph::~Graph(){
-    delete[] adj;
-    delete[] cc_ids;
-    if (labelprop)
-	delete[] order;
 }
 
 void Graph::addEdge(int v, int w){
@@ -86,8 +176,8 @@ void Graph::connectedComponents(bool visited[]){
 void Graph::DFSUtil(int v, bool visited[], int cc){
     visited[v] = true;
     cc_ids[v] = cc;
-    std::vector<int> connected_to_v = adj[v];
-    std::vector<int>::iterator w;
+    const std::vector<int> &connected_to_v = adj[v];
+    std::vector<int>::const_iterator w;
     for (w = connected_to_v.begin(); w != connected_to_v.end(); ++w){
 	if (!visited[*w]){
 	    cc_size_counter++;
@@ -96,34 +186,40 @@ void Graph::DFSUtil(int v, bool visited[], int cc){
     }
 }
 
-void Graph::labelPropStep(bool defensive=false){
+int Graph::labelPropStep(bool defensive=false){
     // shuffle the order
-    std::random_shuffle(&order[0], &order[V]);
+    std::shuffle(&order[0], &order[V], rng);
 
     // a step of asynchronous label propagation
-    int v; std::vector<int> v_edges;
+    int v;
+    std::vector<int> &labels_connected_to_v = scratch->votes;
+    int changes = 0;
     for (int i=0; i<V; i++){
 	v = order[i];
-	v_edges = adj[v]; // vector of connected nodes
-	std::vector<int> labels_connected_to_v;
-	std::vector<int>::iterator it;
+	const std::vector<int> &v_edges = adj[v]; // vector of connected nodes
+	labels_connected_to_v.clear();
+	std::vector<int>::const_iterator it;
 	for (it=v_edges.begin(); it!=v_edges.end(); ++it)
 	    labels_connected_to_v.push_back(cc_ids[*it]);
 
 	// update label
-	cc_ids[v] = mostCommonElement(labels_connected_to_v);
+	int label = mostCommonElement(labels_connected_to_v);
+	changes += (label != cc_ids[v]);
+	cc_ids[v] = label;
     }
+    return changes;
 }
 
 void Graph::setNumLabels(bool relabel=true,
 			 int offset=0){
     // set number of unique labels
     // optionally add an offset to each label value
-    std::vector<int> labels(cc_ids, cc_ids+V);
-    std::sort(labels.begin(), labels.end());
-    int lmap[V];
+    int *labels = growTo(scratch->sorted, V);
+    std::copy(cc_ids, cc_ids+V, labels);
+    std::sort(labels, labels+V);
+    int *lmap = growTo(scratch->lmap, V);
     int num_unique = 0; int elem = -1;
-    for (std::vector<int>::iterator it=labels.begin(); it!=labels.end(); ++it){
+    for (int *it=labels; it!=labels+V; ++it){
 	if (*it != elem){
 	    lmap[*it] = num_unique; // the new label
 	    num_unique++;
@@ -138,20 +234,43 @@ void Graph::setNumLabels(bool relabel=true,
     }
 }
 
-PixGraph::PixGraph(int H, int W, int k, const bool *A)
-    : H{H}, W{W}, N{(H*W)}, k{k}, ksize{(2*k+1)}, max_edges{(int(pow(2*k+1, 2)))}
-    , step_counter{0}, num_labels(this->N)
+PixGraph::PixGraph(int H, int W, int k, const bool *A, GraphScratch *scratch)
+    : PixGraph(1, H, W, k, 0, A, scratch)
+{
+}
+
+void PixGraph::useScratch(GraphScratch *scratch){
+    if (scratch == NULL){
+	owned_scratch.reset(new GraphScratch());
+	scratch = owned_scratch.get();
+    }
+    this->scratch = scratch;
+    this->V = growTo(scratch->labels, N);
+    this->order = growTo(scratch->order, N);
+    this->degrees = growTo(scratch->degrees, N);
+    this->num_nbrs = growTo(scratch->num_nbrs, N);
+    this->nbrs = (affinities == NULL) ? growTo(scratch->nbrs, size_t(N)*max_edges) : NULL;
+    // a defensive vote repeats each of up to max_edges labels by its degree
+    if (affinities == NULL)
+	scratch->votes.reserve(size_t(max_edges)*max_edges);
+}
+
+PixGraph::PixGraph(int T, int H, int W, int k, int kt, const bool *A, GraphScratch *scratch)
+    : T{T}, H{H}, W{W}, N{(T*H*W)}, k{k}, ksize{(2*k+1)}, kt{kt}, ktsize{(2*kt+1)}
+    , max_edges{(2*kt+1)*(int(pow(2*k+1, 2)))}
+    , step_counter{0}, affinities{NULL}, min_affinity{0.0f}, cand_labels{NULL}, cand_weights{NULL}
+    , num_labels(this->N)
 {
-    this->V = new int[N];
-    this->order = new int[N];
-    this->degrees = new int[N];
+    useScratch(scratch);
     for (int i=0; i<N; i++){
 	V[i] = i; // initialize labels to be unique
 	order[i] = i; // initial order (gets shuffled)
 	degrees[i] = 0; // before adding edges, all nodes have degree 0
+	num_nbrs[i] = 0;
     }
     // initialize edges from A; always have self edge
-    this->adj = new std::vector<int>[N];
+    if (A == NULL)
+	return; // packed edges are added by the caller
     for (int v=0; v<N; v++){
 	int degree = 0;
 	for (int e=0; e<max_edges; e++){
@@ -160,7 +279,7 @@ PixGraph::PixGraph(int H, int W, int k, const bool *A)
 		degree++;
 	    }
 	    else if (e == (max_edges-1)/2){
-		adj[v].push_back(v); // self edge
+		addNbr(v, v); // self edge
 		degree++;
 	    }
 	}
@@ -173,36 +292,184 @@ PixGraph::PixGraph(int H, int W, int k, const bool *A)
     // 	order[i] = i; // initial order
 }
 
-PixGraph::~PixGraph(){
-    delete[] V;
-    delete[] adj;
-    delete[] order;
-    delete[] degrees;
+PixGraph::PixGraph(int H, int W, int k, const float *A, float min_affinity, GraphScratch *scratch)
+    : T{1}, H{H}, W{W}, N{(H*W)}, k{k}, ksize{(2*k+1)}, kt{0}, ktsize{1}
+    , max_edges{(int(pow(2*k+1, 2)))}
+    , step_counter{0}, affinities{A}, min_affinity{min_affinity}
+    , num_labels(this->N)
+{
+    // votes are read straight from the stencil, so there are no adjacency lists to build
+    useScratch(scratch);
+    for (int i=0; i<N; i++){
+	V[i] = i;
+	order[i] = i;
+    }
+    this->cand_labels = growTo(this->scratch->cand_labels, max_edges);
+    this->cand_weights = growTo(this->scratch->cand_weights, max_edges);
+}
+
+PixGraph::PixGraph(int H, int W, int k, const uint32_t *masks, GraphScratch *scratch)
+    : PixGraph(1, H, W, k, 0, (const bool*)NULL, scratch)
+{
+    addPackedEdges(masks);
+}
+
+PixGraph::PixGraph(int H, int W, int k, const uint64_t *masks, GraphScratch *scratch)
+    : PixGraph(1, H, W, k, 0, (const bool*)NULL, scratch)
+{
+    addPackedEdges(masks);
+}
+
+static inline int popCount(uint32_t m){ return __builtin_popcount(m); }
+static inline int popCount(uint64_t m){ return __builtin_popcountll(m); }
+static inline int lowestBit(uint32_t m){ return __builtin_ctz(m); }
+static inline int lowestBit(uint64_t m){ return __builtin_ctzll(m); }
+
+// writes v + offsets[e] for each set bit e of mask to out, in increasing e,
+// and returns how many
+static inline __attribute__((always_inline)) int compactNeighborsBits(int v, uint64_t mask, const int *offsets, int *out){
+    int count = 0;
+    while (mask){
+	out[count++] = v + offsets[lowestBit(mask)];
+	mask &= mask - 1;
+    }
+    return count;
+}
+
+static int compactNeighborsScalar(int v, uint64_t mask, const int *offsets, int /* max_edges */, int *out){
+    return compactNeighborsBits(v, mask, offsets, out);
+}
+
+#ifdef VVN_MULTIVERSION
+VVN_TARGET_AVX2 static int compactNeighborsAvx2(int v, uint64_t mask, const int *offsets, int /* max_edges */, int *out){
+    return compactNeighborsBits(v, mask, offsets, out);
+}
+
+// 16 slots at a time with compressing stores; the masked loads and stores
+// touch no slot past max_edges
+VVN_TARGET_AVX512 static int compactNeighborsAvx512(int v, uint64_t mask, const int *offsets, int max_edges, int *out){
+    int count = 0;
+    __m512i base = _mm512_set1_epi32(v);
+    for (int e=0; e<max_edges; e+=16){
+	__mmask16 m = __mmask16(mask >> e);
+	__m512i nbrs = _mm512_add_epi32(base, _mm512_maskz_loadu_epi32(m, &offsets[e]));
+	_mm512_mask_compressstoreu_epi32(&out[count], m, nbrs);
+	count += popCount(uint32_t(m));
+    }
+    return count;
+}
+#endif
+
+typedef int (*CompactKernel)(int, uint64_t, const int*, int, int*);
+
+static CompactKernel selectCompactKernel(CpuIsa isa){
+#ifdef VVN_MULTIVERSION
+    if (isa == CPU_ISA_AVX512)
+	return compactNeighborsAvx512;
+    if (isa == CPU_ISA_AVX2)
+	return compactNeighborsAvx2;
+#endif
+    return compactNeighborsScalar;
+}
+
+static const CompactKernel compact_kernel = selectCompactKernel(cpuIsa());
+
+template <typename M>
+void PixGraph::addPackedEdges(const M *masks){
+    // same edges and degrees as the bool constructor: the self bit is always
+    // set, set bits are visited in increasing e and the degree is their count
+    int bits = 8*sizeof(M);
+    M valid = (max_edges < bits) ? ((M(1) << max_edges) - 1) : ~M(0);
+    M self = M(1) << ((max_edges-1)/2);
+    for (int v=0; v<N; v++){
+	M m = (masks[v] & valid) | self;
+	degrees[v] = popCount(m);
+	while (m){
+	    addEdge(v, lowestBit(m));
+	    m &= m - 1; // clear lowest set bit
+	}
+    }
+}
+
+StencilTopology::StencilTopology(int H, int W, int k)
+    : H{H}, W{W}, k{k}, max_edges{(2*k+1)*(2*k+1)}
+    , offsets(max_edges), row_valid(H, 0), col_valid(W, 0)
+{
+    int ksize = 2*k + 1;
+    for (int e=0; e<max_edges; e++){
+	int dh = (e / ksize) - k; int dw = (e % ksize) - k;
+	offsets[e] = dh*W + dw;
+	uint64_t bit = uint64_t(1) << e;
+	for (int h=0; h<H; h++)
+	    if ((h + dh >= 0) && (h + dh < H))
+		row_valid[h] |= bit;
+	for (int w=0; w<W; w++)
+	    if ((w + dw >= 0) && (w + dw < W))
+		col_valid[w] |= bit;
+    }
+}
+
+PixGraph::PixGraph(const StencilTopology &topo, const bool *A, GraphScratch *scratch)
+    : PixGraph(1, topo.H, topo.W, topo.k, 0, (const bool*)NULL, scratch)
+{
+    for (int v=0; v<N; v++){
+	uint64_t mask = 0;
+	for (int e=0; e<max_edges; e++)
+	    mask |= uint64_t(A[v*max_edges + e]) << e;
+	addTopologyEdges(topo, v, mask);
+    }
+}
+
+PixGraph::PixGraph(const StencilTopology &topo, const uint32_t *masks, GraphScratch *scratch)
+    : PixGraph(1, topo.H, topo.W, topo.k, 0, (const bool*)NULL, scratch)
+{
+    for (int v=0; v<N; v++)
+	addTopologyEdges(topo, v, masks[v]);
+}
+
+PixGraph::PixGraph(const StencilTopology &topo, const uint64_t *masks, GraphScratch *scratch)
+    : PixGraph(1, topo.H, topo.W, topo.k, 0, (const bool*)NULL, scratch)
+{
+    for (int v=0; v<N; v++)
+	addTopologyEdges(topo, v, masks[v]);
+}
+
+void PixGraph::addTopologyEdges(const StencilTopology &topo, int v, uint64_t mask){
+    // degree counts every set slot, in view or not, as the bool constructor does
+    uint64_t valid = (max_edges < 64) ? ((uint64_t(1) << max_edges) - 1) : ~uint64_t(0);
+    mask = (mask & valid) | (uint64_t(1) << ((max_edges-1)/2));
+    degrees[v] = popCount(mask);
+    mask &= topo.row_valid[v / W] & topo.col_valid[v % W];
+    num_nbrs[v] += compact_kernel(v, mask, topo.offsets.data(), max_edges, &nbrs[size_t(v)*max_edges + num_nbrs[v]]);
 }
 
 void PixGraph::addEdge(int v, int e){
-    int row = v / W; int col = v % W;
-    int h = (e / ksize) - k; int w = (e % ksize) - k;
-    bool in_view = ((row + h >= 0) && (row + h < H) &&
+    // e indexes a (2kt+1) x (2k+1) x (2k+1) neighborhood in (t,h,w)
+    int frame = v / (H*W); int row = (v / W) % H; int col = v % W;
+    int t = (e / (ksize*ksize)) - kt;
+    int h = ((e / ksize) % ksize) - k; int w = (e % ksize) - k;
+    bool in_view = ((frame + t >= 0) && (frame + t < T) &&
+		    (row + h >= 0) && (row + h < H) &&
 		    (col + w >= 0) && (col + w < W));
     if (in_view){
-	int ind = (row + h)*W + (col + w);
-	adj[v].push_back(ind);
+	int ind = ((frame + t)*H + (row + h))*W + (col + w);
+	addNbr(v, ind);
     }
 }
 
-void PixGraph::labelPropStep(bool defensive=false){
+int PixGraph::labelPropStep(bool defensive=false){
     // shuffle the order
-    std::random_shuffle(&order[0], &order[N]);
+    std::shuffle(&order[0], &order[N], rng);
 
     // a step of asynchronous label propagation
-    int v; std::vector<int> v_edges;
+    int v;
+    std::vector<int> &labels_connected_to_v = scratch->votes;
+    int changes = 0;
     for (int i=0; i<N; i++){
 	v = order[i];
-	v_edges = adj[v]; // vector of inds to connected nodes
-	std::vector<int> labels_connected_to_v;
-	std::vector<int>::iterator it;
-	for (it=v_edges.begin(); it!=v_edges.end(); ++it){
+	const int *v_edges = &nbrs[size_t(v)*max_edges]; // inds to connected nodes
+	labels_connected_to_v.clear();
+	for (const int *it=v_edges; it!=v_edges+num_nbrs[v]; ++it){
 	    if (defensive){
 		int e = V[*it];
 		for (int j=0; j<degrees[e]; j++)
@@ -211,7 +478,56 @@ void PixGraph::labelPropStep(bool defensive=false){
 	    else
 		labels_connected_to_v.push_back(V[*it]);
 	}
-	V[v] = mostCommonElement(labels_connected_to_v);
+	int label = mostCommonElement(labels_connected_to_v);
+	changes += (label != V[v]);
+	V[v] = label;
+    }
+
+    // updates
+    step_counter++;
+    return changes;
+}
+
+void PixGraph::labelPropStepWeighted(){
+    // shuffle the order
+    std::shuffle(&order[0], &order[N], rng);
+
+    // a step of asynchronous label propagation where each neighbor votes with
+    // its affinity; the node always votes for its own label
+    int center = (max_edges-1)/2;
+    for (int i=0; i<N; i++){
+	int v = order[i];
+	int row = v / W; int col = v % W;
+	const float *a = &affinities[v*max_edges];
+	int num_cands = 1;
+	cand_labels[0] = V[v];
+	cand_weights[0] = std::max(a[center], 0.0f);
+	for (int e=0; e<max_edges; e++){
+	    if (e == center || !(a[e] >= min_affinity) || !(a[e] > 0.0f))
+		continue;
+	    int h = row + (e / ksize) - k; int w = col + (e % ksize) - k;
+	    if (h < 0 || h >= H || w < 0 || w >= W)
+		continue;
+	    int label = V[h*W + w];
+	    int c = 0;
+	    while (c < num_cands && cand_labels[c] != label)
+		c++;
+	    if (c == num_cands){
+		cand_labels[c] = label;
+		cand_weights[c] = 0.0f;
+		num_cands++;
+	    }
+	    cand_weights[c] += a[e];
+	}
+
+	// weighted mode; ties go to the smallest label as in mostCommonElement
+	int best = 0;
+	for (int c=1; c<num_cands; c++){
+	    if (cand_weights[c] > cand_weights[best] ||
+		(cand_weights[c] == cand_weights[best] && cand_labels[c] < cand_labels[best]))
+		best = c;
+	}
+	V[v] = cand_labels[best];
     }
 
     // updates
@@ -223,11 +539,12 @@ void PixGraph::setNumLabels(bool relabel=false,
 			    int offset=0){
     // set the number of unique labels
     // optionally relabel and shuffle the order so 0 isn't in top left
-    std::vector<int> labels(V, V+N);
-    std::sort(labels.begin(), labels.end());
-    int lmap[N];
+    int *labels = growTo(scratch->sorted, N);
+    std::copy(V, V+N, labels);
+    std::sort(labels, labels+N);
+    int *lmap = growTo(scratch->lmap, N);
     int num_unique = 0; int elem = -1;
-    for (std::vector<int>::iterator it=labels.begin(); it!=labels.end(); ++it){
+    for (int *it=labels; it!=labels+N; ++it){
 	if (*it != elem){
 	    lmap[*it] = num_unique; // the new label hash
 	    num_unique++;
@@ -238,10 +555,10 @@ void PixGraph::setNumLabels(bool relabel=false,
 
     if (relabel){
 	if (shuffle){
-	    int new_order[num_labels];
+	    int *new_order = growTo(scratch->relabel, num_labels);
 	    for (int j=0; j<num_labels; j++)
 		new_order[j] = j + offset;
-	    std::random_shuffle(&new_order[0], &new_order[num_labels]);
+	    std::shuffle(&new_order[0], &new_order[num_labels], rng);
 	    for (int k=0; k<N; k++)
 		V[k] = new_order[lmap[V[k]]];
 	}
@@ -256,123 +573,593 @@ void PixGraph::printLabels(int width=5){
     std::cout << "number of steps taken: " << step_counter << std::endl;
     std::cout << "number of unique labels: " << num_labels << std::endl;
 
-    for (int i=0; i<H; i++){
-	for (int j=0; j<W; j++){
-	    std::cout << std::setw (width) << V[i*W + j];
+    for (int t=0; t<T; t++){
+	for (int i=0; i<H; i++){
+	    for (int j=0; j<W; j++){
+		std::cout << std::setw (width) << V[(t*H + i)*W + j];
+	    }
+	    printf("\n");
 	}
 	printf("\n");
     }
-    printf("\n");
-}
-
-int main(){
-
-    // Test of CC Graphs
-    // int N = 5;
-    // Graph G(N, false);
-    // G.addEdge(1, 0);
-    // G.addEdge(2, 3);
-    // G.addEdge(3, 4);
-
-    // bool mask[N] = {true, true, true, false, true};
-    // bool visited[N];
-    // for (int v=0; v<N; v++)
-    // 	visited[v] = (mask[v]) ? false : true;
-
-    // G.connectedComponents(visited);
-
-    // printf("ConnComp labels\n");
-    // for (int v=0; v<N; v++){
-    // 	printf("%d ", G.cc_ids[v]);
-    // }
-    // std::cout << endl;
-
-    // // Test of Labelprop on a generic Graph
-    // std::srand(std::time(0));
-    // int M = 100;
-    // Graph H(M, true);
-
-    // // add some edges
-    // for (int i=0; i<M; i++){
-    // 	for (int j=0; j<i; j++){
-    // 	    if ((i-j) < 2)
-    // 		H.addEdge(i,j);
-    // 	}
-    // }
-
-    // do the labelprop
-    // int num_steps = 10;
-    // for (int n=0; n<num_steps; n++)
-    // 	H.labelPropStep();
-    // H.setNumLabels(false, 0);
-    // printf("LabelProp labels\n");
-    // for (int v=0; v<M; v++){
-    // 	printf("%d ", H.cc_ids[v]);
-    // }
-    // std::cout << endl;
-
-    // Test of sorting edges
-    // int E = 5;
-    // int edge_vals[][3] = {
-    // 	{1, 0, 2},
-    // 	{0, 1, 4},
-    // 	{1, 0, 1},
-    // 	{2, 1, 3},
-    // 	{0, 3, 5}
-    // };
-    // // int (*edges)[3] = new int[E][3];
-    // int **edges = new int*[E];
-    // for (int e=0; e<E; e++){
-    // 	edges[e] = new int[3];
-    // 	for (int i=0; i<3; i++)
-    // 	    edges[e][i] = edge_vals[e][i];
-    // }
-    // printf("Edges pre sorting\n");
-    // for (int e=0; e<E; e++){
-    // 	for (int i=0; i<3; i++)
-    // 	    std::cout << edges[e][i] << " ";
-    // 	std::cout << endl;
-    // }
-    // std::cout << endl;
-
-    // printf("Sorting\n");
-    // std::sort(&edges[0], &edges[E], [&](int *ei, int *ej){return ei[0] < ej[0];});
-    // printf("Edges post sorting\n");
-    // for (int e=0; e<E; e++){
-    // 	for (int i=0; i<3; i++)
-    // 	    std::cout << edges[e][i] << " ";
-    // 	delete[] edges[e];
-    // 	std::cout << endl;
-    // }
-
-    // delete[] edges;
-
-    // Test of most CommonElement
-    // std::vector<int> myvect = {5,2,0,2,2,5,3,3,5,4,2};
-    // for (std::vector<int>::iterator it=myvect.begin(); it!=myvect.end(); ++it)
-    // 	printf("%d ", *it);
-    // printf("\n");
-    // printf("\nmost common label: %d\n", mostCommonElement(myvect));
-
-    // Test of Pix Graphs
-    int H = 16;
-    int W = 32;
-    int k = 1;
-    int max_edges = pow(2*(k+1), 2);
-    bool A[H*W*max_edges];
-    std::fill_n(A, H*W*max_edges, true);
-    int num_steps = 5;
-
-    std::srand(std::time(0));
-
-    auto start = chrono::steady_clock::now();
-    PixGraph G(H, W, k, A);
-    for (int n=0; n<num_steps; n++)
-    	G.labelPropStep(true);
-    auto end = chrono::steady_clock::now();
-    G.setNumLabels(true, true, 5); // relabel, shuffle, offset
-    G.printLabels();
-    std::cout << "time elapsed: " << chrono::duration_cast<chrono::milliseconds>(end-start).count() << endl;
-
-    return 0;
+}
+
+DisjointSets::DisjointSets(int n)
+    : parent(n), sizes(n, 1)
+{
+    for (int i=0; i<n; i++)
+	parent[i] = i;
+}
+
+int DisjointSets::find(int v){
+    while (parent[v] != v){
+	parent[v] = parent[parent[v]];
+	v = parent[v];
+    }
+    return v;
+}
+
+int DisjointSets::unite(int a, int b){
+    if (sizes[a] < sizes[b])
+	std::swap(a, b);
+    parent[b] = a;
+    sizes[a] += sizes[b];
+    return a;
+}
+
+TiledPixGraph::TiledPixGraph(const StencilTopology &topo, int tile_size, unsigned seed)
+    : H{topo.H}, W{topo.W}, N{(topo.H*topo.W)}, tile_size{tile_size}, topo(topo), degrees(N), rng(seed), V(N)
+{
+    int k = topo.k;
+    for (int h0=0; h0<H; h0+=tile_size){
+	for (int w0=0; w0<W; w0+=tile_size){
+	    Tile tile;
+	    tile.h0 = h0; tile.w0 = w0;
+	    tile.th = std::min(tile_size, H - h0); tile.tw = std::min(tile_size, W - w0);
+	    tile.hh0 = std::max(h0 - k, 0); tile.hw0 = std::max(w0 - k, 0);
+	    tile.hh = std::min(h0 + tile.th + k, H) - tile.hh0;
+	    tile.hw = std::min(w0 + tile.tw + k, W) - tile.hw0;
+	    tile.rng.seed(seed + 1 + tiles.size());
+	    tiles.push_back(std::move(tile));
+	}
+    }
+}
+
+template <typename F>
+void TiledPixGraph::initTileMasks(int t, F mask_of){
+    Tile &tile = tiles[t];
+    int k = topo.k; int ksize = 2*k + 1; int max_edges = topo.max_edges;
+    uint64_t valid = (max_edges < 64) ? ((uint64_t(1) << max_edges) - 1) : ~uint64_t(0);
+    uint64_t self = uint64_t(1) << ((max_edges-1)/2);
+    tile.masks.resize(tile.th*tile.tw);
+    tile.order.resize(tile.th*tile.tw);
+    for (int i=0; i<tile.th; i++){
+	for (int j=0; j<tile.tw; j++){
+	    int v = (tile.h0 + i)*W + (tile.w0 + j);
+	    uint64_t mask = (mask_of(v) & valid) | self;
+	    degrees[v] = popCount(mask); // counts out of view edges, as PixGraph does
+	    tile.masks[i*tile.tw + j] = mask & topo.row_valid[tile.h0 + i] & topo.col_valid[tile.w0 + j];
+	    tile.order[i*tile.tw + j] = i*tile.tw + j;
+	    V[v] = v; // initialize labels to be unique
+	}
+    }
+    tile.labels.resize(tile.hh*tile.hw);
+    for (int i=0; i<tile.hh; i++)
+	for (int j=0; j<tile.hw; j++)
+	    tile.labels[i*tile.hw + j] = (tile.hh0 + i)*W + (tile.hw0 + j);
+    tile.offsets.resize(max_edges);
+    for (int e=0; e<max_edges; e++)
+	tile.offsets[e] = ((e / ksize) - k)*tile.hw + ((e % ksize) - k);
+}
+
+void TiledPixGraph::initTile(int t, const bool *A){
+    int max_edges = topo.max_edges;
+    initTileMasks(t, [&](int v){
+	    uint64_t mask = 0;
+	    for (int e=0; e<max_edges; e++)
+		mask |= uint64_t(A[v*max_edges + e]) << e;
+	    return mask;
+	});
+}
+
+void TiledPixGraph::initTile(int t, const uint32_t *masks){
+    initTileMasks(t, [&](int v){ return uint64_t(masks[v]); });
+}
+
+void TiledPixGraph::initTile(int t, const uint64_t *masks){
+    initTileMasks(t, [&](int v){ return masks[v]; });
+}
+
+int TiledPixGraph::sweepTile(int t, bool defensive){
+    Tile &tile = tiles[t];
+    std::shuffle(tile.order.begin(), tile.order.end(), tile.rng);
+
+    // asynchronous label propagation within the tile; halo labels are as of the last refresh
+    std::vector<int> &votes = tile.votes;
+    int row0 = tile.h0 - tile.hh0; int col0 = tile.w0 - tile.hw0;
+    int changes = 0;
+    for (int n=0; n<tile.th*tile.tw; n++){
+	int i = tile.order[n];
+	int li = (row0 + i / tile.tw)*tile.hw + (col0 + i % tile.tw);
+	votes.clear();
+	for (uint64_t m=tile.masks[i]; m; m &= m - 1){
+	    int label = tile.labels[li + tile.offsets[lowestBit(m)]];
+	    if (defensive)
+		votes.insert(votes.end(), degrees[label], label);
+	    else
+		votes.push_back(label);
+	}
+	int label = mostCommonElement(votes);
+	changes += (label != tile.labels[li]);
+	tile.labels[li] = label;
+    }
+
+    // publish the interior
+    for (int i=0; i<tile.th; i++)
+	std::copy(&tile.labels[(row0 + i)*tile.hw + col0], &tile.labels[(row0 + i)*tile.hw + col0 + tile.tw],
+		  &V[(tile.h0 + i)*W + tile.w0]);
+    return changes;
+}
+
+void TiledPixGraph::refreshHalo(int t){
+    Tile &tile = tiles[t];
+    for (int i=0; i<tile.hh; i++){
+	int h = tile.hh0 + i;
+	bool interior_row = (h >= tile.h0) && (h < tile.h0 + tile.th);
+	for (int j=0; j<tile.hw; j++){
+	    int w = tile.hw0 + j;
+	    if (interior_row && (w >= tile.w0) && (w < tile.w0 + tile.tw)){
+		j += tile.tw - 1; // skip the interior
+		continue;
+	    }
+	    tile.labels[i*tile.hw + j] = V[h*W + w];
+	}
+    }
+}
+
+int TiledPixGraph::mergeSeams(bool shuffle, int offset, int *labels){
+    // count each label's edges across tile seams, and those into each other label
+    int k = topo.k; int ksize = 2*k + 1;
+    std::vector<int> seam_edges(N, 0);
+    std::vector<std::pair<int,int> > crossings;
+    for (size_t t=0; t<tiles.size(); t++){
+	const Tile &tile = tiles[t];
+	for (int i=0; i<tile.th; i++){
+	    bool border_row = (i < k) || (i >= tile.th - k);
+	    for (int j=0; j<tile.tw; j++){
+		if (!border_row && j == k && tile.tw - k > j)
+		    j = tile.tw - k; // only pixels within k of the tile border cross seams
+		int h = tile.h0 + i; int w = tile.w0 + j;
+		int a = V[h*W + w];
+		for (uint64_t m=tile.masks[i*tile.tw + j]; m; m &= m - 1){
+		    int e = lowestBit(m);
+		    int nh = h + (e / ksize) - k; int nw = w + (e % ksize) - k;
+		    if ((nh >= tile.h0) && (nh < tile.h0 + tile.th) && (nw >= tile.w0) && (nw < tile.w0 + tile.tw))
+			continue;
+		    int b = V[nh*W + nw];
+		    seam_edges[a]++;
+		    if (a != b)
+			crossings.push_back(std::make_pair(a, b));
+		}
+	    }
+	}
+    }
+    std::sort(crossings.begin(), crossings.end());
+
+    // merge pairs that each send most of their seam edges to the other
+    DisjointSets sets(N);
+    auto count_of = [&](int a, int b){
+	auto range = std::equal_range(crossings.begin(), crossings.end(), std::make_pair(a, b));
+	return int(range.second - range.first);
+    };
+    for (size_t c=0; c<crossings.size(); ){
+	int a = crossings[c].first; int b = crossings[c].second;
+	size_t end = c;
+	while (end < crossings.size() && crossings[end] == crossings[c])
+	    end++;
+	int ab = int(end - c);
+	if (a < b && 2*ab > seam_edges[a] && 2*count_of(b, a) > seam_edges[b]){
+	    int ra = sets.find(a); int rb = sets.find(b);
+	    if (ra != rb)
+		sets.unite(ra, rb);
+	}
+	c = end;
+    }
+
+    // number the merged labels in order of first pixel
+    std::vector<int> lmap(N, -1);
+    int num_labels = 0;
+    for (int v=0; v<N; v++){
+	int root = sets.find(V[v]);
+	if (lmap[root] < 0)
+	    lmap[root] = num_labels++;
+	labels[v] = lmap[root];
+    }
+    std::vector<int> new_order(num_labels);
+    for (int j=0; j<num_labels; j++)
+	new_order[j] = j + offset;
+    if (shuffle)
+	std::shuffle(new_order.begin(), new_order.end(), rng);
+    for (int v=0; v<N; v++)
+	labels[v] = new_order[labels[v]];
+    return num_labels;
+}
+
+// LSD radix sort of edge inds by nonnegative float weight, whose bit patterns sort like the floats
+static void radixSortEdges(int E, const float *weights, std::vector<int> &order){
+    std::vector<uint32_t> keys(E); std::vector<uint32_t> keys_tmp(E);
+    std::vector<int> order_tmp(E);
+    order.resize(E);
+    for (int e=0; e<E; e++){
+	std::memcpy(&keys[e], &weights[e], sizeof(uint32_t));
+	order[e] = e;
+    }
+    for (int shift=0; shift<32; shift+=8){
+	int counts[257] = {0};
+	for (int e=0; e<E; e++)
+	    counts[((keys[e] >> shift) & 0xff) + 1]++;
+	for (int i=0; i<256; i++)
+	    counts[i+1] += counts[i];
+	for (int e=0; e<E; e++){
+	    int pos = counts[(keys[e] >> shift) & 0xff]++;
+	    keys_tmp[pos] = keys[e];
+	    order_tmp[pos] = order[e];
+	}
+	keys.swap(keys_tmp);
+	order.swap(order_tmp);
+    }
+}
+
+int felzenszwalbSegment(int H, int W, int k, const float *A, float min_affinity, float scale, int min_size, int offset, int *labels){
+    int N = H*W; int ksize = 2*k + 1; int K = ksize*ksize; int center = (K-1)/2;
+
+    // one edge per neighboring pixel pair, from the forward half of the stencil
+    std::vector<int> us; std::vector<int> vs; std::vector<float> weights;
+    us.reserve(N*center); vs.reserve(N*center); weights.reserve(N*center);
+    for (int p=0; p<N; p++){
+	int row = p / W; int col = p % W;
+	for (int e=center+1; e<K; e++){
+	    int h = row + (e / ksize) - k; int w = col + (e % ksize) - k;
+	    if (h < 0 || h >= H || w < 0 || w >= W)
+		continue;
+	    int q = h*W + w;
+	    float a = 0.5f * (A[p*K + e] + A[q*K + K-1-e]);
+	    if (!(a >= min_affinity))
+		continue;
+	    float weight = 1.0f - a;
+	    us.push_back(p); vs.push_back(q);
+	    weights.push_back((weight > 0.0f) ? weight : 0.0f); // nonnegative (and not -0) for the radix sort
+	}
+    }
+    int E = weights.size();
+    std::vector<int> order;
+    radixSortEdges(E, weights.data(), order);
+
+    // Kruskal-style merging with the adaptive internal difference criterion
+    DisjointSets sets(N);
+    std::vector<float> thresholds(N, scale);
+    for (int i=0; i<E; i++){
+	int e = order[i];
+	int a = sets.find(us[e]); int b = sets.find(vs[e]);
+	if (a == b)
+	    continue;
+	float w = weights[e];
+	if (w <= thresholds[a] && w <= thresholds[b]){
+	    int root = sets.unite(a, b);
+	    thresholds[root] = w + scale / float(sets.size(root));
+	}
+    }
+
+    // merge away small segments along the cheapest edges
+    if (min_size > 1){
+	for (int i=0; i<E; i++){
+	    int e = order[i];
+	    int a = sets.find(us[e]); int b = sets.find(vs[e]);
+	    if (a != b && (sets.size(a) < min_size || sets.size(b) < min_size))
+		sets.unite(a, b);
+	}
+    }
+
+    // number segments by first pixel
+    std::vector<int> root_labels(N, -1);
+    int num_labels = 0;
+    for (int p=0; p<N; p++){
+	int root = sets.find(p);
+	if (root_labels[root] < 0)
+	    root_labels[root] = num_labels++;
+	labels[p] = root_labels[root] + offset;
+    }
+    return num_labels;
+}
+
+int capSegments(int S, const int *sizes, int E, const int *pairs, const float *weights, int max_segments, int *segment_map){
+    // weight to each neighboring root, kept keyed by roots as segments merge
+    std::vector<std::unordered_map<int,float> > adj(S);
+    for (int e=0; e<E; e++){
+	int a = pairs[2*e]; int b = pairs[2*e + 1];
+	if (a == b)
+	    continue;
+	adj[a][b] += weights[e];
+	adj[b][a] += weights[e];
+    }
+    std::vector<int> seg_sizes(sizes, sizes + S);
+    typedef std::pair<int,int> SizeId;
+    std::priority_queue<SizeId, std::vector<SizeId>, std::greater<SizeId> > smallest;
+    for (int s=0; s<S; s++)
+	smallest.push(SizeId(seg_sizes[s], s));
+    DisjointSets sets(S);
+    auto next_smallest = [&](){
+	// pops stale entries until a current root is on top
+	while (!smallest.empty()){
+	    SizeId top = smallest.top(); smallest.pop();
+	    if (sets.find(top.second) == top.second && seg_sizes[top.second] == top.first)
+		return top.second;
+	}
+	return -1;
+    };
+
+    int alive = S;
+    while (alive > std::max(max_segments, 1)){
+	int s = next_smallest();
+	int t = -1; float best = 0.0f;
+	for (auto &nbr : adj[s]){
+	    if (t < 0 || nbr.second > best || (nbr.second == best && nbr.first < t)){
+		t = nbr.first;
+		best = nbr.second;
+	    }
+	}
+	if (t < 0)
+	    t = next_smallest();
+
+	// move the merged-away root's weights to the new root, on both sides
+	int root = sets.unite(s, t);
+	int other = (root == s) ? t : s;
+	for (auto &nbr : adj[other]){
+	    if (nbr.first == root)
+		continue;
+	    adj[root][nbr.first] += nbr.second;
+	    std::unordered_map<int,float> &back = adj[nbr.first];
+	    back[root] += back[other];
+	    back.erase(other);
+	}
+	adj[root].erase(other);
+	std::unordered_map<int,float>().swap(adj[other]);
+	seg_sizes[root] = seg_sizes[s] + seg_sizes[t];
+	smallest.push(SizeId(seg_sizes[root], root));
+	alive--;
+    }
+
+    std::vector<int> new_ids(S, -1);
+    int num_segments = 0;
+    for (int s=0; s<S; s++){
+	int root = sets.find(s);
+	if (new_ids[root] < 0)
+	    new_ids[root] = num_segments++;
+	segment_map[s] = new_ids[root];
+    }
+    return num_segments;
+}
+
+ScopedPhase::ScopedPhase(PhaseTracer *tracer, const char *phase, GraphStats *stats, double GraphStats::*seconds)
+    :tracer(phase ? tracer : NULL), seconds(stats ? &(stats->*seconds) : NULL){
+    if (this->tracer)
+	this->tracer->begin(phase);
+    if (this->seconds)
+	start = std::chrono::steady_clock::now();
+}
+
+ScopedPhase::~ScopedPhase(){
+    end();
+}
+
+void ScopedPhase::end(){
+    if (seconds)
+	*seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    if (tracer)
+	tracer->end();
+    seconds = NULL; tracer = NULL;
+}
+
+// finds the C largest connected components for each n particles in a batch of size b
+// returns cc_ids with lower id numbers corresponding to larger connected components
+void ccsearch(int b, int n, int C, const bool* edges, const bool* mask, int* ccids, PhaseTracer *tracer, GraphStats *stats,
+	      GraphScratch *scratch){
+    GraphScratch local;
+    if (scratch == NULL)
+	scratch = &local;
+    // loop across batches
+    for (int i=0; i<b; i++){
+	GraphStats *ex_stats = stats ? &stats[i] : NULL;
+	ScopedPhase example(NULL, NULL, ex_stats, &GraphStats::total_seconds);
+	// which particles/nodes have been visited
+	bool *visited = reinterpret_cast<bool*>(growTo(scratch->visited, n));
+
+	for (int v=0; v<n; v++){
+	    visited[v] = (mask[i*n + v]) ? false : true; // if a particle is fake, never visit
+	}
+
+	// construct the graph for this example and add edges
+	ScopedPhase build(tracer, "build_graph", ex_stats, &GraphStats::build_seconds);
+	Graph G(n, false, scratch);
+	for (int v=0; v<n; v++)
+	    // only need to do lower triangle + diagonal of edge mat
+	    for (int w=0; w<=v; w++){
+		if (edges[i*n*n + v*n + w])
+		    G.addEdge(v,w);
+	    }
+	build.end();
+
+	// compute the connected components
+	ScopedPhase search(tracer, "components", ex_stats, &GraphStats::propagate_seconds);
+	G.connectedComponents(visited);
+	search.end();
+
+	// sort by size, largest first
+	ScopedPhase ranking(tracer, "rank_components", ex_stats, &GraphStats::relabel_seconds);
+	int num_ccs = G.cc_sizes.size();
+	int *cc_order = growTo(scratch->cc_order, num_ccs);
+	std::iota(cc_order, cc_order+num_ccs, 0);
+	std::sort(cc_order, cc_order+num_ccs,
+		  [&G](int i, int j) {return G.cc_sizes[i]>G.cc_sizes[j];});
+
+	// how to map originally-assigned cc_ids to size-ranked cc_ids up to C (max components)
+	int *cc_map = growTo(scratch->cc_map, num_ccs);
+	for (int idx = 0; idx < num_ccs; idx++)
+	    cc_map[cc_order[idx]] = idx;
+
+	// assign cc ids only to the largest connected components
+	// fake particles and any cc >= C is set to cc_id = C
+	for (int v=0; v<n; v++){
+	    int v_id = G.cc_ids[v];
+	    if (v_id > 0)
+		ccids[i*n + v] = (cc_map[v_id] < C) ? cc_map[v_id] : C;
+	    else
+		ccids[i*n + v] = C;
+	}
+    }
+}
+
+// runs the sweeps and relabeling of one example's built graph of N nodes from
+// seed and writes its labels, offset by segments_now
+static void propagateLabels(PixGraph &G, int N, int num_steps, bool defensive, int segments_now, int *labels, int *num_segments,
+			    unsigned seed, PhaseTracer *tracer, GraphStats *ex_stats){
+    bool relabel=true; bool shuffle=true;
+    G.seed(seed);
+    ScopedPhase propagate(tracer, "propagate", ex_stats, &GraphStats::propagate_seconds);
+    for (int n=0; n<num_steps; n++){
+	int changes = G.labelPropStep(defensive);
+	if (ex_stats)
+	    ex_stats->changes.push_back(changes);
+    }
+    propagate.end();
+    if (ex_stats)
+	ex_stats->sweeps = num_steps;
+
+    ScopedPhase relabel_phase(tracer, "relabel", ex_stats, &GraphStats::relabel_seconds);
+    G.setNumLabels(relabel, shuffle, segments_now);
+    std::copy(G.V, G.V + N, labels);
+    *num_segments = G.num_labels;
+}
+
+// labelprop on bool or packed stencil edges, with neighbors read from the
+// topology tables when given
+template <typename E>
+static void assignLabelsImpl(int B, int H, int W, int k, int num_steps, bool defensive, const StencilTopology *topology,
+			     const E *edges, int *labels, int *num_segments, unsigned seed, PhaseTracer *tracer, GraphStats *stats,
+			     GraphScratch *scratch){
+    int N = H*W;
+    int64_t edges_per_ex = std::is_same<E, bool>::value ? int64_t(N)*(2*k + 1)*(2*k + 1) : int64_t(N);
+    GraphScratch local;
+    if (scratch == NULL)
+	scratch = &local;
+    int segments_now=0;
+    for (int b=0; b<B; b++){
+	GraphStats *ex_stats = stats ? &stats[b] : NULL;
+	ScopedPhase example(NULL, NULL, ex_stats, &GraphStats::total_seconds);
+	const E *ex_edges = &edges[b*edges_per_ex];
+	int offset = b*N;
+	ScopedPhase build(tracer, "build_graph", ex_stats, &GraphStats::build_seconds);
+	if (topology){
+	    PixGraph G(*topology, ex_edges, scratch);
+	    build.end();
+	    propagateLabels(G, N, num_steps, defensive, segments_now, &labels[offset], &num_segments[b], exampleSeed(seed, b),
+			    tracer, ex_stats);
+	}
+	else{
+	    PixGraph G(H, W, k, ex_edges, scratch);
+	    build.end();
+	    propagateLabels(G, N, num_steps, defensive, segments_now, &labels[offset], &num_segments[b], exampleSeed(seed, b),
+			    tracer, ex_stats);
+	}
+	segments_now = segments_now + num_segments[b];
+    }
+}
+
+void assignLabels(int B, int H, int W, int k, int num_steps, bool defensive, const StencilTopology *topology,
+		  const bool *edges, int *labels, int *num_segments, unsigned seed, PhaseTracer *tracer, GraphStats *stats,
+		  GraphScratch *scratch){
+    assignLabelsImpl(B, H, W, k, num_steps, defensive, topology, edges, labels, num_segments, seed, tracer, stats, scratch);
+}
+
+void assignLabels(int B, int H, int W, int k, int num_steps, bool defensive, const StencilTopology *topology,
+		  const uint32_t *edges, int *labels, int *num_segments, unsigned seed, PhaseTracer *tracer, GraphStats *stats,
+		  GraphScratch *scratch){
+    assignLabelsImpl(B, H, W, k, num_steps, defensive, topology, edges, labels, num_segments, seed, tracer, stats, scratch);
+}
+
+void assignLabels(int B, int H, int W, int k, int num_steps, bool defensive, const StencilTopology *topology,
+		  const uint64_t *edges, int *labels, int *num_segments, unsigned seed, PhaseTracer *tracer, GraphStats *stats,
+		  GraphScratch *scratch){
+    assignLabelsImpl(B, H, W, k, num_steps, defensive, topology, edges, labels, num_segments, seed, tracer, stats, scratch);
+}
+
+// constructs a graph of size num_nodes[b] for b in range(B), adds the appropriate edges, and does labelprop to reassign node labels.
+// if sort_edges, then the edges
+void assignLabelsFC(int B, int E, const int *num_nodes, const int *edges, int *labels, int *num_segments, int num_steps, bool sort_edges,
+		    unsigned seed, PhaseTracer *tracer, GraphStats *stats, GraphScratch *scratch){
+    GraphScratch local;
+    if (scratch == NULL)
+	scratch = &local;
+    // visit the edges in example order: counting sort them by example, or take them as they are
+    ScopedPhase sorting(tracer, "sort_edges", NULL, NULL);
+    int *order = growTo(scratch->edge_order, E);
+    if (sort_edges){
+	int *offsets = growTo(scratch->edge_offsets, B+1);
+	std::fill(offsets, offsets+B+1, 0);
+	for (int e=0; e<E; e++)
+	    if (edges[e*3] >= 0 && edges[e*3] < B)
+		offsets[edges[e*3] + 1]++;
+	std::partial_sum(offsets, offsets+B+1, offsets);
+	int num_valid = offsets[B];
+	for (int e=0; e<E; e++)
+	    if (edges[e*3] >= 0 && edges[e*3] < B)
+		order[offsets[edges[e*3]]++] = e;
+	E = num_valid; // edges of other examples are never visited
+    }
+    else
+	std::iota(order, order+E, 0);
+    sorting.end();
+
+    // set labels and num segments output
+    int offset = 0; int edge_ctr = 0;
+    int nodes_so_far = 0;
+    for (int b=0; b<B; b++){
+
+	GraphStats *ex_stats = stats ? &stats[b] : NULL;
+	ScopedPhase example(NULL, NULL, ex_stats, &GraphStats::total_seconds);
+    	int V = num_nodes[b]; // num nodes in this graph
+	ScopedPhase build(tracer, "build_graph", ex_stats, &GraphStats::build_seconds);
+	Graph G(V, true, scratch); // init graph for labelprop
+
+	// add edges
+	while ((E - edge_ctr) && (edges[order[edge_ctr]*3] == b)){
+	    const int *edge = &edges[order[edge_ctr]*3];
+	    G.addEdge(edge[1], edge[2]);
+	    edge_ctr++;
+	}
+	build.end();
+
+	// do the labelprop and reset labels
+	G.seed(exampleSeed(seed, b));
+	ScopedPhase propagate(tracer, "propagate", ex_stats, &GraphStats::propagate_seconds);
+	for (int n=0; n<num_steps; n++){
+	    int changes = G.labelPropStep(false);
+	    if (ex_stats)
+		ex_stats->changes.push_back(changes);
+	}
+	propagate.end();
+	if (ex_stats)
+	    ex_stats->sweeps = num_steps;
+	ScopedPhase relabel(tracer, "relabel", ex_stats, &GraphStats::relabel_seconds);
+	G.setNumLabels(true, offset);
+
+	// assign outputs
+	for (int v=0; v<V; v++)
+	    labels[nodes_so_far + v] = G.cc_ids[v];
+	num_segments[b] = G.num_labels;
+
+	// update
+	offset = offset + G.num_labels;
+	nodes_so_far = nodes_so_far + V;
+    }
 }
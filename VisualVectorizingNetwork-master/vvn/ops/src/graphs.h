@@ -1,9 +1,56 @@
 #include <list>
 #include <vector>
+#include <cstdint>
 #include <stdio.h>
 #include <cmath>
 #include <iostream>
 #include <iomanip>
+#include <random>
+#include <chrono>
+#include <memory>
+#include <mutex>
+
+// Grow-only buffers that Graph, PixGraph and the batch drivers take their
+// storage from. A scratch backs one graph at a time; kept across calls, it
+// stops allocating once it has grown to the largest graph seen.
+struct GraphScratch
+{
+    std::vector<int> labels; // [N] PixGraph V or Graph cc_ids
+    std::vector<int> order; // [N] sweep order
+    std::vector<int> degrees; // [N]
+    std::vector<int> num_nbrs; // [N] PixGraph adjacency sizes
+    std::vector<int> nbrs; // [N*max_edges] PixGraph adjacency
+    std::vector<std::vector<int> > lists; // Graph adjacency, cleared but never freed
+    std::vector<int> votes; // neighbor labels of one node
+    std::vector<int> cand_labels; std::vector<float> cand_weights; // [max_edges] for labelPropStepWeighted
+    std::vector<int> sorted; std::vector<int> lmap; std::vector<int> relabel; // for setNumLabels
+    std::vector<int> cc_sizes; std::vector<int> cc_order; std::vector<int> cc_map; std::vector<char> visited; // for ccsearch
+    std::vector<int> edge_order; std::vector<int> edge_offsets; // for assignLabelsFC
+};
+
+// Scratch for kernels whose Compute calls may overlap: acquire hands out an
+// idle GraphScratch, creating one only when all are in use.
+class ScratchPool
+{
+    std::mutex mu;
+    std::vector<std::unique_ptr<GraphScratch> > idle;
+
+public:
+    std::unique_ptr<GraphScratch> acquire();
+    void release(std::unique_ptr<GraphScratch> scratch);
+};
+
+// Holds a scratch of pool for the lifetime of the scope
+class ScopedScratch
+{
+    ScratchPool &pool;
+    std::unique_ptr<GraphScratch> scratch;
+
+public:
+    explicit ScopedScratch(ScratchPool &pool) : pool(pool), scratch(pool.acquire()) {}
+    ~ScopedScratch() { pool.release(std::move(scratch)); }
+    GraphScratch *get() { return scratch.get(); }
+};
 
 class Graph
 {
@@ -12,43 +59,231 @@ class Graph
     int cc_size_counter;
     bool labelprop; // indicator for whether to init for labelprop
     int *order; // labelprop step order
+    std::mt19937 rng; // shuffles order
+    std::unique_ptr<GraphScratch> owned_scratch; // when not given one
+    GraphScratch *scratch; // storage
 
     // to find connected components
     void DFSUtil(int v, bool visited[], int cc);
 public:
-    Graph(int v, bool labelprop);
+    Graph(int v, bool labelprop, GraphScratch *scratch = NULL);
     ~Graph();
 
     int *cc_ids;
     int num_labels;
-    std::vector<int> cc_sizes;
+    std::vector<int> &cc_sizes;
+    void seed(unsigned seed){ rng.seed(seed); } // the sweep orders are drawn from seed
     void addEdge(int v, int w);
     void connectedComponents(bool visited[]);
-    void labelPropStep(bool defensive); // propagates labels
+    int labelPropStep(bool defensive); // propagates labels, returns how many changed
     void setNumLabels(bool relabel, int offset); // set num labels and relabel
 };
 
+// Neighbor offsets and in-view masks of the (2k+1)x(2k+1) stencil on an HxW
+// grid. They are the same for every example of a given size, so kernels build
+// them once; slot e of pixel (h,w) is in view iff bit e of row_valid[h] &
+// col_valid[w] is set. Requires (2k+1)**2 <= 64.
+struct StencilTopology
+{
+    int H; int W; int k; int max_edges;
+    std::vector<int> offsets; // [max_edges] neighbor index minus pixel index
+    std::vector<uint64_t> row_valid; // [H]
+    std::vector<uint64_t> col_valid; // [W]
+
+    StencilTopology(int H, int W, int k);
+    bool matches(int H, int W, int k) const { return (this->H == H) && (this->W == W) && (this->k == k); }
+};
+
 class PixGraph
 {
-    int H; int W;
-    std::vector<int> *adj; // adjacency
+    int T; int H; int W;
+    int *nbrs; int *num_nbrs; // adjacency, max_edges slots per node
     int *degrees; // degree of each vertex
     int N; // number of nodes
     int k; int ksize; // radius and half width - 1 of local edge kernel
+    int kt; int ktsize; // temporal radius and width of local edge kernel
     int max_edges;
     int step_counter;
     int *order; // order to alter labels
+    const float *affinities; // soft edges [N,max_edges], or NULL
+    float min_affinity; // soft edges below this don't vote
+    int *cand_labels; float *cand_weights; // [max_edges] candidates for the weighted mode
+    std::mt19937 rng; // shuffles the sweep and label orders
+    std::unique_ptr<GraphScratch> owned_scratch; // when not given one
+    GraphScratch *scratch; // storage
 
+    void useScratch(GraphScratch *scratch); // takes storage for N nodes from scratch, or from a new one if NULL
+    void addNbr(int v, int w){ nbrs[size_t(v)*max_edges + num_nbrs[v]++] = w; }
     void addEdge(int v, int e);
+    template <typename M> void addPackedEdges(const M *masks); // adds edges from per-node stencil bitmasks
+    void addTopologyEdges(const StencilTopology &topo, int v, uint64_t mask); // adds the in-view edges of a node's mask
 
 public:
-    PixGraph(int H, int W, int k, const bool *A);
-    ~PixGraph();
+    PixGraph(int H, int W, int k, const bool *A, GraphScratch *scratch = NULL);
+    PixGraph(int T, int H, int W, int k, int kt, const bool *A, GraphScratch *scratch = NULL); // spatiotemporal, edges [T*H*W,(2kt+1)*(2k+1)**2]
+    PixGraph(int H, int W, int k, const float *A, float min_affinity, GraphScratch *scratch = NULL); // soft edges, no adjacency lists
+    PixGraph(int H, int W, int k, const uint32_t *masks, GraphScratch *scratch = NULL); // packed edges, bit e of masks[v] is A[v,e]; (2k+1)**2 <= 32
+    PixGraph(int H, int W, int k, const uint64_t *masks, GraphScratch *scratch = NULL); // packed edges; (2k+1)**2 <= 64
+    PixGraph(const StencilTopology &topo, const bool *A, GraphScratch *scratch = NULL); // as above, with neighbors and bounds read from the tables
+    PixGraph(const StencilTopology &topo, const uint32_t *masks, GraphScratch *scratch = NULL);
+    PixGraph(const StencilTopology &topo, const uint64_t *masks, GraphScratch *scratch = NULL);
 
     int *V; // labels
     int num_labels; // current number of labels
 
+    void seed(unsigned seed){ rng.seed(seed); } // the sweep and label orders are drawn from seed
     void setNumLabels(bool relabel, bool shuffle, int offset); // counts the number of unique labels and reorders
-    void labelPropStep(bool defensive); // propagates labels
+    int labelPropStep(bool defensive); // propagates labels, returns how many changed
+    void labelPropStepWeighted(); // propagates labels by affinity-weighted votes over the soft edges
     void printLabels(int width); // to pretty-print labels
 };
+
+// Label propagation on the stencil graph of topo in tile_size x tile_size
+// tiles, for images too large to build a PixGraph for at once. Each tile
+// sweeps its pixels against a private copy of its labels plus a k pixel halo,
+// so tiles can be swept in parallel; halos are refreshed from the shared
+// labels V between sweeps. Afterwards, segments split along a seam are merged
+// when most of each one's cross-seam edges lead to the other. Requires
+// (2k+1)**2 <= 64.
+class TiledPixGraph
+{
+    struct Tile
+    {
+	int h0; int w0; int th; int tw; // interior
+	int hh0; int hw0; int hh; int hw; // interior plus halo, clipped to the image
+	std::vector<int> labels; // [hh*hw]
+	std::vector<uint64_t> masks; // [th*tw] in-view edges, self edge included
+	std::vector<int> order; // [th*tw] order to alter labels
+	std::vector<int> offsets; // [max_edges] neighbor offsets within labels
+	std::vector<int> votes; // neighbor labels of one pixel, kept across sweeps
+	std::mt19937 rng;
+    };
+
+    int H; int W; int N;
+    int tile_size;
+    const StencilTopology &topo;
+    std::vector<Tile> tiles;
+    std::vector<int> degrees; // [N] for defensive votes
+    std::mt19937 rng; // shuffles the merged labels
+
+    template <typename F> void initTileMasks(int t, F mask_of);
+
+public:
+    TiledPixGraph(const StencilTopology &topo, int tile_size, unsigned seed);
+
+    std::vector<int> V; // [N] labels
+
+    int numTiles() const { return tiles.size(); }
+    void initTile(int t, const bool *A); // loads tile t's edges from those of the whole image
+    void initTile(int t, const uint32_t *masks);
+    void initTile(int t, const uint64_t *masks);
+    int sweepTile(int t, bool defensive); // a labelprop step over tile t, then writes its labels to V; returns how many changed
+    void refreshHalo(int t); // copies tile t's halo labels from V
+    int mergeSeams(bool shuffle, int offset, int *labels); // merges split segments, writes [N] labels from offset and returns their number
+};
+
+class DisjointSets
+{
+    std::vector<int> parent;
+    std::vector<int> sizes;
+
+public:
+    DisjointSets(int n);
+
+    int find(int v); // root of v's set, with path halving
+    int unite(int a, int b); // merges the sets of roots a and b, returns the new root
+    int size(int root) const { return sizes[root]; }
+};
+
+// Felzenszwalb-Huttenlocher segmentation on the stencil of soft affinities
+// [H*W,(2k+1)**2]. Each pixel pair's edge weight is 1 - its mean affinity in
+// both directions; pairs below min_affinity are never merged. Segments merge
+// in increasing order of weight while the weight is within both segments'
+// internal difference plus scale/|segment|, then segments smaller than
+// min_size merge into their cheapest neighbor. Labels are numbered from
+// offset in order of first pixel; returns the number of segments.
+int felzenszwalbSegment(int H, int W, int k, const float *A, float min_affinity, float scale, int min_size, int offset, int *labels);
+
+// Merges the smallest of S segments (sizes[S]) into the neighbor they share
+// the most weight with until at most max_segments remain, where E weighted
+// segment pairs (pairs[e,2], weights[e]) connect segments in both directions.
+// A segment with no neighbors merges into the next smallest. segment_map[S]
+// gets each segment's new id, numbered in order of smallest member; returns
+// the number of segments left.
+int capSegments(int S, const int *sizes, int E, const int *pairs, const float *weights, int max_segments, int *segment_map);
+
+// Seed of the graph of example b of a batch run from seed. Examples draw
+// independent streams, so their labels don't depend on which thread runs them
+// or in what order.
+inline unsigned exampleSeed(unsigned seed, int b){
+    uint32_t x = seed + 0x9e3779b9u*uint32_t(b + 1);
+    x = (x ^ (x >> 16))*0x85ebca6bu;
+    x = (x ^ (x >> 13))*0xc2b2ae35u;
+    return x ^ (x >> 16);
+}
+
+// Batch drivers shared by the TF ops and libvvn_graph (see vvn_graph.h).
+// Each seeds example b's graph with exampleSeed(seed, b) and optionally
+// reports its phases to a PhaseTracer, fills per-example GraphStats and takes
+// its storage from a GraphScratch; all are skipped when NULL.
+
+// Receives the phases of a batch driver as it runs, e.g. to mark them on a
+// profiler timeline. Phases do not nest and end on the thread that began them.
+class PhaseTracer
+{
+public:
+    virtual ~PhaseTracer() {}
+    virtual void begin(const char *phase) = 0;
+    virtual void end() = 0;
+};
+
+struct GraphStats
+{
+    double total_seconds = 0; // wall time spent on the example
+    double build_seconds = 0; // graph construction
+    double propagate_seconds = 0; // labelprop sweeps, or the component search
+    double relabel_seconds = 0; // compacting and ordering the labels
+    int sweeps = 0;
+    std::vector<int> changes; // [sweeps] labels changed by each sweep
+};
+
+// Begins phase on tracer and adds its wall time to stats->*seconds, for
+// the lifetime of the scope; tracer, phase and stats may each be NULL.
+class ScopedPhase
+{
+    PhaseTracer *tracer;
+    double *seconds;
+    std::chrono::steady_clock::time_point start;
+
+public:
+    ScopedPhase(PhaseTracer *tracer, const char *phase, GraphStats *stats, double GraphStats::*seconds);
+    ~ScopedPhase();
+    void end(); // ends the phase before the scope does
+};
+
+// Finds the connected components of each of the b examples of [b,n,n] bool
+// edges among the points where mask[b,n] is set. ccids[b,n] numbers the C
+// largest components from 0 in decreasing order of size; masked points and
+// the rest of the components get C.
+void ccsearch(int b, int n, int C, const bool *edges, const bool *mask, int *ccids, PhaseTracer *tracer = NULL, GraphStats *stats = NULL,
+	      GraphScratch *scratch = NULL);
+
+// Runs num_steps of PixGraph labelprop on each of the B examples of stencil
+// edges [B,H*W,(2k+1)**2], or packed [B,H*W] bitmasks, reading neighbors from
+// topology when it is not NULL. labels[B,H*W] increase across examples and
+// num_segments[B] gets the number of labels in each.
+void assignLabels(int B, int H, int W, int k, int num_steps, bool defensive, const StencilTopology *topology,
+		  const bool *edges, int *labels, int *num_segments, unsigned seed, PhaseTracer *tracer = NULL, GraphStats *stats = NULL,
+		  GraphScratch *scratch = NULL);
+void assignLabels(int B, int H, int W, int k, int num_steps, bool defensive, const StencilTopology *topology,
+		  const uint32_t *edges, int *labels, int *num_segments, unsigned seed, PhaseTracer *tracer = NULL, GraphStats *stats = NULL,
+		  GraphScratch *scratch = NULL);
+void assignLabels(int B, int H, int W, int k, int num_steps, bool defensive, const StencilTopology *topology,
+		  const uint64_t *edges, int *labels, int *num_segments, unsigned seed, PhaseTracer *tracer = NULL, GraphStats *stats = NULL,
+		  GraphScratch *scratch = NULL);
+
+// Runs num_steps of Graph labelprop on B graphs of num_nodes[b] nodes joined
+// by the E edges[E,3] = (example, sender, receiver). Edges must be grouped by
+// example unless sort_edges. labels[sum(num_nodes)] increase across examples.
+void assignLabelsFC(int B, int E, const int *num_nodes, const int *edges, int *labels, int *num_segments, int num_steps, bool sort_edges,
+		    unsigned seed, PhaseTracer *tracer = NULL, GraphStats *stats = NULL, GraphScratch *scratch = NULL);
@@ -0,0 +1,148 @@
+#include "nndistance.h"
+#include "cpu_isa.h"
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <vector>
+
+static void nnsearchScalar(int b, int n, int m, int D, const float *xyz1, const float *xyz2, float *dist, int *idx,
+			   std::vector<float> & /* nothing is transposed */){
+    for (int i=0; i<b; i++){
+	for (int j=0; j<n; j++){
+	    const float *p = &xyz1[((long long)i*n + j)*D];
+	    double best = 0;
+	    int besti = 0;
+	    for (int k=0; k<m; k++){
+		// summed in float in dim order, as the unrolled kernels were
+		const float *q = &xyz2[((long long)i*m + k)*D];
+		float d = 0.0f;
+		for (int c=0; c<D; c++){
+		    float diff = q[c] - p[c];
+		    d += diff*diff;
+		}
+		if (k == 0 || d < best){
+		    best = d;
+		    besti = k;
+		}
+	    }
+	    dist[i*n + j] = best;
+	    idx[i*n + j] = besti;
+	}
+    }
+}
+
+#ifdef VVN_MULTIVERSION
+// nnsearch over L candidates at a time, with each example's xyz2 transposed to
+// [D,m] so that a dim of L candidates is one load. Each lane keeps the first
+// of its candidates at the least distance, so the lowest index wins ties as
+// in the scalar search. Distances are summed in the same order without fused
+// multiply-adds, which the clones' targets allow but would change the sums.
+// NaN distances compare false as in the scalar search, which also keeps
+// candidate 0 if its distance is NaN, so that case is checked first.
+template <int L>
+static inline __attribute__((always_inline)) void nnsearchLanes(int b, int n, int m, int D, const float *xyz1, const float *xyz2,
+								  float *dist, int *idx, std::vector<float> &soa){
+    typedef typename Lanes<L>::floatv floatv;
+    typedef typename Lanes<L>::intv intv;
+    if (m < L){
+	nnsearchScalar(b, n, m, D, xyz1, xyz2, dist, idx, soa);
+	return;
+    }
+    int full = m - m % L; // candidates in whole vectors, the rest are searched one by one
+    if (soa.size() < size_t(D)*full)
+	soa.resize(size_t(D)*full);
+    intv lane;
+    for (int l=0; l<L; l++)
+	lane[l] = l;
+    for (int i=0; i<b; i++){
+	const float *ex2 = &xyz2[(long long)i*m*D];
+	for (int k=0; k<full; k++)
+	    for (int c=0; c<D; c++)
+		soa[size_t(c)*full + k] = ex2[(long long)k*D + c];
+	for (int j=0; j<n; j++){
+	    const float *p = &xyz1[((long long)i*n + j)*D];
+	    float d0 = 0.0f;
+	    for (int c=0; c<D; c++){
+		float diff = ex2[c] - p[c];
+		d0 += diff*diff;
+	    }
+	    if (std::isnan(d0)){
+		dist[i*n + j] = d0;
+		idx[i*n + j] = 0;
+		continue;
+	    }
+	    floatv best_v = floatv{} + std::numeric_limits<float>::infinity();
+	    intv besti_v = intv{};
+	    for (int k=0; k<full; k+=L){
+		floatv d = floatv{};
+		for (int c=0; c<D; c++){
+		    floatv q;
+		    std::memcpy(&q, &soa[size_t(c)*full + k], sizeof(q));
+		    floatv diff = q - p[c];
+		    d += diff*diff;
+		}
+		intv closer = d < best_v;
+		best_v = closer ? d : best_v;
+		besti_v = closer ? lane + k : besti_v;
+	    }
+	    float best = std::numeric_limits<float>::infinity();
+	    int besti = 0;
+	    for (int l=0; l<L; l++){
+		if (best_v[l] < best || (best_v[l] == best && besti_v[l] < besti)){
+		    best = best_v[l];
+		    besti = besti_v[l];
+		}
+	    }
+	    for (int k=full; k<m; k++){
+		const float *q = &ex2[(long long)k*D];
+		float d = 0.0f;
+		for (int c=0; c<D; c++){
+		    float diff = q[c] - p[c];
+		    d += diff*diff;
+		}
+		if (d < best){
+		    best = d;
+		    besti = k;
+		}
+	    }
+	    dist[i*n + j] = best;
+	    idx[i*n + j] = besti;
+	}
+    }
+}
+
+VVN_TARGET_AVX2 __attribute__((optimize("fp-contract=off")))
+static void nnsearchAvx2(int b, int n, int m, int D, const float *xyz1, const float *xyz2, float *dist, int *idx,
+			 std::vector<float> &soa){
+    nnsearchLanes<8>(b, n, m, D, xyz1, xyz2, dist, idx, soa);
+}
+
+VVN_TARGET_AVX512 __attribute__((optimize("fp-contract=off")))
+static void nnsearchAvx512(int b, int n, int m, int D, const float *xyz1, const float *xyz2, float *dist, int *idx,
+			   std::vector<float> &soa){
+    nnsearchLanes<16>(b, n, m, D, xyz1, xyz2, dist, idx, soa);
+}
+#endif
+
+typedef void (*NnSearchKernel)(int, int, int, int, const float*, const float*, float*, int*, std::vector<float>&);
+
+static NnSearchKernel selectNnSearch(CpuIsa isa){
+#ifdef VVN_MULTIVERSION
+    if (isa == CPU_ISA_AVX512)
+	return nnsearchAvx512;
+    if (isa == CPU_ISA_AVX2)
+	return nnsearchAvx2;
+#endif
+    return nnsearchScalar;
+}
+
+// picked when the library is loaded, along with the ops' registrations
+static const NnSearchKernel nnsearch_kernel = selectNnSearch(cpuIsa());
+
+// transposed candidates of callers without a scratch, e.g. the NnDistance
+// kernels on TF's worker threads
+static thread_local std::vector<float> thread_scratch;
+
+void nnsearch(int b, int n, int m, int D, const float *xyz1, const float *xyz2, float *dist, int *idx, std::vector<float> *scratch){
+    nnsearch_kernel(b, n, m, D, xyz1, xyz2, dist, idx, scratch ? *scratch : thread_scratch);
+}
@@ -0,0 +1,12 @@
+#include <cstddef>
+#include <vector>
+
+// For each of the n points xyz1[i,j] of each of the b examples, finds the
+// nearest of the m points xyz2[i,:] in squared euclidean distance over all D
+// dims, as the CPU NnDistance ops do for D = 3, 6 and 12. dist and idx are
+// [b,n]; ties go to the lowest index and NaN distances never win, except
+// that a NaN distance to candidate 0 is kept as in the original kernels.
+// The vectorized searches transpose xyz2 into scratch, which only grows;
+// without one they use a buffer kept by the calling thread.
+void nnsearch(int b, int n, int m, int D, const float *xyz1, const float *xyz2, float *dist, int *idx,
+	      std::vector<float> *scratch = NULL);
@@ -0,0 +1,154 @@
+#include "particles.h"
+#include <algorithm>
+#include <cmath>
+
+using namespace std;
+
+ScreenGrid::ScreenGrid()
+    : N{0}, gh{0}, gw{0}, ymin{0.0f}, xmin{0.0f}, cell_size{1.0f}
+{
+}
+
+void ScreenGrid::build(int N, const float *coords, const float *depths, float p_radius){
+    // bins particles with finite coordinates and depths into cells of size >= p_radius
+    this->N = N;
+    particle_cells.assign(N, -1);
+
+    float ymax = 0.0f; float xmax = 0.0f;
+    int num_binned = 0;
+    for (int p=0; p<N; p++){
+	float y = coords[p*2 + 0]; float x = coords[p*2 + 1];
+	if (!std::isfinite(y) || !std::isfinite(x) || std::isnan(depths[p]))
+	    continue; // can neither occlude nor be occluded
+	if (num_binned == 0){
+	    ymin = ymax = y; xmin = xmax = x;
+	}
+	ymin = std::min(ymin, y); ymax = std::max(ymax, y);
+	xmin = std::min(xmin, x); xmax = std::max(xmax, x);
+	particle_cells[p] = 0;
+	num_binned++;
+    }
+
+    // grow the cells until there are O(N) of them; any size >= p_radius is correct,
+    // and the small margin keeps rounding in the cell index from skipping a neighbour
+    double cs = std::max(1.001*std::fabs(double(p_radius)), 1.0e-6);
+    double max_cells = 2.0*num_binned + 1.0;
+    double ext_h = double(ymax) - double(ymin); double ext_w = double(xmax) - double(xmin);
+    double num_cells = (std::floor(ext_h/cs) + 1.0) * (std::floor(ext_w/cs) + 1.0);
+    if (num_cells > max_cells)
+	cs *= std::sqrt(num_cells / max_cells);
+    while ((std::floor(ext_h/cs) + 1.0) * (std::floor(ext_w/cs) + 1.0) > max_cells)
+	cs *= 1.5;
+    cell_size = float(cs);
+    gh = int(std::floor(ext_h/cs)) + 1;
+    gw = int(std::floor(ext_w/cs)) + 1;
+
+    // counting sort of particles into cells
+    cell_offsets.assign(gh*gw + 1, 0);
+    for (int p=0; p<N; p++){
+	if (particle_cells[p] < 0)
+	    continue;
+	int ch = std::min(gh-1, int((coords[p*2 + 0] - ymin) / cell_size));
+	int cw = std::min(gw-1, int((coords[p*2 + 1] - xmin) / cell_size));
+	particle_cells[p] = ch*gw + cw;
+	cell_offsets[particle_cells[p] + 1]++;
+    }
+    for (int c=0; c<gh*gw; c++)
+	cell_offsets[c+1] += cell_offsets[c];
+    cell_members.resize(num_binned);
+    std::vector<int> fill(cell_offsets.begin(), cell_offsets.end()-1);
+    for (int p=0; p<N; p++){
+	if (particle_cells[p] >= 0)
+	    cell_members[fill[particle_cells[p]]++] = p;
+    }
+
+    // nearest first within each cell so scans can stop at the first particle behind p
+    for (int c=0; c<gh*gw; c++){
+	if (cell_offsets[c+1] - cell_offsets[c] > 1)
+	    std::sort(cell_members.begin() + cell_offsets[c], cell_members.begin() + cell_offsets[c+1],
+		      [depths](int i, int j){return depths[i] > depths[j];});
+    }
+}
+
+bool ScreenGrid::isOccluded(int p, const float *coords, const float *depths, float p_radius) const{
+    // p is occluded if any q within p_radius in image space is in front of it
+    int cell = particle_cells[p];
+    if (cell < 0)
+	return false;
+    int ch = cell / gw; int cw = cell % gw;
+    float y = coords[p*2 + 0]; float x = coords[p*2 + 1]; float z = depths[p];
+    float r2 = p_radius * p_radius;
+    for (int h=std::max(0, ch-1); h<=std::min(gh-1, ch+1); h++){
+	for (int w=std::max(0, cw-1); w<=std::min(gw-1, cw+1); w++){
+	    int c = h*gw + w;
+	    for (int i=cell_offsets[c]; i<cell_offsets[c+1]; i++){
+		int q = cell_members[i];
+		if (!(depths[q] > z))
+		    break; // the rest of the cell is behind p
+		float dh = coords[q*2 + 0] - y; float dw = coords[q*2 + 1] - x;
+		if (dh*dh + dw*dw < r2)
+		    return true;
+	    }
+	}
+    }
+    return false;
+}
+
+void occludeParticles(int N, const float *coords, const float *depths, const float *mask,
+		      float p_radius, float *not_occluded, ScreenGrid &grid){
+    // particles that are masked out or behind the camera are moved far off screen,
+    // as in the pairwise TF implementation, so they only occlude each other
+    float coord_mask_val = -100.0f * p_radius;
+    std::vector<float> pim_coords(N*2);
+    for (int p=0; p<N; p++){
+	float m = (depths[p] < 0.0f) ? mask[p] : 0.0f;
+	for (int d=0; d<2; d++)
+	    pim_coords[p*2 + d] = coords[p*2 + d]*m + coord_mask_val*(1.0f - m);
+    }
+
+    grid.build(N, pim_coords.data(), depths, p_radius);
+    for (int p=0; p<N; p++){
+	bool occluded = grid.isOccluded(p, pim_coords.data(), depths, p_radius);
+	not_occluded[p] = (occluded ? 0.0f : 1.0f) * mask[p]; // all fake particles are occluded
+    }
+}
+
+void projectParticles(int N, int D, int xyz_dim, const float *particles, const float *Vmat, const float *Pmat,
+		      int H, int W, float coord_max, float eps, float *coords, float *depths){
+    // agent-relative coordinates first and then the projection, as the TF path
+    // does; V's homogeneous row is dropped, so V can't be folded into P
+    float V[16];
+    for (int i=0; i<16; i++)
+	V[i] = (Vmat == NULL) ? float(i % 5 == 0) : Vmat[i];
+    const float *P = Pmat;
+
+    // branch-free over particles so the loop vectorizes
+    const float *xyz = &particles[xyz_dim];
+    for (int p=0; p<N; p++){
+	float x = xyz[p*D + 0]; float y = xyz[p*D + 1]; float z = xyz[p*D + 2];
+	float ax = V[0]*x + V[1]*y + V[2]*z + V[3];
+	float ay = V[4]*x + V[5]*y + V[6]*z + V[7];
+	float az = V[8]*x + V[9]*y + V[10]*z + V[11];
+	depths[p] = az;
+	float px = P[0]*ax + P[1]*ay + P[2]*az + P[3];
+	float py = P[4]*ax + P[5]*ay + P[6]*az + P[7];
+	float pw = P[12]*ax + P[13]*ay + P[14]*az + P[15];
+	px = px / (pw + eps); py = py / (pw + eps);
+
+	// y axis is inverted by convention
+	coords[p*2 + 0] = float(H) * (1.0f - 0.5f*(py + 1.0f));
+	coords[p*2 + 1] = float(W) * 0.5f * (px + 1.0f);
+    }
+    for (int i=0; i<N*2; i++){
+	float c = std::isfinite(coords[i]) ? coords[i] : coord_max;
+	coords[i] = std::max(std::min(c, coord_max), -coord_max);
+    }
+}
+
+void coordsToIndices(int N, int H, int W, const float *coords, int *inds){
+    // nearbyint rounds half to even, like tf.round
+    for (int p=0; p<N; p++){
+	inds[p*2 + 0] = int(std::min(std::max(std::nearbyint(coords[p*2 + 0]), 0.0f), float(H-1)));
+	inds[p*2 + 1] = int(std::min(std::max(std::nearbyint(coords[p*2 + 1]), 0.0f), float(W-1)));
+    }
+}
@@ -0,0 +1,39 @@
+#include <vector>
+
+// Screen-space bucketing of projected particles. Cells are at least p_radius
+// wide, so every particle within p_radius of a point lies in the 3x3 block of
+// cells around it. Particles in each cell are kept sorted nearest-first
+// (largest depth first, since depths are negative in front of the camera).
+class ScreenGrid
+{
+    int N; // number of particles
+    int gh; int gw; // grid height and width in cells
+    float ymin; float xmin; // grid origin
+    float cell_size;
+    std::vector<int> cell_offsets; // [gh*gw+1] CSR offsets into cell_members
+    std::vector<int> cell_members; // particle inds grouped by cell, nearest first
+    std::vector<int> particle_cells; // cell of each particle, -1 if not binned
+
+public:
+    ScreenGrid();
+
+    void build(int N, const float *coords, const float *depths, float p_radius);
+    bool isOccluded(int p, const float *coords, const float *depths, float p_radius) const;
+};
+
+// Computes the not_occluded_mask of one frame of N particles given their
+// (h,w) image coordinates, their depths and a validity mask.
+void occludeParticles(int N, const float *coords, const float *depths, const float *mask,
+		      float p_radius, float *not_occluded, ScreenGrid &grid);
+
+// Maps one frame of particles [N,D] (xyz in dims xyz_dim:xyz_dim+3) to (h,w)
+// image coordinates and depths. Vmat (optional, may be NULL) puts raw particles
+// in camera-relative coordinates and Pmat projects them; both are row-major 4x4.
+// As in raw_to_agent_particles, V's homogeneous row is dropped before Pmat is
+// applied, so V is applied first rather than folded into Pmat.
+// Non-finite coordinates become coord_max and all are clipped to +-coord_max.
+void projectParticles(int N, int D, int xyz_dim, const float *particles, const float *Vmat, const float *Pmat,
+		      int H, int W, float coord_max, float eps, float *coords, float *depths);
+
+// Rounds (h,w) coordinates half-to-even and clamps them to valid image indices.
+void coordsToIndices(int N, int H, int W, const float *coords, int *inds);
@@ -0,0 +1,98 @@
+#include "sampling.h"
+#include <algorithm>
+#include <limits>
+
+using namespace std;
+
+AliasTable::AliasTable()
+    : n{0}
+{
+}
+
+void AliasTable::build(int n, const float *weights){
+    this->n = n;
+    prob.resize(n); alias.resize(n); scaled.resize(n);
+    small.clear(); large.clear();
+
+    double total = 0.0;
+    for (int i=0; i<n; i++)
+	total += weights[i];
+
+    // scale so the mean weight is 1, then pair each light column with a heavy one
+    for (int i=0; i<n; i++){
+	scaled[i] = (total > 0.0) ? double(weights[i]) * n / total : 1.0;
+	alias[i] = i;
+	if (scaled[i] < 1.0)
+	    small.push_back(i);
+	else
+	    large.push_back(i);
+    }
+    while (!small.empty() && !large.empty()){
+	int s = small.back(); small.pop_back();
+	int l = large.back(); large.pop_back();
+	prob[s] = float(scaled[s]);
+	alias[s] = l;
+	scaled[l] = (scaled[l] + scaled[s]) - 1.0;
+	if (scaled[l] < 1.0)
+	    small.push_back(l);
+	else
+	    large.push_back(l);
+    }
+    // leftovers are 1 up to rounding
+    for (size_t i=0; i<large.size(); i++)
+	prob[large[i]] = 1.0f;
+    for (size_t i=0; i<small.size(); i++)
+	prob[small[i]] = 1.0f;
+}
+
+int AliasTable::sample(float u_col, float u_coin) const{
+    int i = std::min(n-1, int(double(u_col) * n));
+    return (u_coin < prob[i]) ? i : alias[i];
+}
+
+void farthestPointSample(int N, int D, const float *points, const float *mask, int P, int *inds, float *sampled){
+    // points are transposed to [D,N] so the distance updates are contiguous loops over n
+    std::vector<float> points_t(D*N);
+    for (int n=0; n<N; n++)
+	for (int d=0; d<D; d++)
+	    points_t[d*N + n] = points[n*D + d];
+
+    // invalid points start below any distance so they're never picked
+    std::vector<float> min_dists2(N); std::vector<float> dists2(N);
+    int first = -1; int num_valid = 0;
+    for (int n=0; n<N; n++){
+	bool valid = (mask[n] != 0.0f);
+	min_dists2[n] = valid ? std::numeric_limits<float>::max() : -1.0f;
+	if (valid){
+	    num_valid++;
+	    if (first < 0)
+		first = n;
+	}
+    }
+    int num_sampled = std::min(P, num_valid);
+    for (int p=0; p<P; p++){
+	inds[p] = (first < 0) ? 0 : first;
+	sampled[p] = 0.0f;
+    }
+
+    int last = first;
+    for (int p=0; p<num_sampled; p++){
+	inds[p] = last;
+	sampled[p] = 1.0f;
+	min_dists2[last] = -1.0f;
+	if (p+1 == num_sampled)
+	    break;
+
+	std::fill(dists2.begin(), dists2.end(), 0.0f);
+	for (int d=0; d<D; d++){
+	    const float *x = &points_t[d*N];
+	    float c = x[last];
+	    for (int n=0; n<N; n++)
+		dists2[n] += (x[n] - c)*(x[n] - c);
+	}
+	// sampled and invalid points stay negative
+	for (int n=0; n<N; n++)
+	    min_dists2[n] = (min_dists2[n] < 0.0f) ? min_dists2[n] : std::min(min_dists2[n], dists2[n]);
+	last = int(std::max_element(min_dists2.begin(), min_dists2.end()) - min_dists2.begin());
+    }
+}
@@ -0,0 +1,23 @@
+#include <vector>
+
+// Walker/Vose alias table for drawing from a discrete distribution over n
+// outcomes in O(1) per sample after an O(n) build.
+class AliasTable
+{
+    int n;
+    std::vector<float> prob; // probability of keeping each column rather than its alias
+    std::vector<int> alias;
+    std::vector<double> scaled; // worklists reused across builds
+    std::vector<int> small; std::vector<int> large;
+
+public:
+    AliasTable();
+
+    void build(int n, const float *weights); // nonnegative weights; uniform if they sum to 0
+    int sample(float u_col, float u_coin) const; // two uniforms in [0,1)
+};
+
+// Farthest-point sampling of P of the N points [N,D] whose mask is nonzero,
+// starting from the first of them. If fewer than P points are valid, the
+// remaining inds repeat the first sample and their sampled flag is 0.
+void farthestPointSample(int N, int D, const float *points, const float *mask, int P, int *inds, float *sampled);
@@ -0,0 +1,234 @@
+#include "segments.h"
+#include <vector>
+#include <limits>
+#include <algorithm>
+#include <cstdint>
+
+using namespace std;
+
+void rowsToCSR(int E, const int *rows, int R, int *offsets, int *order){
+    // stable counting sort
+    for (int i=0; i<=R; i++)
+	offsets[i] = 0;
+    for (int e=0; e<E; e++)
+	offsets[rows[e] + 1]++;
+    for (int i=0; i<R; i++)
+	offsets[i+1] += offsets[i];
+
+    // fill each row from its start, which leaves offsets[r] at the start of
+    // row r+1; shifting them back restores the offsets without a copy
+    for (int e=0; e<E; e++)
+	order[offsets[rows[e]]++] = e;
+    for (int i=R; i>0; i--)
+	offsets[i] = offsets[i-1];
+    offsets[0] = 0;
+}
+
+bool receiverCSR(int E, const int *edges, int B, int T, int N, bool right_receivers, int *offsets, int *order){
+    int rec_dim = right_receivers ? 3 : 2;
+    std::vector<int> rows(E);
+    for (int e=0; e<E; e++){
+	const int *edge = &edges[e*4];
+	if (edge[0] < 0 || edge[0] >= B || edge[1] < 0 || edge[1] >= T ||
+	    edge[2] < 0 || edge[2] >= N || edge[3] < 0 || edge[3] >= N)
+	    return false;
+	rows[e] = (edge[0]*T + edge[1])*N + edge[rec_dim];
+    }
+    rowsToCSR(E, rows.data(), B*T*N, offsets, order);
+    return true;
+}
+
+bool receiverIdxsCSR(int E, const int *receiver_idxs, int B, int T, int N, int *offsets, int *order){
+    std::vector<int> rows(E);
+    for (int e=0; e<E; e++){
+	const int *idx = &receiver_idxs[e*3];
+	if (idx[0] < 0 || idx[0] >= B || idx[1] < 0 || idx[1] >= T || idx[2] < 0 || idx[2] >= N)
+	    return false;
+	rows[e] = (idx[0]*T + idx[1])*N + idx[2];
+    }
+    rowsToCSR(E, rows.data(), B*T*N, offsets, order);
+    return true;
+}
+
+void segmentReduce(SegmentReduction reduction, int row_start, int row_limit, int C, const float *values,
+		   const int *offsets, const int *order, float *out){
+    for (int row=row_start; row<row_limit; row++){
+	float *out_row = &out[(long)row*C];
+	int count = offsets[row+1] - offsets[row];
+	float init = (reduction == SEGMENT_MAX) ? std::numeric_limits<float>::lowest() : 0.0f;
+	for (int c=0; c<C; c++)
+	    out_row[c] = init;
+	for (int i=offsets[row]; i<offsets[row+1]; i++){
+	    const float *v = &values[(long)order[i]*C];
+	    if (reduction == SEGMENT_MAX){
+		for (int c=0; c<C; c++)
+		    out_row[c] = std::max(out_row[c], v[c]);
+	    }
+	    else{
+		for (int c=0; c<C; c++)
+		    out_row[c] += v[c];
+	    }
+	}
+	if (reduction == SEGMENT_MEAN && count > 0){
+	    float norm = 1.0f / float(count);
+	    for (int c=0; c<C; c++)
+		out_row[c] *= norm;
+	}
+    }
+}
+
+void segmentReduceGrad(SegmentReduction reduction, int row_start, int row_limit, int C, const float *values,
+		       const int *offsets, const int *order, const float *out, const float *grad_out, float *grad_values){
+    std::vector<float> num_ties(C);
+    for (int row=row_start; row<row_limit; row++){
+	const float *g = &grad_out[(long)row*C];
+	int count = offsets[row+1] - offsets[row];
+	if (reduction == SEGMENT_MAX){
+	    // split evenly between values tied for the max
+	    const float *m = &out[(long)row*C];
+	    std::fill(num_ties.begin(), num_ties.end(), 0.0f);
+	    for (int i=offsets[row]; i<offsets[row+1]; i++){
+		const float *v = &values[(long)order[i]*C];
+		for (int c=0; c<C; c++)
+		    num_ties[c] += (v[c] == m[c]) ? 1.0f : 0.0f;
+	    }
+	    for (int i=offsets[row]; i<offsets[row+1]; i++){
+		const float *v = &values[(long)order[i]*C];
+		float *gv = &grad_values[(long)order[i]*C];
+		for (int c=0; c<C; c++)
+		    gv[c] = (v[c] == m[c]) ? g[c] / num_ties[c] : 0.0f;
+	    }
+	}
+	else{
+	    float norm = (reduction == SEGMENT_MEAN && count > 0) ? 1.0f / float(count) : 1.0f;
+	    for (int i=offsets[row]; i<offsets[row+1]; i++){
+		float *gv = &grad_values[(long)order[i]*C];
+		for (int c=0; c<C; c++)
+		    gv[c] = g[c] * norm;
+	    }
+	}
+    }
+}
+
+void segmentBorderCounts(int H, int W, int N, const int *segment_ids, const bool *pixel_mask, int *border_counts){
+    std::fill(border_counts, border_counts + N*N, 0);
+    for (int h=0; h<H; h++){
+	for (int w=0; w<W; w++){
+	    if (pixel_mask != NULL && !pixel_mask[h*W + w])
+		continue;
+	    int i = segment_ids[h*W + w];
+	    // distinct neighbouring segments, counted once per pixel
+	    int neighbors[4]; int num_neighbors = 0;
+	    int nh[4] = {h, h, h-1, h+1}; int nw[4] = {w-1, w+1, w, w};
+	    for (int d=0; d<4; d++){
+		if (nh[d] < 0 || nh[d] >= H || nw[d] < 0 || nw[d] >= W)
+		    continue;
+		int j = segment_ids[nh[d]*W + nw[d]];
+		if (j == i || std::find(neighbors, neighbors + num_neighbors, j) != neighbors + num_neighbors)
+		    continue;
+		neighbors[num_neighbors++] = j;
+		border_counts[i*N + j]++;
+	    }
+	}
+    }
+}
+
+void segmentAdjacency(int H, int W, int k, int N, const int *segment_ids, const bool *edges,
+		      std::vector<int> &offsets, std::vector<int> &nbrs, std::vector<int> &counts, std::vector<float> &agreement){
+    int HW = H*W; int ksize = 2*k + 1; int K = ksize*ksize;
+
+    // pixels grouped by segment
+    std::vector<int> pix_offsets(N + 1); std::vector<int> pixels(HW);
+    rowsToCSR(HW, segment_ids, N, pix_offsets.data(), pixels.data());
+
+    // sparse accumulator over each segment's neighbours; slot[j] is valid while last[j] == i
+    std::vector<int> last(N, -1); std::vector<int> slot(N, 0);
+    std::vector<float> agree_sum;
+    offsets.assign(1, 0); nbrs.clear(); counts.clear(); agreement.clear();
+    for (int i=0; i<N; i++){
+	int row_start = int(nbrs.size());
+	for (int idx=pix_offsets[i]; idx<pix_offsets[i+1]; idx++){
+	    int p = pixels[idx];
+	    int row = p / W; int col = p % W;
+	    for (int e=0; e<K; e++){
+		int h = row + (e / ksize) - k; int w = col + (e % ksize) - k;
+		if (h < 0 || h >= H || w < 0 || w >= W)
+		    continue;
+		int q = h*W + w;
+		int j = segment_ids[q];
+		if (j == i)
+		    continue;
+		if (last[j] != i){
+		    last[j] = i;
+		    slot[j] = int(nbrs.size());
+		    nbrs.push_back(j); counts.push_back(0); agree_sum.push_back(0.0f);
+		}
+		// the mirrored slot K-1-e is q's edge back to p
+		counts[slot[j]]++;
+		agree_sum[slot[j]] += 0.5f * (float(edges[int64_t(p)*K + e]) + float(edges[int64_t(q)*K + K-1-e]));
+	    }
+	}
+
+	// neighbours in increasing order
+	int row_end = int(nbrs.size());
+	std::vector<int> perm(row_end - row_start);
+	for (int r=0; r<row_end-row_start; r++)
+	    perm[r] = row_start + r;
+	std::sort(perm.begin(), perm.end(), [&](int a, int b){return nbrs[a] < nbrs[b];});
+	std::vector<int> row_nbrs(perm.size()); std::vector<int> row_counts(perm.size());
+	for (size_t r=0; r<perm.size(); r++){
+	    row_nbrs[r] = nbrs[perm[r]]; row_counts[r] = counts[perm[r]];
+	    agreement.push_back(agree_sum[perm[r]] / float(counts[perm[r]]));
+	}
+	std::copy(row_nbrs.begin(), row_nbrs.end(), nbrs.begin() + row_start);
+	std::copy(row_counts.begin(), row_counts.end(), counts.begin() + row_start);
+	offsets.push_back(row_end);
+    }
+}
+
+void matchSegmentsIoU(int N, const int *segment_ids, int S, const int *track_ids, int T, float iou_thresh, int *matches){
+    std::vector<int> track_sizes(T, 0);
+    for (int p=0; p<N; p++)
+	track_sizes[track_ids[p]]++;
+
+    // co-occurrence counts of each segment's tracks; slot[t] is valid while last[t] == s
+    std::vector<int> pix_offsets(S + 1); std::vector<int> pixels(N);
+    rowsToCSR(N, segment_ids, S, pix_offsets.data(), pixels.data());
+    std::vector<int> last(T, -1); std::vector<int> slot(T, 0);
+    std::vector<int> tracks; std::vector<int> counts;
+    struct Candidate { float iou; int s; int t; };
+    std::vector<Candidate> candidates;
+    for (int s=0; s<S; s++){
+	tracks.clear(); counts.clear();
+	for (int idx=pix_offsets[s]; idx<pix_offsets[s+1]; idx++){
+	    int t = track_ids[pixels[idx]];
+	    if (last[t] != s){
+		last[t] = s;
+		slot[t] = int(tracks.size());
+		tracks.push_back(t); counts.push_back(0);
+	    }
+	    counts[slot[t]]++;
+	}
+	int size = pix_offsets[s+1] - pix_offsets[s];
+	for (size_t r=0; r<tracks.size(); r++){
+	    float iou = float(counts[r]) / float(size + track_sizes[tracks[r]] - counts[r]);
+	    if (iou >= iou_thresh)
+		candidates.push_back({iou, s, tracks[r]});
+	}
+    }
+
+    // greedy one-to-one assignment, ties to the lower segment then track
+    std::sort(candidates.begin(), candidates.end(), [](const Candidate &a, const Candidate &b){
+	    return (a.iou > b.iou) || (a.iou == b.iou && (a.s < b.s || (a.s == b.s && a.t < b.t)));
+	});
+    std::vector<bool> track_used(T, false);
+    for (int s=0; s<S; s++)
+	matches[s] = -1;
+    for (size_t c=0; c<candidates.size(); c++){
+	const Candidate &cand = candidates[c];
+	if (matches[cand.s] >= 0 || track_used[cand.t])
+	    continue;
+	matches[cand.s] = cand.t;
+	track_used[cand.t] = true;
+    }
+}
@@ -0,0 +1,49 @@
+#include <vector>
+
+// Groups E items by their flat row id rows[e] in [0,R) into CSR form: offsets
+// has R+1 entries and order lists item inds row by row, in their original
+// relative order so that reductions over a row are deterministic.
+void rowsToCSR(int E, const int *rows, int R, int *offsets, int *order);
+
+// Groups E edges (batch_idx, time_idx, lnode_idx, rnode_idx) by receiver into
+// CSR form over the B*T*N receiver rows of a [B,T,N] node set. The receiver
+// is the rnode if right_receivers, else the lnode. Returns false if any index
+// is out of range.
+bool receiverCSR(int E, const int *edges, int B, int T, int N, bool right_receivers, int *offsets, int *order);
+
+// As above for E receiver indices (batch_idx, time_idx, receiver_idx).
+bool receiverIdxsCSR(int E, const int *receiver_idxs, int B, int T, int N, int *offsets, int *order);
+
+// Reduces the C-dim rows of values grouped by CSR rows [row_start, row_limit)
+// into out[row,C] by sum, mean or max. Empty rows are 0 for sum and mean and
+// the lowest float for max, as in tf.math.unsorted_segment_*.
+enum SegmentReduction {SEGMENT_SUM, SEGMENT_MEAN, SEGMENT_MAX};
+void segmentReduce(SegmentReduction reduction, int row_start, int row_limit, int C, const float *values,
+		   const int *offsets, const int *order, float *out);
+
+// Gradient of segmentReduce with respect to the values. For max the gradient
+// is split evenly between the values tied for the max.
+void segmentReduceGrad(SegmentReduction reduction, int row_start, int row_limit, int C, const float *values,
+		       const int *offsets, const int *order, const float *out, const float *grad_out, float *grad_values);
+
+// Counts, for each pair of segments (i,j) of an [H,W] map of segment ids in
+// [0,N), the pixels of segment i with at least one 4-neighbour in segment j.
+// Only pixels set in pixel_mask [H,W] are counted, or all if it is NULL.
+// border_counts is [N,N] and is overwritten.
+void segmentBorderCounts(int H, int W, int N, const int *segment_ids, const bool *pixel_mask, int *border_counts);
+
+// Region adjacency graph of an [H,W] map of segment ids in [0,N) under the
+// (2k+1)^2 stencil edges [H*W,(2k+1)^2] that produced it. For each segment i,
+// nbrs[offsets[i]:offsets[i+1]] are the segments j != i that some stencil
+// neighbour pair (p in i, q in j) connects, in increasing order. counts are
+// the number of such pairs and agreement the mean of the pairs' stencil edges
+// in both directions, so both are symmetric in (i,j).
+void segmentAdjacency(int H, int W, int k, int N, const int *segment_ids, const bool *edges,
+		      std::vector<int> &offsets, std::vector<int> &nbrs, std::vector<int> &counts, std::vector<float> &agreement);
+
+// Matches the S segments of an [N] map of segment ids in [0,S) to the tracks
+// of the previous frame's [N] map of track ids in [0,T) by pixel overlap IoU,
+// from the co-occurrence counts of each segment's pixels. Pairs are matched
+// greedily in decreasing IoU, each segment and track at most once, while the
+// IoU is at least iou_thresh. matches[S] gets each segment's track, or -1.
+void matchSegmentsIoU(int N, const int *segment_ids, int S, const int *track_ids, int T, float iou_thresh, int *matches);
@@ -0,0 +1,13 @@
+#include "tensorflow/core/lib/core/threadpool.h"
+#include "tensorflow/core/platform/cpu_info.h"
+#include "tensorflow/core/platform/env.h"
+
+// Pool that the asynchronous CPU graph ops run their work on, so a long
+// segmentation holds no executor thread while accelerator ops in the same
+// step wait to be scheduled. Each op library gets one, created on first use
+// and kept for the life of the process.
+inline tensorflow::thread::ThreadPool *graphOpPool(){
+    static tensorflow::thread::ThreadPool *pool = new tensorflow::thread::ThreadPool(
+	tensorflow::Env::Default(), "vvn_graph_ops", tensorflow::port::NumSchedulableCPUs());
+    return pool;
+}
@@ -3,12 +3,35 @@
 rm ./tf_connected_components.so
 rm ./tf_labelprop.so
 rm ./tf_labelprop_fc.so
+rm ./tf_particle_occlusion.so
+rm ./tf_graphconv.so
+rm ./tf_segment_reduce.so
+rm ./tf_image_sampling.so
+rm ./tf_edge_correction.so
+rm ./tf_hierarchy.so
+rm ./tf_point_sampling.so
+rm ./tf_hierarchical_grouping.so
+rm ./tf_segment_tracker.so
+rm ./graph_benchmarks
+rm ./libvvn_graph.so
+rm ./vvn_segment
 
 TF_CFLAGS=( $(python -c 'import tensorflow as tf; print(" ".join(tf.sysconfig.get_compile_flags()))') )
 TF_LFLAGS=( $(python -c 'import tensorflow as tf; print(" ".join(tf.sysconfig.get_link_flags()))') )
 echo $TF_CFLAGS
 echo $TF_LFLAGS
-g++ -std=c++11 -shared graphs.cc tf_connected_components.cc -o tf_connected_components.so -fPIC ${TF_CFLAGS[@]} ${TF_LFLAGS[@]} -O2
-g++ -std=c++11 -shared graphs.cc tf_labelprop.cc -o tf_labelprop.so -fPIC ${TF_CFLAGS[@]} ${TF_LFLAGS[@]} -O2
-g++ -std=c++11 -shared graphs.cc tf_labelprop_fc.cc -o tf_labelprop_fc.so -fPIC ${TF_CFLAGS[@]} ${TF_LFLAGS[@]} -O2
-
+g++ -std=c++11 -shared graphs.cc cpu_isa.cc tf_connected_components.cc -o tf_connected_components.so -fPIC ${TF_CFLAGS[@]} ${TF_LFLAGS[@]} -O2
+g++ -std=c++11 -shared graphs.cc cpu_isa.cc segments.cc tf_labelprop.cc -o tf_labelprop.so -fPIC ${TF_CFLAGS[@]} ${TF_LFLAGS[@]} -O2
+g++ -std=c++11 -shared graphs.cc cpu_isa.cc tf_labelprop_fc.cc -o tf_labelprop_fc.so -fPIC ${TF_CFLAGS[@]} ${TF_LFLAGS[@]} -O2
+g++ -std=c++11 -shared particles.cc tf_particle_occlusion.cc -o tf_particle_occlusion.so -fPIC ${TF_CFLAGS[@]} ${TF_LFLAGS[@]} -O2
+g++ -std=c++11 -shared segments.cc tf_graphconv.cc -o tf_graphconv.so -fPIC ${TF_CFLAGS[@]} ${TF_LFLAGS[@]} -O2
+g++ -std=c++11 -shared segments.cc tf_segment_reduce.cc -o tf_segment_reduce.so -fPIC ${TF_CFLAGS[@]} ${TF_LFLAGS[@]} -O2
+g++ -std=c++11 -shared sampling.cc tf_image_sampling.cc -o tf_image_sampling.so -fPIC ${TF_CFLAGS[@]} ${TF_LFLAGS[@]} -O2
+g++ -std=c++11 -shared segments.cc tf_edge_correction.cc -o tf_edge_correction.so -fPIC ${TF_CFLAGS[@]} ${TF_LFLAGS[@]} -O2
+g++ -std=c++11 -shared segments.cc tf_hierarchy.cc -o tf_hierarchy.so -fPIC ${TF_CFLAGS[@]} ${TF_LFLAGS[@]} -O2
+g++ -std=c++11 -shared sampling.cc tf_point_sampling.cc -o tf_point_sampling.so -fPIC ${TF_CFLAGS[@]} ${TF_LFLAGS[@]} -O2
+g++ -std=c++11 -shared graphs.cc cpu_isa.cc tf_hierarchical_grouping.cc -o tf_hierarchical_grouping.so -fPIC ${TF_CFLAGS[@]} ${TF_LFLAGS[@]} -O2
+g++ -std=c++11 -shared segments.cc tf_segment_tracker.cc -o tf_segment_tracker.so -fPIC ${TF_CFLAGS[@]} ${TF_LFLAGS[@]} -O2
+g++ -std=c++11 -pthread graphs.cc nndistance.cc cpu_isa.cc graph_benchmarks.cc -o graph_benchmarks -O2
+g++ -std=c++11 -shared graphs.cc nndistance.cc cpu_isa.cc vvn_graph.cc -o libvvn_graph.so -fPIC -O2
+g++ -std=c++11 -pthread vvn_segment.cc -o vvn_segment -L. -lvvn_graph -Wl,-rpath,'$ORIGIN' -O2
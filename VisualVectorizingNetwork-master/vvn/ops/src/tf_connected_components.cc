@@ -2,30 +2,50 @@
 #include "tensorflow/core/framework/op_kernel.h"
 #include "tensorflow/core/framework/shape_inference.h"
 #include "graphs.h"
+#include "tf_async_pool.h"
+#include "tf_graph_trace.h"
 
 using namespace tensorflow;
 
 // Finds the C largest connected components in each example of a [B,N,N] batch of boolean graph edge matricies
+// If debug_stats, debug gets the per-example timings of graph building, search and ranking (see writeGraphStats)
 REGISTER_OP("ConnectedComponents")
     .Attr("num_ccs: int")
+    .Attr("debug_stats: bool = false")
     .Input("edges: bool")
     .Input("mask: bool")
     .Output("ccids: int32")
+    .Output("debug: float32") // [B,5] per-example stats, or [0,0]
     .SetShapeFn([](::tensorflow::shape_inference::InferenceContext* context) {
+	    bool debug_stats;
+	    TF_RETURN_IF_ERROR(context->GetAttr("debug_stats", &debug_stats));
 	    context->set_output(0, context->input(1));
+	    if (debug_stats)
+		context->set_output(1, context->Matrix(context->Dim(context->input(1),0), graphStatsColumns(0)));
+	    else
+		context->set_output(1, context->Matrix(0, 0));
 	    return Status::OK();
 	});
 
-static void ccsearch(int b, int n, int C, const bool* edges, const bool* mask, int* ccids);
-
-class ConnectedComponentsOp : public OpKernel{
+class ConnectedComponentsOp : public AsyncOpKernel{
 private:
     int num_ccs_;
+    bool debug_stats_;
+    ScratchPool scratch_pool_; // graph storage kept across calls, one per concurrent call
 public:
-    explicit ConnectedComponentsOp(OpKernelConstruction* context):OpKernel(context){
+    explicit ConnectedComponentsOp(OpKernelConstruction* context):AsyncOpKernel(context){
 	OP_REQUIRES_OK(context, context->GetAttr("num_ccs", &num_ccs_));
+	OP_REQUIRES_OK(context, context->GetAttr("debug_stats", &debug_stats_));
     }
-    void Compute(OpKernelContext * context) override {
+    void ComputeAsync(OpKernelContext * context, DoneCallback done) override {
+	// run on the graph op pool and signal done when finished or failed
+	graphOpPool()->Schedule([this, context, done](){
+		findComponents(context);
+		done();
+	    });
+    }
+    void findComponents(OpKernelContext * context){
+	profiler::TraceMe trace("ConnectedComponents");
 
 	const Tensor& edges_tensor=context->input(0);
 	const Tensor& mask_tensor=context->input(1);
@@ -44,58 +64,17 @@ public:
 	auto ccids_flat=ccids_tensor->flat<int>();
 	int* ccids=&(ccids_flat(0));
 	// find up to num_ccs
-	ccsearch(b, n, num_ccs_, edges, mask, ccids);
+	TraceMePhases tracer;
+	std::vector<GraphStats> stats(debug_stats_ ? b : 0);
+	ScopedScratch scratch(scratch_pool_);
+	ccsearch(b, n, num_ccs_, edges, mask, ccids, &tracer, debug_stats_ ? stats.data() : NULL, scratch.get());
+
+	Tensor* debug_tensor=NULL;
+	TensorShape debug_shape = debug_stats_ ? TensorShape{b, graphStatsColumns(0)} : TensorShape{0, 0};
+	OP_REQUIRES_OK(context,context->allocate_output(1,debug_shape,&debug_tensor));
+	if (debug_stats_)
+	    writeGraphStats(stats, 0, debug_tensor->flat<float>().data());
     }
 };
 
 REGISTER_KERNEL_BUILDER(Name("ConnectedComponents").Device(DEVICE_CPU), ConnectedComponentsOp);
-
-using namespace std;
-
-// finds the C largest connected components for each n particles in a batch of size b
-// returns cc_ids with lower id numbers corresponding to larger connected components
-static void ccsearch(int b, int n, int C, const bool* edges, const bool* mask, int* ccids){
-    // loop across batches
-    for (int i=0; i<b; i++){
-	bool visited[n]; // which particles/nodes have been visited
-
-	for (int v=0; v<n; v++){
-	    visited[v] = (mask[i*n + v]) ? false : true; // if a particle is fake, never visit
-	}
-
-	// construct the graph for this example and add edges
-	Graph G(n, false);
-	for (int v=0; v<n; v++)
-	    // only need to do lower triangle + diagonal of edge mat
-	    for (int w=0; w<=v; w++){
-		if (edges[i*n*n + v*n + w])
-		    G.addEdge(v,w);
-	    }
-
-	// compute the connected components
-	G.connectedComponents(visited);
-
-	// sort by size, largest first
-	int num_ccs = G.cc_sizes.size();
-	vector<int> cc_order(num_ccs);
-	std::iota(cc_order.begin(), cc_order.end(), 0);
-	std::sort(cc_order.begin(), cc_order.begin()+num_ccs,
-		  [&G](int i, int j) {return G.cc_sizes[i]>G.cc_sizes[j];});
-
-	// how to map originally-assigned cc_ids to size-ranked cc_ids up to C (max components)
-	vector<int> cc_map(num_ccs);
-	for (int idx = 0; idx < num_ccs; idx++)
-	    cc_map[cc_order[idx]] = idx;
-
-	// assign cc ids only to the largest connected components
-	// fake particles and any cc >= C is set to cc_id = C
-	for (int v=0; v<n; v++){
-	    int v_id = G.cc_ids[v];
-	    if (v_id > 0)
-		ccids[i*n + v] = (cc_map[v_id] < C) ? cc_map[v_id] : C;
-	    else
-		ccids[i*n + v] = C;
-	}
-    }
-}
-
@@ -0,0 +1,267 @@
+#include "tensorflow/core/framework/op.h"
+#include "tensorflow/core/framework/op_kernel.h"
+#include "tensorflow/core/framework/shape_inference.h"
+#include "tensorflow/core/util/work_sharder.h"
+#include "segments.h"
+
+using namespace tensorflow;
+
+// Fuses build_edge_corrections and update_edges from ops/graphical.py. In one
+// pass over the pixels of each example it accumulates each level 0 segment's
+// mean reconstruction error (image_pred - image_gt) and mean absolute error,
+// and marks the pixels on a level 1 segment edge and on an image edge. Both
+// edges are read off the stencil edges the segments came from: a pixel is on a
+// segment edge if a neighbour in its stencil is in another level 1 segment,
+// and on an image edge if its edge to an in-image neighbour is off. As in
+// find_true_edges, an edge between valid level 0 segments i,j is true if they
+// border at num_pixels_thresh pixels on a segment edge but not an image edge,
+// and if border_false_edges it is also false if they border at as many where
+//     image_edges_weight * image_edge - segment_edge > 0
+// If recon_false_edges, an edge between bordering valid segments i,j is false,
+// as in find_false_edges, if
+//     (sum_c |err|_i > thresh_gate or sum_c |err|_j > thresh_gate) and
+//     sum_c dist(err_i - err_j) > thresh
+// The false and true edges are then applied to edges_prev with the same
+// conflict_resolution semantics as update_edges. Level 0 segment ids are
+// offset by their minimum per example and clamped to N-1, as in
+// compute_segment_border_mats.
+
+REGISTER_OP("CorrectSegmentEdges")
+    .Attr("k: int >= 0") // half width of the stencil
+    .Attr("thresh_gate: float = 0.25") // min summed abs error for a segment's edges to be corrected
+    .Attr("thresh: float = 0.25") // min error distance between segments for a false edge
+    .Attr("num_pixels_thresh: int = 2") // min border pixels for two segments to be bordering
+    .Attr("image_edges_weight: float = 1.0") // of image edges against segment edges for border false edges
+    .Attr("recon_false_edges: bool = true")
+    .Attr("border_false_edges: bool = false")
+    .Attr("dist_func: {'abs', 'square'} = 'abs'")
+    .Attr("conflict_resolution: {'true', 'false', 'unchanged'} = 'unchanged'")
+    .Input("edges_prev: bool") // [B,N,N]
+    .Input("stencil_edges: bool") // [B,H*W,(2k+1)**2]
+    .Input("segments_lvl0: int32") // [B,H,W] segments whose edges are corrected
+    .Input("segments_lvl1: int32") // [B,H,W]
+    .Input("image_pred: float32") // [B,H,W,C]
+    .Input("image_gt: float32") // [B,H,W,C]
+    .Input("valid_nodes: bool") // [B,N,1]
+    .Output("edges_next: bool") // [B,N,N]
+    .Output("false_edges: bool") // [B,N,N] edges that should become 0
+    .Output("true_edges: bool") // [B,N,N] edges that should become 1
+    .SetShapeFn([](::tensorflow::shape_inference::InferenceContext* c) {
+	    c->set_output(0, c->input(0));
+	    c->set_output(1, c->input(0));
+	    c->set_output(2, c->input(0));
+	    return Status::OK();
+	});
+
+enum ConflictResolution {CONFLICT_UNCHANGED, CONFLICT_TRUE, CONFLICT_FALSE};
+
+struct EdgeCorrectionParams{
+    int H; int W; int C; int N;
+    int k;
+    float thresh_gate;
+    float thresh;
+    int num_pixels_thresh;
+    float image_edges_weight;
+    bool recon_false_edges;
+    bool border_false_edges;
+    bool square_dist;
+    ConflictResolution conflict_resolution;
+};
+
+static ConflictResolution parseConflictResolution(const string &conflict_resolution){
+    if (conflict_resolution == "true")
+	return CONFLICT_TRUE;
+    else if (conflict_resolution == "false")
+	return CONFLICT_FALSE;
+    return CONFLICT_UNCHANGED;
+}
+
+static void correctEdges(const EdgeCorrectionParams &p, const bool *edges_prev, const bool *stencil_edges, const int *segments_lvl0,
+			 const int *segments_lvl1, const float *image_pred, const float *image_gt, const bool *valid_nodes,
+			 bool *edges_next, bool *false_edges, bool *true_edges);
+
+class CorrectSegmentEdgesOp : public OpKernel{
+private:
+    EdgeCorrectionParams params_;
+public:
+    explicit CorrectSegmentEdgesOp(OpKernelConstruction *context):OpKernel(context){
+	string dist_func, conflict_resolution;
+	OP_REQUIRES_OK(context, context->GetAttr("k", &params_.k));
+	OP_REQUIRES_OK(context, context->GetAttr("thresh_gate", &params_.thresh_gate));
+	OP_REQUIRES_OK(context, context->GetAttr("thresh", &params_.thresh));
+	OP_REQUIRES_OK(context, context->GetAttr("num_pixels_thresh", &params_.num_pixels_thresh));
+	OP_REQUIRES_OK(context, context->GetAttr("image_edges_weight", &params_.image_edges_weight));
+	OP_REQUIRES_OK(context, context->GetAttr("recon_false_edges", &params_.recon_false_edges));
+	OP_REQUIRES_OK(context, context->GetAttr("border_false_edges", &params_.border_false_edges));
+	OP_REQUIRES_OK(context, context->GetAttr("dist_func", &dist_func));
+	OP_REQUIRES_OK(context, context->GetAttr("conflict_resolution", &conflict_resolution));
+	params_.square_dist = (dist_func == "square");
+	params_.conflict_resolution = parseConflictResolution(conflict_resolution);
+    }
+    void Compute(OpKernelContext *context) override {
+	const Tensor &edges_prev_tensor = context->input(0);
+	const Tensor &stencil_tensor = context->input(1);
+	const Tensor &lvl0_tensor = context->input(2);
+	const Tensor &lvl1_tensor = context->input(3);
+	const Tensor &pred_tensor = context->input(4);
+	const Tensor &gt_tensor = context->input(5);
+	const Tensor &valid_tensor = context->input(6);
+	OP_REQUIRES(context, edges_prev_tensor.dims()==3, errors::InvalidArgument("CorrectSegmentEdges requires edges_prev of shape (B,N,N)"));
+	int B = edges_prev_tensor.shape().dim_size(0);
+	int N = edges_prev_tensor.shape().dim_size(1);
+	OP_REQUIRES(context, edges_prev_tensor.shape()==(TensorShape{B,N,N}), errors::InvalidArgument("CorrectSegmentEdges requires edges_prev of shape (B,N,N)"));
+	OP_REQUIRES(context, lvl0_tensor.dims()==3 && lvl0_tensor.shape().dim_size(0)==B, errors::InvalidArgument("CorrectSegmentEdges requires segments_lvl0 of shape (B,H,W)"));
+	int H = lvl0_tensor.shape().dim_size(1);
+	int W = lvl0_tensor.shape().dim_size(2);
+	int K = (2*params_.k + 1)*(2*params_.k + 1);
+	OP_REQUIRES(context, lvl1_tensor.shape()==(TensorShape{B,H,W}), errors::InvalidArgument("CorrectSegmentEdges requires segments_lvl1 of shape (B,H,W)"));
+	OP_REQUIRES(context, stencil_tensor.shape()==(TensorShape{B,int64(H)*W,K}), errors::InvalidArgument("CorrectSegmentEdges requires stencil_edges of shape (B,H*W,(2k+1)**2)"));
+	OP_REQUIRES(context, pred_tensor.dims()==4, errors::InvalidArgument("CorrectSegmentEdges requires image_pred of shape (B,H,W,C)"));
+	int C = pred_tensor.shape().dim_size(3);
+	OP_REQUIRES(context, pred_tensor.shape()==(TensorShape{B,H,W,C}), errors::InvalidArgument("CorrectSegmentEdges requires image_pred of shape (B,H,W,C)"));
+	OP_REQUIRES(context, gt_tensor.shape()==(TensorShape{B,H,W,C}), errors::InvalidArgument("CorrectSegmentEdges requires image_gt of shape (B,H,W,C)"));
+	OP_REQUIRES(context, valid_tensor.shape()==(TensorShape{B,N,1}), errors::InvalidArgument("CorrectSegmentEdges requires valid_nodes of shape (B,N,1)"));
+	OP_REQUIRES(context, N > 0, errors::InvalidArgument("CorrectSegmentEdges requires N > 0"));
+
+	Tensor *edges_next_tensor = NULL;
+	OP_REQUIRES_OK(context, context->allocate_output(0, TensorShape{B,N,N}, &edges_next_tensor));
+	Tensor *false_edges_tensor = NULL;
+	OP_REQUIRES_OK(context, context->allocate_output(1, TensorShape{B,N,N}, &false_edges_tensor));
+	Tensor *true_edges_tensor = NULL;
+	OP_REQUIRES_OK(context, context->allocate_output(2, TensorShape{B,N,N}, &true_edges_tensor));
+	if (B == 0)
+	    return;
+
+	const bool *edges_prev = edges_prev_tensor.flat<bool>().data();
+	const bool *stencil_edges = stencil_tensor.flat<bool>().data();
+	const int *segments_lvl0 = lvl0_tensor.flat<int>().data();
+	const int *segments_lvl1 = lvl1_tensor.flat<int>().data();
+	const float *image_pred = pred_tensor.flat<float>().data();
+	const float *image_gt = gt_tensor.flat<float>().data();
+	const bool *valid_nodes = valid_tensor.flat<bool>().data();
+	bool *edges_next = edges_next_tensor->flat<bool>().data();
+	bool *false_edges = false_edges_tensor->flat<bool>().data();
+	bool *true_edges = true_edges_tensor->flat<bool>().data();
+
+	EdgeCorrectionParams p = params_;
+	p.H = H; p.W = W; p.C = C; p.N = N;
+	int64 NN = int64(N)*N; int64 HW = int64(H)*W;
+	auto correct_examples = [&](int64 start, int64 limit){
+	    for (int64 b=start; b<limit; b++)
+		correctEdges(p, &edges_prev[b*NN], &stencil_edges[b*HW*K], &segments_lvl0[b*HW], &segments_lvl1[b*HW],
+			     &image_pred[b*HW*C], &image_gt[b*HW*C], &valid_nodes[b*N],
+			     &edges_next[b*NN], &false_edges[b*NN], &true_edges[b*NN]);
+	};
+	auto worker_threads = *(context->device()->tensorflow_cpu_worker_threads());
+	Shard(worker_threads.num_threads, worker_threads.workers, B, HW*(2*C + K + 8) + NN*C, correct_examples);
+    }
+};
+
+REGISTER_KERNEL_BUILDER(Name("CorrectSegmentEdges").Device(DEVICE_CPU), CorrectSegmentEdgesOp);
+
+using namespace std;
+
+static bool bordering(const std::vector<int> &border_counts, int N, int i, int j, int num_pixels_thresh){
+    return (border_counts[i*N + j] >= num_pixels_thresh) || (border_counts[j*N + i] >= num_pixels_thresh);
+}
+
+static void correctEdges(const EdgeCorrectionParams &p, const bool *edges_prev, const bool *stencil_edges, const int *segments_lvl0,
+			 const int *segments_lvl1, const float *image_pred, const float *image_gt, const bool *valid_nodes,
+			 bool *edges_next, bool *false_edges, bool *true_edges){
+    int N = p.N; int C = p.C; int H = p.H; int W = p.W; int HW = H*W;
+    int k = p.k; int ksize = 2*k + 1; int K = ksize*ksize;
+
+    // offset and clamp segment ids
+    std::vector<int> seg_map(HW);
+    int min_id = (HW > 0) ? *std::min_element(segments_lvl0, segments_lvl0 + HW) : 0;
+    for (int i=0; i<HW; i++)
+	seg_map[i] = std::min(segments_lvl0[i] - min_id, N-1);
+
+    // pixels on a level 1 segment edge without an image edge, and on a
+    // weighted image edge without a segment edge, as in find_true_edges
+    std::vector<char> true_pixels(HW); std::vector<char> false_pixels(HW);
+    for (int h=0; h<H; h++){
+	for (int w=0; w<W; w++){
+	    int i = h*W + w;
+	    bool segment_edge = false; bool image_edge = false;
+	    for (int dh=-k; dh<=k; dh++){
+		for (int dw=-k; dw<=k; dw++){
+		    if ((dh == 0 && dw == 0) || h+dh < 0 || h+dh >= H || w+dw < 0 || w+dw >= W)
+			continue;
+		    int j = (h+dh)*W + (w+dw);
+		    segment_edge = segment_edge || (segments_lvl1[j] != segments_lvl1[i]);
+		    image_edge = image_edge || !stencil_edges[int64(i)*K + (dh+k)*ksize + (dw+k)];
+		}
+	    }
+	    true_pixels[i] = segment_edge && !image_edge;
+	    false_pixels[i] = (float(image_edge)*p.image_edges_weight - float(segment_edge) > 0.0f);
+	}
+    }
+
+    // per-segment mean error and mean abs error
+    std::vector<float> err(N*C, 0.0f); std::vector<float> abs_err(N*C, 0.0f);
+    std::vector<int> num_pixels(N, 0);
+    std::vector<bool> gate(N, false);
+    if (p.recon_false_edges){
+	for (int i=0; i<HW; i++){
+	    int n = seg_map[i];
+	    num_pixels[n]++;
+	    for (int c=0; c<C; c++){
+		float e = image_pred[i*C + c] - image_gt[i*C + c];
+		err[n*C + c] += e;
+		abs_err[n*C + c] += std::fabs(e);
+	    }
+	}
+	for (int n=0; n<N; n++){
+	    float norm = (num_pixels[n] > 0) ? 1.0f / float(num_pixels[n]) : 0.0f;
+	    float total_abs_err = 0.0f;
+	    for (int c=0; c<C; c++){
+		err[n*C + c] *= norm;
+		total_abs_err += abs_err[n*C + c] * norm;
+	    }
+	    gate[n] = (total_abs_err > p.thresh_gate) && valid_nodes[n];
+	}
+    }
+
+    // bordering segments, at all pixels and at the true and false ones
+    std::vector<int> border_counts(p.recon_false_edges ? N*N : 0);
+    std::vector<int> true_counts(N*N);
+    std::vector<int> false_counts(p.border_false_edges ? N*N : 0);
+    if (p.recon_false_edges)
+	segmentBorderCounts(H, W, N, seg_map.data(), NULL, border_counts.data());
+    segmentBorderCounts(H, W, N, seg_map.data(), reinterpret_cast<const bool*>(true_pixels.data()), true_counts.data());
+    if (p.border_false_edges)
+	segmentBorderCounts(H, W, N, seg_map.data(), reinterpret_cast<const bool*>(false_pixels.data()), false_counts.data());
+
+    int thresh = p.num_pixels_thresh;
+    for (int i=0; i<N; i++){
+	for (int j=0; j<N; j++){
+	    int e = i*N + j;
+	    bool is_false = false;
+	    if (p.recon_false_edges && bordering(border_counts, N, i, j, thresh) && (gate[i] || gate[j]) && valid_nodes[i] && valid_nodes[j]){
+		float dist = 0.0f;
+		for (int c=0; c<C; c++){
+		    float d = err[i*C + c] - err[j*C + c];
+		    dist += p.square_dist ? d*d : std::fabs(d);
+		}
+		is_false = (dist > p.thresh);
+	    }
+	    if (p.border_false_edges)
+		is_false = is_false || bordering(false_counts, N, i, j, thresh);
+	    bool is_true = bordering(true_counts, N, i, j, thresh) && valid_nodes[i] && valid_nodes[j];
+	    false_edges[e] = is_false;
+	    true_edges[e] = is_true;
+
+	    // update_edges
+	    bool next = (edges_prev[e] || is_true) && !is_false;
+	    if (is_false && is_true){
+		switch (p.conflict_resolution){
+		case CONFLICT_TRUE: next = true; break;
+		case CONFLICT_FALSE: next = false; break;
+		case CONFLICT_UNCHANGED: next = edges_prev[e]; break;
+		}
+	    }
+	    edges_next[e] = next;
+	}
+    }
+}
@@ -0,0 +1,37 @@
+#include "tensorflow/core/profiler/lib/traceme.h"
+#include "absl/types/optional.h"
+
+// Profiling helpers of the graph ops; include after graphs.h.
+
+// Marks the phases of the graphs.cc batch drivers on the TF profiler
+// timeline, nested under the op's own TraceMe. TraceMe costs a branch when
+// no trace is being collected.
+class TraceMePhases : public PhaseTracer
+{
+    absl::optional<tensorflow::profiler::TraceMe> phase_;
+public:
+    void begin(const char *phase) override { phase_.emplace(phase); }
+    void end() override { phase_.reset(); }
+};
+
+// Columns of the graph ops' debug outputs with num_steps sweeps: total,
+// build, propagate and relabel seconds, sweeps run, then the number of labels
+// changed by each sweep.
+inline int graphStatsColumns(int num_steps){
+    return 5 + num_steps;
+}
+
+// writes the stats of each example as a row of debug [B,graphStatsColumns(num_steps)]
+inline void writeGraphStats(const std::vector<GraphStats> &stats, int num_steps, float *debug){
+    int C = graphStatsColumns(num_steps);
+    for (size_t b=0; b<stats.size(); b++){
+	float *row = &debug[b*C];
+	row[0] = stats[b].total_seconds;
+	row[1] = stats[b].build_seconds;
+	row[2] = stats[b].propagate_seconds;
+	row[3] = stats[b].relabel_seconds;
+	row[4] = stats[b].sweeps;
+	for (int n=0; n<num_steps; n++)
+	    row[5 + n] = (n < int(stats[b].changes.size())) ? stats[b].changes[n] : 0;
+    }
+}
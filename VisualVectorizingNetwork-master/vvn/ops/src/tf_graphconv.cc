@@ -0,0 +1,359 @@
+#include "tensorflow/core/framework/op.h"
+#include "tensorflow/core/framework/op_kernel.h"
+#include "tensorflow/core/framework/shape_inference.h"
+#include "tensorflow/core/util/work_sharder.h"
+#include "segments.h"
+
+using namespace tensorflow;
+
+// Hard graph convolution with a single hidden layer, fusing the gather, mlp
+// and sum_effects steps of graphconv_pairwise. For each edge (b,t,l,r) the pair
+// features [n_l, n_r, n_r - n_l, (n_r - n_l)**2] are formed in a small scratch
+// buffer, passed through
+//     effect = act(pairs * w1 + b1) * w2 + b2  (optionally times n_r - n_l)
+// and accumulated directly into the receiver's row, so the [E,4D] pairs and
+// [E,hidden] activations are never materialized. Edges are grouped by receiver
+// with a stable counting sort, so the sums are deterministic.
+
+REGISTER_OP("GraphConvPairwise")
+    .Attr("activation: {'identity', 'relu'} = 'identity'") // hidden layer activation
+    .Attr("agg_type: {'sum', 'mean'} = 'sum'") // how effects on the same receiver are aggregated
+    .Attr("right_receivers: bool = true") // whether rnodes (else lnodes) receive the effects
+    .Attr("scale_diffs_by_effects: bool = false") // whether effects multiply n_r - n_l
+    .Input("nodes: float32") // [B,T,N,D]
+    .Input("edges: int32") // [E,4] of (batch_idx, time_idx, lnode_idx, rnode_idx)
+    .Input("w1: float32") // [4D,hidden]
+    .Input("b1: float32") // [hidden]
+    .Input("w2: float32") // [hidden,Do]
+    .Input("b2: float32") // [Do]
+    .Output("effects: float32") // [B,T,N,Do] aggregated effects per receiver
+    .SetShapeFn([](::tensorflow::shape_inference::InferenceContext* c) {
+	    ::tensorflow::shape_inference::ShapeHandle effects_shape;
+	    TF_RETURN_IF_ERROR(c->ReplaceDim(c->input(0), 3, c->Dim(c->input(5), 0), &effects_shape));
+	    c->set_output(0, effects_shape);
+	    return Status::OK();
+	});
+
+REGISTER_OP("GraphConvPairwiseGrad")
+    .Attr("activation: {'identity', 'relu'} = 'identity'")
+    .Attr("agg_type: {'sum', 'mean'} = 'sum'")
+    .Attr("right_receivers: bool = true")
+    .Attr("scale_diffs_by_effects: bool = false")
+    .Input("nodes: float32")
+    .Input("edges: int32")
+    .Input("w1: float32")
+    .Input("b1: float32")
+    .Input("w2: float32")
+    .Input("b2: float32")
+    .Input("grad_effects: float32") // [B,T,N,Do]
+    .Output("grad_nodes: float32")
+    .Output("grad_w1: float32")
+    .Output("grad_b1: float32")
+    .Output("grad_w2: float32")
+    .Output("grad_b2: float32")
+    .SetShapeFn([](::tensorflow::shape_inference::InferenceContext* c) {
+	    for (int i=0; i<5; i++)
+		c->set_output(i, c->input(i < 1 ? i : i+1));
+	    return Status::OK();
+	});
+
+struct GraphConvParams{
+    int B; int T; int N; int D; // nodes
+    int hidden; int Do; // layer sizes
+    bool relu;
+    bool mean;
+    bool right_receivers;
+    bool scale;
+};
+
+static void graphconvForward(const GraphConvParams &p, int64 frame_start, int64 frame_limit, const float *nodes, const int *edges,
+			     const int *offsets, const int *order, const float *w1, const float *b1, const float *w2, const float *b2,
+			     float *effects);
+static void graphconvBackward(const GraphConvParams &p, int64 frame_start, int64 frame_limit, const float *nodes, const int *edges,
+			      const int *offsets, const int *order, const float *w1, const float *b1, const float *w2, const float *b2,
+			      const float *grad_effects, float *grad_nodes, float *grad_w1, float *grad_b1, float *grad_w2, float *grad_b2);
+
+// reads attrs and checks inputs common to the forward and gradient ops
+static void readGraphConvAttrs(OpKernelConstruction *context, GraphConvParams *p){
+    string activation; string agg_type;
+    OP_REQUIRES_OK(context, context->GetAttr("activation", &activation));
+    OP_REQUIRES_OK(context, context->GetAttr("agg_type", &agg_type));
+    OP_REQUIRES_OK(context, context->GetAttr("right_receivers", &p->right_receivers));
+    OP_REQUIRES_OK(context, context->GetAttr("scale_diffs_by_effects", &p->scale));
+    p->relu = (activation == "relu");
+    p->mean = (agg_type == "mean");
+}
+
+static void checkGraphConvInputs(OpKernelContext *context, GraphConvParams *p, std::vector<int> *offsets, std::vector<int> *order){
+    const Tensor &nodes_tensor = context->input(0);
+    const Tensor &edges_tensor = context->input(1);
+    OP_REQUIRES(context, nodes_tensor.dims()==4, errors::InvalidArgument("GraphConvPairwise requires nodes of shape (B,T,N,D)"));
+    OP_REQUIRES(context, edges_tensor.dims()==2 && edges_tensor.shape().dim_size(1)==4, errors::InvalidArgument("GraphConvPairwise requires edges of shape (E,4)"));
+    p->B = nodes_tensor.shape().dim_size(0);
+    p->T = nodes_tensor.shape().dim_size(1);
+    p->N = nodes_tensor.shape().dim_size(2);
+    p->D = nodes_tensor.shape().dim_size(3);
+    const Tensor &w1_tensor = context->input(2);
+    const Tensor &w2_tensor = context->input(4);
+    OP_REQUIRES(context, w1_tensor.dims()==2 && w1_tensor.shape().dim_size(0)==4*p->D, errors::InvalidArgument("GraphConvPairwise requires w1 of shape (4*D,hidden)"));
+    p->hidden = w1_tensor.shape().dim_size(1);
+    OP_REQUIRES(context, w2_tensor.dims()==2 && w2_tensor.shape().dim_size(0)==p->hidden, errors::InvalidArgument("GraphConvPairwise requires w2 of shape (hidden,Do)"));
+    p->Do = w2_tensor.shape().dim_size(1);
+    OP_REQUIRES(context, context->input(3).shape()==(TensorShape{p->hidden}), errors::InvalidArgument("GraphConvPairwise requires b1 of shape (hidden,)"));
+    OP_REQUIRES(context, context->input(5).shape()==(TensorShape{p->Do}), errors::InvalidArgument("GraphConvPairwise requires b2 of shape (Do,)"));
+    OP_REQUIRES(context, !p->scale || p->Do==p->D, errors::InvalidArgument("GraphConvPairwise with scale_diffs_by_effects requires Do == D"));
+
+    // group edges by receiver
+    int E = edges_tensor.shape().dim_size(0);
+    offsets->resize(p->B*p->T*p->N + 1);
+    order->resize(E);
+    const int *edges = edges_tensor.flat<int>().data();
+    OP_REQUIRES(context, receiverCSR(E, edges, p->B, p->T, p->N, p->right_receivers, offsets->data(), order->data()),
+		errors::InvalidArgument("GraphConvPairwise edge indices must be in range of the nodes' (B,T,N)"));
+}
+
+class GraphConvPairwiseOp : public OpKernel{
+private:
+    GraphConvParams params_;
+public:
+    explicit GraphConvPairwiseOp(OpKernelConstruction *context):OpKernel(context){
+	readGraphConvAttrs(context, &params_);
+    }
+    void Compute(OpKernelContext *context) override {
+	GraphConvParams p = params_;
+	std::vector<int> offsets; std::vector<int> order;
+	checkGraphConvInputs(context, &p, &offsets, &order);
+	if (!context->status().ok())
+	    return;
+
+	Tensor *effects_tensor = NULL;
+	OP_REQUIRES_OK(context, context->allocate_output(0, TensorShape{p.B,p.T,p.N,p.Do}, &effects_tensor));
+	if (p.B*p.T*p.N == 0)
+	    return;
+
+	const float *nodes = context->input(0).flat<float>().data();
+	const int *edges = context->input(1).flat<int>().data();
+	const float *w1 = context->input(2).flat<float>().data();
+	const float *b1 = context->input(3).flat<float>().data();
+	const float *w2 = context->input(4).flat<float>().data();
+	const float *b2 = context->input(5).flat<float>().data();
+	float *effects = effects_tensor->flat<float>().data();
+	const int *offsets_ptr = offsets.data(); const int *order_ptr = order.data();
+
+	// each (b,t) frame only writes its own receiver rows
+	auto convolve_frames = [&](int64 start, int64 limit){
+	    graphconvForward(p, start, limit, nodes, edges, offsets_ptr, order_ptr, w1, b1, w2, b2, effects);
+	};
+	int64 edges_per_frame = order.size() / (p.B*p.T) + 1;
+	auto worker_threads = *(context->device()->tensorflow_cpu_worker_threads());
+	Shard(worker_threads.num_threads, worker_threads.workers, p.B*p.T,
+	      edges_per_frame * 4 * p.D * (p.hidden + p.Do), convolve_frames);
+    }
+};
+
+REGISTER_KERNEL_BUILDER(Name("GraphConvPairwise").Device(DEVICE_CPU), GraphConvPairwiseOp);
+
+class GraphConvPairwiseGradOp : public OpKernel{
+private:
+    GraphConvParams params_;
+public:
+    explicit GraphConvPairwiseGradOp(OpKernelConstruction *context):OpKernel(context){
+	readGraphConvAttrs(context, &params_);
+    }
+    void Compute(OpKernelContext *context) override {
+	GraphConvParams p = params_;
+	std::vector<int> offsets; std::vector<int> order;
+	checkGraphConvInputs(context, &p, &offsets, &order);
+	if (!context->status().ok())
+	    return;
+	const Tensor &grad_effects_tensor = context->input(6);
+	OP_REQUIRES(context, grad_effects_tensor.shape()==(TensorShape{p.B,p.T,p.N,p.Do}), errors::InvalidArgument("GraphConvPairwiseGrad requires grad_effects of shape (B,T,N,Do)"));
+
+	// outputs
+	Tensor *grad_tensors[5];
+	for (int i=0; i<5; i++)
+	    OP_REQUIRES_OK(context, context->allocate_output(i, context->input(i < 1 ? i : i+1).shape(), &grad_tensors[i]));
+	float *grad_nodes = grad_tensors[0]->flat<float>().data();
+	int64 num_nodes = int64(p.B)*p.T*p.N*p.D;
+	std::fill(grad_nodes, grad_nodes + num_nodes, 0.0f);
+
+	const float *nodes = context->input(0).flat<float>().data();
+	const int *edges = context->input(1).flat<int>().data();
+	const float *w1 = context->input(2).flat<float>().data();
+	const float *b1 = context->input(3).flat<float>().data();
+	const float *w2 = context->input(4).flat<float>().data();
+	const float *b2 = context->input(5).flat<float>().data();
+	const float *grad_effects = grad_effects_tensor.flat<float>().data();
+	const int *offsets_ptr = offsets.data(); const int *order_ptr = order.data();
+
+	// weight gradients are accumulated in a fixed number of frame blocks and
+	// summed in block order, so results don't depend on thread scheduling
+	int num_frames = p.B*p.T;
+	auto worker_threads = *(context->device()->tensorflow_cpu_worker_threads());
+	int num_blocks = std::max(1, std::min(num_frames, worker_threads.num_threads));
+	int64 weights_size = int64(4*p.D + 1)*p.hidden + int64(p.hidden + 1)*p.Do;
+	std::vector<float> block_grads(num_blocks * weights_size, 0.0f);
+	auto backprop_blocks = [&](int64 start, int64 limit){
+	    for (int64 blk=start; blk<limit; blk++){
+		float *g = &block_grads[blk*weights_size];
+		float *g_w1 = g; float *g_b1 = g_w1 + 4*p.D*p.hidden;
+		float *g_w2 = g_b1 + p.hidden; float *g_b2 = g_w2 + p.hidden*p.Do;
+		int64 frame_start = (num_frames * blk) / num_blocks;
+		int64 frame_limit = (num_frames * (blk + 1)) / num_blocks;
+		graphconvBackward(p, frame_start, frame_limit, nodes, edges, offsets_ptr, order_ptr, w1, b1, w2, b2,
+				  grad_effects, grad_nodes, g_w1, g_b1, g_w2, g_b2);
+	    }
+	};
+	int64 edges_per_block = order.size() / num_blocks + 1;
+	Shard(worker_threads.num_threads, worker_threads.workers, num_blocks,
+	      edges_per_block * 8 * p.D * (p.hidden + p.Do), backprop_blocks);
+
+	// reduce the weight gradients
+	float *grad_w1 = grad_tensors[1]->flat<float>().data();
+	float *grad_b1 = grad_tensors[2]->flat<float>().data();
+	float *grad_w2 = grad_tensors[3]->flat<float>().data();
+	float *grad_b2 = grad_tensors[4]->flat<float>().data();
+	float *outs[4] = {grad_w1, grad_b1, grad_w2, grad_b2};
+	int64 sizes[4] = {int64(4*p.D)*p.hidden, p.hidden, int64(p.hidden)*p.Do, p.Do};
+	int64 offset = 0;
+	for (int i=0; i<4; i++){
+	    for (int64 j=0; j<sizes[i]; j++){
+		float total = 0.0f;
+		for (int blk=0; blk<num_blocks; blk++)
+		    total += block_grads[blk*weights_size + offset + j];
+		outs[i][j] = total;
+	    }
+	    offset += sizes[i];
+	}
+    }
+};
+
+REGISTER_KERNEL_BUILDER(Name("GraphConvPairwiseGrad").Device(DEVICE_CPU), GraphConvPairwiseGradOp);
+
+using namespace std;
+
+// pair features [n_l, n_r, n_r - n_l, (n_r - n_l)**2]
+static inline void pairFeatures(int D, const float *lnode, const float *rnode, float *x){
+    for (int d=0; d<D; d++){
+	float diff = rnode[d] - lnode[d];
+	x[d] = lnode[d];
+	x[D + d] = rnode[d];
+	x[2*D + d] = diff;
+	x[3*D + d] = diff*diff;
+    }
+}
+
+// y = x * w + b for x [I], w [I,O] row-major
+static inline void denseLayer(int I, int O, const float *x, const float *w, const float *b, float *y){
+    for (int o=0; o<O; o++)
+	y[o] = b[o];
+    for (int i=0; i<I; i++){
+	float xi = x[i];
+	const float *wi = &w[i*O];
+	for (int o=0; o<O; o++)
+	    y[o] += xi * wi[o];
+    }
+}
+
+// hidden pre-activations a, activations h and (unscaled) outputs o for one edge
+static inline void edgeMLP(const GraphConvParams &p, const float *x, const float *w1, const float *b1, const float *w2, const float *b2,
+			   float *a, float *h, float *o){
+    denseLayer(4*p.D, p.hidden, x, w1, b1, a);
+    for (int j=0; j<p.hidden; j++)
+	h[j] = (p.relu && a[j] < 0.0f) ? 0.0f : a[j];
+    denseLayer(p.hidden, p.Do, h, w2, b2, o);
+}
+
+static void graphconvForward(const GraphConvParams &p, int64 frame_start, int64 frame_limit, const float *nodes, const int *edges,
+			     const int *offsets, const int *order, const float *w1, const float *b1, const float *w2, const float *b2,
+			     float *effects){
+    std::vector<float> scratch(4*p.D + 2*p.hidden + p.Do);
+    float *x = scratch.data(); float *a = x + 4*p.D; float *h = a + p.hidden; float *o = h + p.hidden;
+    for (int64 f=frame_start; f<frame_limit; f++){
+	const float *frame_nodes = &nodes[f*p.N*p.D];
+	for (int64 row=f*p.N; row<(f+1)*p.N; row++){
+	    float *out = &effects[row*p.Do];
+	    std::fill(out, out + p.Do, 0.0f);
+	    for (int i=offsets[row]; i<offsets[row+1]; i++){
+		const int *edge = &edges[order[i]*4];
+		pairFeatures(p.D, &frame_nodes[edge[2]*p.D], &frame_nodes[edge[3]*p.D], x);
+		edgeMLP(p, x, w1, b1, w2, b2, a, h, o);
+		const float *diffs = &x[2*p.D];
+		for (int c=0; c<p.Do; c++)
+		    out[c] += p.scale ? o[c]*diffs[c] : o[c];
+	    }
+	    int count = offsets[row+1] - offsets[row];
+	    if (p.mean && count > 0){
+		for (int c=0; c<p.Do; c++)
+		    out[c] /= float(count);
+	    }
+	}
+    }
+}
+
+static void graphconvBackward(const GraphConvParams &p, int64 frame_start, int64 frame_limit, const float *nodes, const int *edges,
+			      const int *offsets, const int *order, const float *w1, const float *b1, const float *w2, const float *b2,
+			      const float *grad_effects, float *grad_nodes, float *grad_w1, float *grad_b1, float *grad_w2, float *grad_b2){
+    // activations are recomputed per edge rather than stored
+    int D = p.D; int hidden = p.hidden; int Do = p.Do;
+    std::vector<float> scratch(8*D + 3*hidden + 3*Do);
+    float *x = scratch.data(); float *g_x = x + 4*D;
+    float *a = g_x + 4*D; float *h = a + hidden; float *g_a = h + hidden;
+    float *o = g_a + hidden; float *g = o + Do; float *g_o = g + Do;
+    for (int64 f=frame_start; f<frame_limit; f++){
+	const float *frame_nodes = &nodes[f*p.N*D];
+	float *frame_grad_nodes = &grad_nodes[f*p.N*D];
+	for (int64 row=f*p.N; row<(f+1)*p.N; row++){
+	    int count = offsets[row+1] - offsets[row];
+	    float norm = (p.mean && count > 0) ? 1.0f / float(count) : 1.0f;
+	    for (int c=0; c<Do; c++)
+		g[c] = grad_effects[row*Do + c] * norm;
+
+	    for (int i=offsets[row]; i<offsets[row+1]; i++){
+		const int *edge = &edges[order[i]*4];
+		int l = edge[2]; int r = edge[3];
+		pairFeatures(D, &frame_nodes[l*D], &frame_nodes[r*D], x);
+		edgeMLP(p, x, w1, b1, w2, b2, a, h, o);
+		const float *diffs = &x[2*D];
+		for (int c=0; c<Do; c++)
+		    g_o[c] = p.scale ? g[c]*diffs[c] : g[c];
+
+		// output layer
+		for (int j=0; j<hidden; j++){
+		    float hj = h[j]; float *gw = &grad_w2[j*Do]; const float *w = &w2[j*Do];
+		    float gh = 0.0f;
+		    for (int c=0; c<Do; c++){
+			gw[c] += hj * g_o[c];
+			gh += w[c] * g_o[c];
+		    }
+		    g_a[j] = (p.relu && a[j] <= 0.0f) ? 0.0f : gh;
+		}
+		for (int c=0; c<Do; c++)
+		    grad_b2[c] += g_o[c];
+
+		// hidden layer
+		for (int k=0; k<4*D; k++){
+		    float xk = x[k]; float *gw = &grad_w1[k*hidden]; const float *w = &w1[k*hidden];
+		    float gx = 0.0f;
+		    for (int j=0; j<hidden; j++){
+			gw[j] += xk * g_a[j];
+			gx += w[j] * g_a[j];
+		    }
+		    g_x[k] = gx;
+		}
+		for (int j=0; j<hidden; j++)
+		    grad_b1[j] += g_a[j];
+
+		// pair features back to the two nodes
+		float *g_l = &frame_grad_nodes[l*D]; float *g_r = &frame_grad_nodes[r*D];
+		for (int d=0; d<D; d++){
+		    float g_diff = g_x[2*D + d] + 2.0f*diffs[d]*g_x[3*D + d];
+		    if (p.scale)
+			g_diff += g[d]*o[d];
+		    g_l[d] += g_x[d] - g_diff;
+		    g_r[d] += g_x[D + d] + g_diff;
+		}
+	    }
+	}
+    }
+}
@@ -0,0 +1,315 @@
+#include "tensorflow/core/framework/op.h"
+#include "tensorflow/core/framework/op_kernel.h"
+#include "tensorflow/core/framework/shape_inference.h"
+#include "tensorflow/core/platform/mutex.h"
+#include "tensorflow/core/util/guarded_philox_random.h"
+#include "tensorflow/core/util/work_sharder.h"
+#include "graphs.h"
+#include <memory>
+
+using namespace tensorflow;
+
+// Runs the whole grouping stack of a scene graph for each example without
+// returning to TF between levels:
+//   level 0: stencil edges from the [H,W,C] features as in
+//            compute_adjacency_from_features with euclidean_dist2 (a neighbour
+//            is connected if its squared distance is below the pixel's squared
+//            distance from the example's mean feature, times pixel_thresh_scale),
+//            LabelProp on those edges and mean pooling of the pixel features;
+//   level l: fc edges between the level l-1 nodes as in euclidean_dist2_fc
+//            (squared distance below thresh_scales[l-1] times the mean over all
+//            node pairs), LabelPropFc and mean pooling of the child nodes.
+// Like within_example_segment_ids, segments beyond a level's max_nodes are
+// merged into its last node. Nodes are [C+1] with a trailing valid flag, and
+// parent_idxs maps each level l-1 node to its level l node (0 if invalid).
+// Each example's labelprop is shuffled from the call's seed, drawn from seed
+// and seed2 as for LabelProp, and the example's index, so nonzero seeds give
+// the same groups however the batch is sharded.
+
+REGISTER_OP("HierarchicalGrouping")
+    .Attr("L: int >= 1") // number of graph levels above the pixel-level segments
+    .Attr("k: int = 1") // half width of the pixel stencil
+    .Attr("pixel_num_steps: int = 10") // LabelProp steps at level 0
+    .Attr("pixel_thresh_scale: float = 1.0")
+    .Attr("pixel_max_nodes: int >= 1") // Nmax at level 0
+    .Attr("num_steps: list(int)") // [L] LabelPropFc steps per level
+    .Attr("thresh_scales: list(float)") // [L] scales of the mean pairwise distance per level
+    .Attr("max_nodes: list(int)") // [L] Nmax per level
+    .Attr("seed: int = 0")
+    .Attr("seed2: int = 0")
+    .Input("features: float32") // [B,H,W,C]
+    .Output("segment_ids: int32") // [B,H,W] level 0 node of each pixel
+    .Output("pixel_nodes: float32") // [B,Nmax_0,C+1]
+    .Output("nodes: L * float32") // L x [B,Nmax_l,C+1]
+    .Output("parent_idxs: L * int32") // L x [B,Nmax_{l-1}] index of each level l-1 node's parent at level l
+    .Output("num_nodes: int32") // [B,L+1] valid nodes per level
+    .SetIsStateful()
+    .SetShapeFn([](::tensorflow::shape_inference::InferenceContext* c) {
+	    ::tensorflow::shape_inference::ShapeHandle features;
+	    TF_RETURN_IF_ERROR(c->WithRank(c->input(0), 4, &features));
+	    ::tensorflow::shape_inference::DimensionHandle B = c->Dim(features, 0);
+	    ::tensorflow::shape_inference::DimensionHandle D;
+	    TF_RETURN_IF_ERROR(c->Add(c->Dim(features, 3), 1, &D));
+	    int L; int pixel_max_nodes;
+	    std::vector<int> max_nodes;
+	    TF_RETURN_IF_ERROR(c->GetAttr("L", &L));
+	    TF_RETURN_IF_ERROR(c->GetAttr("pixel_max_nodes", &pixel_max_nodes));
+	    TF_RETURN_IF_ERROR(c->GetAttr("max_nodes", &max_nodes));
+	    if (int(max_nodes.size()) != L)
+		return errors::InvalidArgument("HierarchicalGrouping requires len(max_nodes) == L");
+	    c->set_output(0, c->MakeShape({B, c->Dim(features, 1), c->Dim(features, 2)}));
+	    c->set_output(1, c->MakeShape({B, c->MakeDim(pixel_max_nodes), D}));
+	    for (int l=0; l<L; l++){
+		c->set_output(2 + l, c->MakeShape({B, c->MakeDim(max_nodes[l]), D}));
+		c->set_output(2 + L + l, c->Matrix(B, (l == 0) ? pixel_max_nodes : max_nodes[l-1]));
+	    }
+	    c->set_output(2 + 2*L, c->Matrix(B, L + 1));
+	    return Status::OK();
+	});
+
+struct GroupingConfig{
+    int H; int W; int C; int k;
+    int pixel_num_steps;
+    float pixel_thresh_scale;
+    int pixel_max_nodes;
+    std::vector<int> num_steps;
+    std::vector<float> thresh_scales;
+    std::vector<int> max_nodes;
+};
+
+// Scratch reused across the examples of a shard and kept by the kernel
+// between calls; only grows.
+struct GroupingArena{
+    std::unique_ptr<bool[]> edges; size_t edges_capacity = 0;
+    std::vector<float> means; std::vector<float> dists2;
+    std::vector<int> labels; std::vector<int> counts;
+    GraphScratch graph; // storage of each level's PixGraph or Graph
+
+    bool *stencilEdges(size_t n){
+	if (n > edges_capacity){
+	    edges.reset(new bool[n]);
+	    edges_capacity = n;
+	}
+	return edges.get();
+    }
+};
+
+static int groupPixels(const GroupingConfig &cfg, const float *features, unsigned seed, int *segment_ids, float *nodes,
+		       GroupingArena &arena);
+static int groupNodes(const GroupingConfig &cfg, int level, int num_children, const float *children, int Nmax_children,
+		      unsigned seed, float *nodes, int *parents, GroupingArena &arena);
+
+class HierarchicalGroupingOp : public OpKernel{
+private:
+    GroupingConfig cfg_;
+    GuardedPhiloxRandom generator_;
+    mutex mu_;
+    std::vector<std::unique_ptr<GroupingArena> > idle_arenas_ GUARDED_BY(mu_); // of finished shards
+
+    std::unique_ptr<GroupingArena> acquireArena(){
+	mutex_lock l(mu_);
+	if (idle_arenas_.empty())
+	    return std::unique_ptr<GroupingArena>(new GroupingArena());
+	std::unique_ptr<GroupingArena> arena = std::move(idle_arenas_.back());
+	idle_arenas_.pop_back();
+	return arena;
+    }
+    void releaseArena(std::unique_ptr<GroupingArena> arena){
+	mutex_lock l(mu_);
+	idle_arenas_.push_back(std::move(arena));
+    }
+public:
+    explicit HierarchicalGroupingOp(OpKernelConstruction *context):OpKernel(context){
+	int L;
+	OP_REQUIRES_OK(context, context->GetAttr("L", &L));
+	OP_REQUIRES_OK(context, context->GetAttr("k", &cfg_.k));
+	OP_REQUIRES_OK(context, context->GetAttr("pixel_num_steps", &cfg_.pixel_num_steps));
+	OP_REQUIRES_OK(context, context->GetAttr("pixel_thresh_scale", &cfg_.pixel_thresh_scale));
+	OP_REQUIRES_OK(context, context->GetAttr("pixel_max_nodes", &cfg_.pixel_max_nodes));
+	OP_REQUIRES_OK(context, context->GetAttr("num_steps", &cfg_.num_steps));
+	OP_REQUIRES_OK(context, context->GetAttr("thresh_scales", &cfg_.thresh_scales));
+	OP_REQUIRES_OK(context, context->GetAttr("max_nodes", &cfg_.max_nodes));
+	OP_REQUIRES(context, cfg_.k >= 0, errors::InvalidArgument("HierarchicalGrouping requires k >= 0"));
+	OP_REQUIRES(context, int(cfg_.num_steps.size())==L && int(cfg_.thresh_scales.size())==L && int(cfg_.max_nodes.size())==L,
+		    errors::InvalidArgument("HierarchicalGrouping requires num_steps, thresh_scales and max_nodes of length L"));
+	for (int l=0; l<L; l++)
+	    OP_REQUIRES(context, cfg_.max_nodes[l] >= 1, errors::InvalidArgument("HierarchicalGrouping requires max_nodes >= 1"));
+	OP_REQUIRES_OK(context, generator_.Init(context));
+    }
+    void Compute(OpKernelContext *context) override {
+	const Tensor &features_tensor = context->input(0);
+	OP_REQUIRES(context, features_tensor.dims()==4, errors::InvalidArgument("HierarchicalGrouping requires features of shape (B,H,W,C)"));
+	int B = features_tensor.shape().dim_size(0);
+	GroupingConfig cfg = cfg_;
+	cfg.H = features_tensor.shape().dim_size(1);
+	cfg.W = features_tensor.shape().dim_size(2);
+	cfg.C = features_tensor.shape().dim_size(3);
+	int L = cfg.max_nodes.size();
+	int D = cfg.C + 1;
+	int HW = cfg.H*cfg.W;
+	const float *features = features_tensor.flat<float>().data();
+
+	// outputs
+	Tensor *segments_tensor = NULL;
+	OP_REQUIRES_OK(context, context->allocate_output(0, TensorShape{B,cfg.H,cfg.W}, &segments_tensor));
+	int *segment_ids = segments_tensor->flat<int>().data();
+	Tensor *pixel_nodes_tensor = NULL;
+	OP_REQUIRES_OK(context, context->allocate_output(1, TensorShape{B,cfg.pixel_max_nodes,D}, &pixel_nodes_tensor));
+	float *pixel_nodes = pixel_nodes_tensor->flat<float>().data();
+	OpOutputList nodes_list;
+	OP_REQUIRES_OK(context, context->output_list("nodes", &nodes_list));
+	OpOutputList parents_list;
+	OP_REQUIRES_OK(context, context->output_list("parent_idxs", &parents_list));
+	std::vector<float*> nodes(L); std::vector<int*> parents(L);
+	for (int l=0; l<L; l++){
+	    int Nchildren = (l == 0) ? cfg.pixel_max_nodes : cfg.max_nodes[l-1];
+	    Tensor *nodes_tensor = NULL;
+	    OP_REQUIRES_OK(context, nodes_list.allocate(l, TensorShape{B,cfg.max_nodes[l],D}, &nodes_tensor));
+	    nodes[l] = nodes_tensor->flat<float>().data();
+	    Tensor *parents_tensor = NULL;
+	    OP_REQUIRES_OK(context, parents_list.allocate(l, TensorShape{B,Nchildren}, &parents_tensor));
+	    parents[l] = parents_tensor->flat<int>().data();
+	}
+	Tensor *num_nodes_tensor = NULL;
+	OP_REQUIRES_OK(context, context->allocate_output(2 + 2*L, TensorShape{B,L+1}, &num_nodes_tensor));
+	int *num_nodes = num_nodes_tensor->flat<int>().data();
+
+	// examples are independent; each shard takes an arena from the kernel's
+	// and seeds each example's graphs from its index alone
+	unsigned seed = generator_.ReserveSamples128(1)()[0];
+	auto group_examples = [&](int64 start, int64 limit){
+	    std::unique_ptr<GroupingArena> owned_arena = acquireArena();
+	    GroupingArena &arena = *owned_arena;
+	    for (int64 b=start; b<limit; b++){
+		unsigned ex_seed = exampleSeed(seed, b);
+		int n = groupPixels(cfg, &features[b*HW*cfg.C], ex_seed, &segment_ids[b*HW], &pixel_nodes[b*cfg.pixel_max_nodes*D],
+				    arena);
+		num_nodes[b*(L+1)] = n;
+		const float *children = &pixel_nodes[b*cfg.pixel_max_nodes*D];
+		int Nchildren = cfg.pixel_max_nodes;
+		for (int l=0; l<L; l++){
+		    float *level_nodes = &nodes[l][b*cfg.max_nodes[l]*D];
+		    n = groupNodes(cfg, l, n, children, Nchildren, ex_seed + l + 1, level_nodes, &parents[l][b*Nchildren], arena);
+		    num_nodes[b*(L+1) + l + 1] = n;
+		    children = level_nodes;
+		    Nchildren = cfg.max_nodes[l];
+		}
+	    }
+	    releaseArena(std::move(owned_arena));
+	};
+	int64 K = (2*cfg.k + 1)*(2*cfg.k + 1);
+	auto worker_threads = *(context->device()->tensorflow_cpu_worker_threads());
+	Shard(worker_threads.num_threads, worker_threads.workers, B, int64(HW)*K*(cfg.C + 16)*std::max(cfg.pixel_num_steps, 1), group_examples);
+    }
+};
+
+REGISTER_KERNEL_BUILDER(Name("HierarchicalGrouping").Device(DEVICE_CPU), HierarchicalGroupingOp);
+
+using namespace std;
+
+// mean pools the D-1 features of items into their (clamped) groups and sets the valid flag
+static void poolNodes(int num_items, int C, const float *items, int item_stride, const int *groups, int num_groups,
+		      float *nodes, int Nmax, std::vector<int> &counts){
+    int D = C + 1;
+    std::fill(nodes, nodes + Nmax*D, 0.0f);
+    counts.assign(Nmax, 0);
+    for (int i=0; i<num_items; i++){
+	int g = groups[i];
+	counts[g]++;
+	for (int c=0; c<C; c++)
+	    nodes[g*D + c] += items[i*item_stride + c];
+    }
+    for (int g=0; g<Nmax; g++){
+	if (counts[g] == 0)
+	    continue;
+	for (int c=0; c<C; c++)
+	    nodes[g*D + c] /= float(counts[g]);
+	nodes[g*D + C] = 1.0f;
+    }
+}
+
+static int groupPixels(const GroupingConfig &cfg, const float *features, unsigned seed, int *segment_ids, float *nodes,
+		       GroupingArena &arena){
+    int H = cfg.H; int W = cfg.W; int C = cfg.C; int k = cfg.k;
+    int HW = H*W; int ksize = 2*k + 1; int K = ksize*ksize;
+
+    // per-pixel thresholds are the squared distance from the mean feature
+    arena.means.assign(C, 0.0f);
+    for (int i=0; i<HW; i++)
+	for (int c=0; c<C; c++)
+	    arena.means[c] += features[i*C + c];
+    for (int c=0; c<C; c++)
+	arena.means[c] /= float(std::max(HW, 1));
+
+    bool *edges = arena.stencilEdges(size_t(HW)*K);
+    for (int p=0; p<HW; p++){
+	const float *fp = &features[p*C];
+	float thresh = 0.0f;
+	for (int c=0; c<C; c++)
+	    thresh += (fp[c] - arena.means[c])*(fp[c] - arena.means[c]);
+	thresh *= cfg.pixel_thresh_scale;
+	int row = p / W; int col = p % W;
+	for (int e=0; e<K; e++){
+	    int h = row + (e / ksize) - k; int w = col + (e % ksize) - k;
+	    if (h < 0 || h >= H || w < 0 || w >= W){
+		edges[p*K + e] = false; // PixGraph drops these
+		continue;
+	    }
+	    const float *fq = &features[(h*W + w)*C];
+	    float dist2 = 0.0f;
+	    for (int c=0; c<C; c++)
+		dist2 += (fp[c] - fq[c])*(fp[c] - fq[c]);
+	    edges[p*K + e] = (dist2 < thresh);
+	}
+    }
+
+    PixGraph G(H, W, k, edges, &arena.graph);
+    G.seed(seed);
+    for (int n=0; n<cfg.pixel_num_steps; n++)
+	G.labelPropStep(false);
+    G.setNumLabels(true, false, 0);
+
+    int Nmax = cfg.pixel_max_nodes;
+    for (int i=0; i<HW; i++)
+	segment_ids[i] = std::min(G.V[i], Nmax-1);
+    poolNodes(HW, C, features, C, segment_ids, Nmax, nodes, Nmax, arena.counts);
+    return std::min(G.num_labels, Nmax);
+}
+
+static int groupNodes(const GroupingConfig &cfg, int level, int num_children, const float *children, int Nmax_children,
+		      unsigned seed, float *nodes, int *parents, GroupingArena &arena){
+    int C = cfg.C; int D = C + 1; int N = Nmax_children;
+
+    // threshold is a multiple of the mean over all [N,N] pairs, including invalid nodes
+    arena.dists2.resize(size_t(N)*N);
+    double total = 0.0;
+    for (int i=0; i<N; i++){
+	for (int j=0; j<N; j++){
+	    float dist2 = 0.0f;
+	    for (int c=0; c<C; c++){
+		float diff = children[i*D + c] - children[j*D + c];
+		dist2 += diff*diff;
+	    }
+	    arena.dists2[i*N + j] = dist2;
+	    total += dist2;
+	}
+    }
+    float thresh = float(total / double(std::max(N*N, 1))) * cfg.thresh_scales[level];
+
+    // valid children come first, as LabelPropFc assumes
+    Graph G(num_children, true, &arena.graph);
+    G.seed(seed);
+    for (int i=0; i<num_children; i++)
+	for (int j=0; j<num_children; j++)
+	    if (arena.dists2[i*N + j] < thresh)
+		G.addEdge(i, j);
+    for (int n=0; n<cfg.num_steps[level]; n++)
+	G.labelPropStep(false);
+    G.setNumLabels(true, 0);
+
+    int Nmax = cfg.max_nodes[level];
+    for (int i=0; i<N; i++)
+	parents[i] = (i < num_children) ? std::min(G.cc_ids[i], Nmax-1) : 0;
+    poolNodes(num_children, C, children, D, parents, Nmax, nodes, Nmax, arena.counts);
+    return std::min(G.num_labels, Nmax);
+}
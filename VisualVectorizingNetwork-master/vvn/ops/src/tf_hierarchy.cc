@@ -0,0 +1,236 @@
+#include "tensorflow/core/framework/op.h"
+#include "tensorflow/core/framework/op_kernel.h"
+#include "tensorflow/core/framework/shape_inference.h"
+#include "tensorflow/core/util/work_sharder.h"
+#include "tensorflow/core/platform/mutex.h"
+#include "segments.h"
+#include <algorithm>
+#include <limits>
+#include <numeric>
+
+using namespace tensorflow;
+
+// Composes the child->parent index maps of L hierarchy levels into the
+// ancestor of every base node at every level, as get_ancestors does with
+// repeated gathers. If same_parent_level >= 0 it also groups the base nodes by
+// their ancestor at that level and emits the (batch_index, time_index, lindex,
+// lindex) edges between nodes in the same group, as
+// compute_same_parent_within_layer_edges does, along with the CSR offsets of
+// those edges over the B*T*N_0 base nodes. Otherwise both are empty. Every
+// parent index must be a node of the next level, or any non-negative index at
+// the top level, whose node count isn't known.
+
+REGISTER_OP("ComposeAncestors")
+    .Attr("L: int >= 1") // number of levels
+    .Attr("same_parent_level: int = -1") // level whose ancestors define the same-parent edges, -1 for none
+    .Attr("remove_self_connections: bool = true")
+    .Input("parent_idxs: L * int32") // L x [B,T,N_l], index of each level l node's parent among the N_{l+1} nodes
+    .Output("ancestor_idxs: int32") // [B,T,N_0,L] index of each base node's ancestor at each level
+    .Output("same_parent_offsets: int32") // [B*T*N_0+1] CSR offsets of each base node's edges
+    .Output("same_parent_edges: int32") // [E,4] (batch_index, time_index, lindex, lindex) grouped by first lindex
+    .SetShapeFn([](::tensorflow::shape_inference::InferenceContext* c) {
+	    int L;
+	    TF_RETURN_IF_ERROR(c->GetAttr("L", &L));
+	    ::tensorflow::shape_inference::ShapeHandle anc_shape;
+	    TF_RETURN_IF_ERROR(c->Concatenate(c->input(0), c->Vector(L), &anc_shape));
+	    c->set_output(0, anc_shape);
+	    c->set_output(1, c->Vector(c->UnknownDim()));
+	    c->set_output(2, c->Matrix(c->UnknownDim(), 4));
+	    return Status::OK();
+	});
+
+static void composeAncestors(int L, const std::vector<const int*> &parents, const std::vector<int> &sizes, int64 f, int *ancestors);
+static Status sameParentDegrees(int N0, int L, int level, int num_groups, bool remove_self, const int *ancestors, int *degrees,
+				std::vector<int> &groups, std::vector<int> &offsets, std::vector<int> &order);
+static Status sameParentEdges(int N0, int L, int level, int num_groups, bool remove_self, int b, int t, const int *ancestors, const int *edge_offsets,
+			      std::vector<int> &groups, std::vector<int> &offsets, std::vector<int> &order, int *edges);
+
+class ComposeAncestorsOp : public OpKernel{
+private:
+    int same_parent_level_;
+    bool remove_self_connections_;
+public:
+    explicit ComposeAncestorsOp(OpKernelConstruction *context):OpKernel(context){
+	OP_REQUIRES_OK(context, context->GetAttr("same_parent_level", &same_parent_level_));
+	OP_REQUIRES_OK(context, context->GetAttr("remove_self_connections", &remove_self_connections_));
+    }
+    void Compute(OpKernelContext *context) override {
+	OpInputList parent_list;
+	OP_REQUIRES_OK(context, context->input_list("parent_idxs", &parent_list));
+	int L = parent_list.size();
+	OP_REQUIRES(context, same_parent_level_ < L, errors::InvalidArgument("ComposeAncestors requires same_parent_level < L"));
+	OP_REQUIRES(context, parent_list[0].dims()==3, errors::InvalidArgument("ComposeAncestors requires parent_idxs of shape (B,T,N_l)"));
+	int B = parent_list[0].shape().dim_size(0);
+	int T = parent_list[0].shape().dim_size(1);
+
+	// every parent index must be a node of the next level
+	std::vector<const int*> parents(L);
+	std::vector<int> sizes(L);
+	for (int l=0; l<L; l++){
+	    const Tensor &p = parent_list[l];
+	    OP_REQUIRES(context, p.dims()==3 && p.shape().dim_size(0)==B && p.shape().dim_size(1)==T,
+			errors::InvalidArgument("ComposeAncestors requires parent_idxs of shape (B,T,N_l) at every level"));
+	    sizes[l] = p.shape().dim_size(2);
+	    parents[l] = p.flat<int>().data();
+	}
+	for (int l=0; l<L; l++){
+	    int num_parents = (l+1 < L) ? sizes[l+1] : std::numeric_limits<int>::max();
+	    for (int64 i=0; i<int64(B)*T*sizes[l]; i++)
+		OP_REQUIRES(context, parents[l][i] >= 0 && parents[l][i] < num_parents,
+			    errors::InvalidArgument("ComposeAncestors found a parent index out of range at level ", l));
+	}
+
+	int N0 = sizes[0];
+	int BT = B*T;
+	Tensor *ancestors_tensor = NULL;
+	OP_REQUIRES_OK(context, context->allocate_output(0, TensorShape{B,T,N0,L}, &ancestors_tensor));
+	int *ancestors = ancestors_tensor->flat<int>().data();
+
+	auto worker_threads = *(context->device()->tensorflow_cpu_worker_threads());
+	auto compose_frames = [&](int64 start, int64 limit){
+	    for (int64 f=start; f<limit; f++)
+		composeAncestors(L, parents, sizes, f, &ancestors[f*N0*L]);
+	};
+	Shard(worker_threads.num_threads, worker_threads.workers, BT, int64(N0)*L*4, compose_frames);
+
+	int level = same_parent_level_;
+	if (level < 0){
+	    Tensor *offsets_tensor = NULL;
+	    OP_REQUIRES_OK(context, context->allocate_output(1, TensorShape{0}, &offsets_tensor));
+	    Tensor *edges_tensor = NULL;
+	    OP_REQUIRES_OK(context, context->allocate_output(2, TensorShape{0,4}, &edges_tensor));
+	    return;
+	}
+
+	// count each base node's same-parent edges, then fill them in place
+	int num_groups = (level+1 < L) ? sizes[level+1] : -1; // unknown at the top level
+	mutex mu;
+	Status status;
+	Tensor *offsets_tensor = NULL;
+	OP_REQUIRES_OK(context, context->allocate_output(1, TensorShape{BT*N0 + 1}, &offsets_tensor));
+	int *edge_offsets = offsets_tensor->flat<int>().data();
+	bool remove_self = remove_self_connections_;
+	edge_offsets[0] = 0;
+	auto count_frames = [&](int64 start, int64 limit){
+	    std::vector<int> groups; std::vector<int> offsets; std::vector<int> order;
+	    for (int64 f=start; f<limit; f++){
+		Status s = sameParentDegrees(N0, L, level, num_groups, remove_self, &ancestors[f*N0*L], &edge_offsets[f*N0 + 1], groups, offsets, order);
+		if (!s.ok()){
+		    mutex_lock l(mu);
+		    status = s;
+		    return;
+		}
+	    }
+	};
+	Shard(worker_threads.num_threads, worker_threads.workers, BT, int64(N0)*8, count_frames);
+	OP_REQUIRES_OK(context, status);
+	int64 E = 0;
+	for (int i=1; i<=BT*N0; i++){
+	    E += edge_offsets[i];
+	    OP_REQUIRES(context, E <= std::numeric_limits<int>::max(), errors::ResourceExhausted("ComposeAncestors has too many same-parent edges"));
+	    edge_offsets[i] = int(E);
+	}
+
+	Tensor *edges_tensor = NULL;
+	OP_REQUIRES_OK(context, context->allocate_output(2, TensorShape{E,4}, &edges_tensor));
+	int *edges = edges_tensor->flat<int>().data();
+	auto fill_frames = [&](int64 start, int64 limit){
+	    std::vector<int> groups; std::vector<int> offsets; std::vector<int> order;
+	    for (int64 f=start; f<limit; f++){
+		Status s = sameParentEdges(N0, L, level, num_groups, remove_self, int(f / T), int(f % T), &ancestors[f*N0*L], &edge_offsets[f*N0],
+					   groups, offsets, order, edges);
+		if (!s.ok()){
+		    mutex_lock l(mu);
+		    status = s;
+		    return;
+		}
+	    }
+	};
+	Shard(worker_threads.num_threads, worker_threads.workers, BT, int64(N0)*8 + 4*E/std::max(BT, 1), fill_frames);
+	OP_REQUIRES_OK(context, status);
+    }
+};
+
+REGISTER_KERNEL_BUILDER(Name("ComposeAncestors").Device(DEVICE_CPU), ComposeAncestorsOp);
+
+using namespace std;
+
+static void composeAncestors(int L, const std::vector<const int*> &parents, const std::vector<int> &sizes, int64 f, int *ancestors){
+    int N0 = sizes[0];
+    const int *p0 = &parents[0][f*N0];
+    for (int i=0; i<N0; i++)
+	ancestors[i*L] = p0[i];
+    for (int l=1; l<L; l++){
+	const int *pl = &parents[l][f*sizes[l]];
+	for (int i=0; i<N0; i++)
+	    ancestors[i*L + l] = pl[ancestors[i*L + l - 1]];
+    }
+}
+
+static Status groupByAncestor(int N0, int L, int level, int num_groups, const int *ancestors,
+			      std::vector<int> &groups, std::vector<int> &offsets, std::vector<int> &order){
+    // groups[i] is base node i's ancestor at level, or its rank among the
+    // distinct ancestors when they are too sparse to bucket; num_groups < 0 if
+    // the level's node count isn't known
+    groups.resize(N0);
+    order.resize(N0);
+    int R = 0;
+    for (int i=0; i<N0; i++){
+	groups[i] = ancestors[i*L + level];
+	if (groups[i] < 0 || (num_groups >= 0 && groups[i] >= num_groups))
+	    return errors::InvalidArgument("ComposeAncestors found an ancestor index out of range at level ", level);
+	R = std::max(R, groups[i] + 1);
+    }
+    if (R <= N0){
+	// counting sort of the base nodes by their ancestor
+	offsets.resize(R + 1);
+	rowsToCSR(N0, groups.data(), R, offsets.data(), order.data());
+	return Status::OK();
+    }
+
+    // sort the base nodes by ancestor, keeping their order within a group
+    std::iota(order.begin(), order.end(), 0);
+    std::sort(order.begin(), order.end(), [&](int i, int j){
+	    return groups[i] < groups[j] || (groups[i] == groups[j] && i < j);
+	});
+    offsets.clear();
+    int prev = -1;
+    for (int k=0; k<N0; k++){
+	int i = order[k];
+	if (groups[i] != prev){
+	    prev = groups[i];
+	    offsets.push_back(k);
+	}
+	groups[i] = int(offsets.size()) - 1;
+    }
+    offsets.push_back(N0);
+    return Status::OK();
+}
+
+static Status sameParentDegrees(int N0, int L, int level, int num_groups, bool remove_self, const int *ancestors, int *degrees,
+				std::vector<int> &groups, std::vector<int> &offsets, std::vector<int> &order){
+    TF_RETURN_IF_ERROR(groupByAncestor(N0, L, level, num_groups, ancestors, groups, offsets, order));
+    for (int i=0; i<N0; i++){
+	int g = groups[i];
+	degrees[i] = offsets[g+1] - offsets[g] - (remove_self ? 1 : 0);
+    }
+    return Status::OK();
+}
+
+static Status sameParentEdges(int N0, int L, int level, int num_groups, bool remove_self, int b, int t, const int *ancestors, const int *edge_offsets,
+			      std::vector<int> &groups, std::vector<int> &offsets, std::vector<int> &order, int *edges){
+    // group members are in increasing order, so edges come out sorted as tf.where would give them
+    TF_RETURN_IF_ERROR(groupByAncestor(N0, L, level, num_groups, ancestors, groups, offsets, order));
+    for (int i=0; i<N0; i++){
+	int g = groups[i];
+	int *edge = &edges[int64(edge_offsets[i])*4];
+	for (int k=offsets[g]; k<offsets[g+1]; k++){
+	    int j = order[k];
+	    if (remove_self && j == i)
+		continue;
+	    edge[0] = b; edge[1] = t; edge[2] = i; edge[3] = j;
+	    edge += 4;
+	}
+    }
+    return Status::OK();
+}
@@ -0,0 +1,137 @@
+#include "tensorflow/core/framework/op.h"
+#include "tensorflow/core/framework/op_kernel.h"
+#include "tensorflow/core/framework/shape_inference.h"
+#include "tensorflow/core/lib/random/random_distributions.h"
+#include "tensorflow/core/util/guarded_philox_random.h"
+#include "tensorflow/core/util/work_sharder.h"
+#include "sampling.h"
+
+using namespace tensorflow;
+
+// Samples num_points (h,w) indices per consecutive frame pair of a [B,T,H,W,C]
+// video, with probability proportional to the squared frame difference
+// sum_c (im[t+1] - im[t])**2 / rgb_max**2 at each pixel (or to its inversion,
+// max - delta, if static, to sample the non-moving parts). Each frame pair
+// builds an alias table in O(HW) and draws every sample in O(1). Frame pairs
+// whose weights are all zero are sampled uniformly.
+
+REGISTER_OP("SampleDeltaImageInds")
+    .Attr("T: {uint8, float}")
+    .Attr("num_points: int")
+    .Attr("static: bool = false") // sample where the image doesn't change
+    .Attr("rgb_max: float = 255.0")
+    .Attr("seed: int = 0")
+    .Attr("seed2: int = 0")
+    .Input("images: T") // [B,T,H,W,C]
+    .Output("inds: int32") // [B,T-1,num_points,2] of (h,w)
+    .SetIsStateful()
+    .SetShapeFn([](::tensorflow::shape_inference::InferenceContext* c) {
+	    int num_points;
+	    TF_RETURN_IF_ERROR(c->GetAttr("num_points", &num_points));
+	    ::tensorflow::shape_inference::ShapeHandle images;
+	    TF_RETURN_IF_ERROR(c->WithRank(c->input(0), 5, &images));
+	    ::tensorflow::shape_inference::DimensionHandle num_pairs;
+	    TF_RETURN_IF_ERROR(c->Add(c->Dim(images, 1), -1, &num_pairs));
+	    c->set_output(0, c->MakeShape({c->Dim(images, 0), num_pairs, c->MakeDim(num_points), c->MakeDim(2)}));
+	    return Status::OK();
+	});
+
+template <typename T>
+static void sampleFrameInds(int H, int W, int C, int P, bool is_static, float rgb_max, const T *im0, const T *im1,
+			    random::PhiloxRandom rng, std::vector<float> &weights, AliasTable &table, int *inds);
+
+template <typename T>
+class SampleDeltaImageIndsOp : public OpKernel{
+private:
+    int num_points_;
+    bool static_;
+    float rgb_max_;
+    GuardedPhiloxRandom generator_;
+public:
+    explicit SampleDeltaImageIndsOp(OpKernelConstruction *context):OpKernel(context){
+	OP_REQUIRES_OK(context, context->GetAttr("num_points", &num_points_));
+	OP_REQUIRES_OK(context, context->GetAttr("static", &static_));
+	OP_REQUIRES_OK(context, context->GetAttr("rgb_max", &rgb_max_));
+	OP_REQUIRES(context, num_points_ >= 0, errors::InvalidArgument("SampleDeltaImageInds requires num_points >= 0"));
+	OP_REQUIRES_OK(context, generator_.Init(context));
+    }
+    void Compute(OpKernelContext *context) override {
+	const Tensor &images_tensor = context->input(0);
+	OP_REQUIRES(context, images_tensor.dims()==5, errors::InvalidArgument("SampleDeltaImageInds requires images of shape (B,T,H,W,C)"));
+	int B = images_tensor.shape().dim_size(0);
+	int num_frames = images_tensor.shape().dim_size(1);
+	int H = images_tensor.shape().dim_size(2);
+	int W = images_tensor.shape().dim_size(3);
+	int C = images_tensor.shape().dim_size(4);
+	OP_REQUIRES(context, num_frames >= 2, errors::InvalidArgument("SampleDeltaImageInds requires at least 2 frames"));
+	OP_REQUIRES(context, H*W > 0, errors::InvalidArgument("SampleDeltaImageInds requires nonempty images"));
+	int P = num_points_;
+
+	Tensor *inds_tensor = NULL;
+	OP_REQUIRES_OK(context, context->allocate_output(0, TensorShape{B,num_frames-1,P,2}, &inds_tensor));
+	int num_pairs = B*(num_frames-1);
+	if (num_pairs*P == 0)
+	    return;
+	const T *images = images_tensor.flat<T>().data();
+	int *inds = inds_tensor->flat<int>().data();
+
+	// two uniforms per sample, four per 128-bit philox sample
+	int64 samples_per_pair = (int64(P) + 1) / 2;
+	random::PhiloxRandom rng = generator_.ReserveSamples128(num_pairs * samples_per_pair);
+
+	int64 frame_size = int64(H)*W*C;
+	bool is_static = static_; float rgb_max = rgb_max_;
+	auto sample_pairs = [=](int64 start, int64 limit){
+	    std::vector<float> weights(H*W);
+	    AliasTable table;
+	    for (int64 f=start; f<limit; f++){
+		int b = f / (num_frames-1); int t = f % (num_frames-1);
+		const T *im0 = &images[(int64(b)*num_frames + t)*frame_size];
+		random::PhiloxRandom pair_rng = rng;
+		pair_rng.Skip(f * samples_per_pair);
+		sampleFrameInds(H, W, C, P, is_static, rgb_max, im0, im0 + frame_size, pair_rng, weights, table, &inds[f*P*2]);
+	    }
+	};
+	auto worker_threads = *(context->device()->tensorflow_cpu_worker_threads());
+	Shard(worker_threads.num_threads, worker_threads.workers, num_pairs, frame_size*4 + int64(P)*8, sample_pairs);
+    }
+};
+
+REGISTER_KERNEL_BUILDER(Name("SampleDeltaImageInds").Device(DEVICE_CPU).TypeConstraint<uint8>("T"), SampleDeltaImageIndsOp<uint8>);
+REGISTER_KERNEL_BUILDER(Name("SampleDeltaImageInds").Device(DEVICE_CPU).TypeConstraint<float>("T"), SampleDeltaImageIndsOp<float>);
+
+using namespace std;
+
+template <typename T>
+static void sampleFrameInds(int H, int W, int C, int P, bool is_static, float rgb_max, const T *im0, const T *im1,
+			    random::PhiloxRandom rng, std::vector<float> &weights, AliasTable &table, int *inds){
+    // delta energy per pixel
+    int N = H*W;
+    float scale = 1.0f / rgb_max;
+    float delta_max = 0.0f;
+    for (int i=0; i<N; i++){
+	float delta = 0.0f;
+	for (int c=0; c<C; c++){
+	    float d = float(im1[i*C + c])*scale - float(im0[i*C + c])*scale;
+	    delta += d*d;
+	}
+	weights[i] = delta;
+	delta_max = std::max(delta_max, delta);
+    }
+    if (is_static){
+	for (int i=0; i<N; i++)
+	    weights[i] = delta_max - weights[i]; // invert so that sample is from the non-moving parts
+    }
+    table.build(N, weights.data());
+
+    // draw the samples
+    random::UniformDistribution<random::PhiloxRandom, float> uniform;
+    for (int p=0; p<P; p+=2){
+	auto u = uniform(&rng);
+	for (int j=0; j<2 && p+j<P; j++){
+	    int ind = table.sample(u[2*j], u[2*j + 1]);
+	    inds[(p+j)*2 + 0] = ind / W;
+	    inds[(p+j)*2 + 1] = ind % W;
+	}
+    }
+}
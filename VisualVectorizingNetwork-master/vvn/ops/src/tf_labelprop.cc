@@ -1,7 +1,16 @@
 #include "tensorflow/core/framework/op.h"
 #include "tensorflow/core/framework/op_kernel.h"
 #include "tensorflow/core/framework/shape_inference.h"
+#include "tensorflow/core/platform/mutex.h"
+#include "tensorflow/core/util/guarded_philox_random.h"
+#include "tensorflow/core/util/work_sharder.h"
 #include "graphs.h"
+#include "segments.h"
+#include "tf_async_pool.h"
+#include "tf_graph_trace.h"
+#include <atomic>
+#include <memory>
+#include <type_traits>
 
 using namespace tensorflow;
 
@@ -10,48 +19,138 @@ using namespace tensorflow;
 // the integer labels for each feature in a [B,H,W] tensor. These will be in
 // the range [0,BHW) but typically much smaller as label propagation
 // tends to converge within ~5 steps to an order of magnitude fewer labels.
+// Edges may also be packed into one uint32 or uint64 bitmask per feature (see
+// PackStencilEdges), in which case the stencil half width k must be given.
+// Images larger than tile_size on a side can be run in parallel tiles (see
+// TiledPixGraph), which keeps memory linear in HW for megapixel frames.
+// If segment_pixels, the pixels of each segment are also returned in CSR form
+// so that per-segment gathers need no argsort. If max_segments > 0, the
+// smallest segments of each example are merged into the neighbor they share
+// the most edges with until at most max_segments remain. If debug_stats, the
+// per-example timings and label changes of each sweep are returned in debug
+// (see writeGraphStats); otherwise debug is empty and nothing is measured.
+// The visiting order of each sweep is shuffled from seed and seed2 as for
+// the random ops, so that nonzero seeds give the same labels on every run.
 
 REGISTER_OP("LabelProp")
     .Attr("num_steps: int") // num steps to run op
     .Attr("defensive: bool = false") // whether to do defensive labelprop
-    .Input("edges: bool") // connectivity matrix of shape [B,HW,(2k+1)**2]
+    .Attr("T: {bool, uint32, uint64} = DT_BOOL") // edge type, bool or packed bitmasks
+    .Attr("k: int = -1") // stencil half width, required for packed edges
+    .Attr("tile_size: int = 0") // tile side in pixels for tiled labelprop, 0 to run untiled
+    .Attr("segment_pixels: bool = false") // whether to output segment_offsets and pixel_indices
+    .Attr("max_segments: int = 0") // cap on segments per example, 0 for none
+    .Attr("debug_stats: bool = false") // whether to output debug
+    .Attr("seed: int = 0")
+    .Attr("seed2: int = 0")
+    .Input("edges: T") // connectivity matrix of shape [B,HW,(2k+1)**2], or [B,HW] packed
     .Input("size: int32") // [H,W]
     .Output("labels: int32") // [B,HW] labels in increasing order
     .Output("num_segments: int32") // [B] number of segments (unique labels) per example
+    .Output("segment_offsets: int32") // [sum(num_segments)+1] CSR offsets of each label's pixels, or [0]
+    .Output("pixel_indices: int32") // [B*HW] flat pixel indices grouped by label, or [0]
+    .Output("debug: float32") // [B,5+num_steps] per-example stats, or [0,0]
+    .SetIsStateful()
     .SetShapeFn([](::tensorflow::shape_inference::InferenceContext* c) {
+	    int num_steps; bool debug_stats;
+	    TF_RETURN_IF_ERROR(c->GetAttr("num_steps", &num_steps));
+	    TF_RETURN_IF_ERROR(c->GetAttr("debug_stats", &debug_stats));
 	    c->set_output(0, c->Matrix(c->Dim(c->input(0),0), c->Dim(c->input(0),1)));
 	    c->set_output(1, c->Vector(c->Dim(c->input(0),0)));
+	    c->set_output(2, c->Vector(c->UnknownDim()));
+	    c->set_output(3, c->Vector(c->UnknownDim()));
+	    if (debug_stats)
+		c->set_output(4, c->Matrix(c->Dim(c->input(0),0), graphStatsColumns(num_steps)));
+	    else
+		c->set_output(4, c->Matrix(0, 0));
 	    return Status::OK();
 	});
 
-static void assignLabels(int B, int H, int W, int k, int num_steps, bool defensive, const bool *edges, int *labels, int *num_segments); // declaration
+static void assignLabels(int B, int T, int H, int W, int k, int kt, int num_steps, bool defensive, unsigned seed, const bool *edges,
+			 int *labels, int *num_segments); // declaration
+template <typename E>
+static void capSegmentLabels(int B, int H, int W, int k, int max_segments, const DeviceBase::CpuWorkerThreads &workers,
+			     const E *edges, int *labels, int *num_segments); // merges small segments
+template <typename E>
+static void assignLabelsTiled(int B, int num_steps, bool defensive, int tile_size, const StencilTopology &topology,
+			      const DeviceBase::CpuWorkerThreads &workers, unsigned seed, const E *edges, int *labels, int *num_segments,
+			      PhaseTracer *tracer, GraphStats *stats); // parallel over tiles
 
-class LabelPropOp : public OpKernel{
+// stencil edges as PixGraph takes them; tf's uint64 need not be uint64_t
+static const bool *pixGraphEdges(const bool *edges){ return edges; }
+template <typename M>
+static const typename std::conditional<sizeof(M) == 4, uint32_t, uint64_t>::type *pixGraphEdges(const M *masks){
+    return reinterpret_cast<const typename std::conditional<sizeof(M) == 4, uint32_t, uint64_t>::type*>(masks);
+}
+
+template <typename T>
+class LabelPropOp : public AsyncOpKernel{
 private:
     int num_steps_;
     bool defensive_;
-    int H; int W;
+    int k_;
+    int tile_size_;
+    bool segment_pixels_;
+    int max_segments_;
+    bool debug_stats_;
+    mutex mu_;
+    std::shared_ptr<const StencilTopology> topology_ GUARDED_BY(mu_); // stencil tables for the last (H,W,k)
+    ScratchPool scratch_pool_; // graph storage kept across calls, one per concurrent call
+    GuardedPhiloxRandom generator_;
+
+    std::shared_ptr<const StencilTopology> cachedTopology(int H, int W, int k){
+	if ((2*k + 1)*(2*k + 1) > 64)
+	    return nullptr; // table masks are 64 bits, build graphs directly
+	mutex_lock l(mu_);
+	if (!topology_ || !topology_->matches(H, W, k))
+	    topology_ = std::make_shared<const StencilTopology>(H, W, k);
+	return topology_;
+    }
 public:
-    explicit LabelPropOp(OpKernelConstruction *context):OpKernel(context){
+    explicit LabelPropOp(OpKernelConstruction *context):AsyncOpKernel(context){
 	OP_REQUIRES_OK(context, context->GetAttr("num_steps", &num_steps_));
 	OP_REQUIRES_OK(context, context->GetAttr("defensive", &defensive_));
+	OP_REQUIRES_OK(context, context->GetAttr("k", &k_));
+	OP_REQUIRES_OK(context, context->GetAttr("tile_size", &tile_size_));
+	OP_REQUIRES_OK(context, context->GetAttr("segment_pixels", &segment_pixels_));
+	OP_REQUIRES_OK(context, context->GetAttr("max_segments", &max_segments_));
+	OP_REQUIRES_OK(context, context->GetAttr("debug_stats", &debug_stats_));
+	OP_REQUIRES_OK(context, generator_.Init(context));
     }
-    void Compute(OpKernelContext *context) override {
+    void ComputeAsync(OpKernelContext *context, DoneCallback done) override {
+	// run on the graph op pool and signal done when finished or failed
+	graphOpPool()->Schedule([this, context, done](){
+		computeLabels(context);
+		done();
+	    });
+    }
+    void computeLabels(OpKernelContext *context){
+	profiler::TraceMe trace("LabelProp");
+	unsigned seed = generator_.ReserveSamples128(1)()[0]; // of this call, each example's is derived from it
 	// edges input
 	const Tensor &edges_tensor = context->input(0);
-	OP_REQUIRES(context, edges_tensor.dims()==3, errors::InvalidArgument("LabelProp requires edges of shape (batch, H*W, (2k+1)**2"));
+	bool packed = !std::is_same<T, bool>::value;
+	int k;
+	if (packed){
+	    OP_REQUIRES(context, edges_tensor.dims()==2, errors::InvalidArgument("LabelProp requires packed edges of shape (batch, H*W)"));
+	    k = k_;
+	    OP_REQUIRES(context, k >= 0 && (2*k + 1)*(2*k + 1) <= int(8*sizeof(T)),
+			errors::InvalidArgument("LabelProp requires packed edges to hold (2k+1)**2 bits for attr k >= 0"));
+	}
+	else{
+	    OP_REQUIRES(context, edges_tensor.dims()==3, errors::InvalidArgument("LabelProp requires edges of shape (batch, H*W, (2k+1)**2"));
+	    k = edges_tensor.shape().dim_size(2);
+	    k = int((std::sqrt(k)-1) / 2); // kernel half width
+	}
 	int B = edges_tensor.shape().dim_size(0);
-	int k = edges_tensor.shape().dim_size(2);
-	k = int((std::sqrt(k)-1) / 2); // kernel half width
 
-	auto edges_flat = edges_tensor.flat<bool>();
-	const bool *edges = &edges_flat(0); // input reference
+	const T *edges = edges_tensor.flat<T>().data(); // input reference
 
 	// size input
 	const Tensor &size_tensor = context->input(1);
 	auto size_flat = size_tensor.flat<int>();
 	const int *size = &size_flat(0);
-	H = size[0]; W = size[1];
+	int H = size[0]; int W = size[1];
 	OP_REQUIRES(context, edges_tensor.shape().dim_size(1)==(H*W), errors::InvalidArgument("LabelProp requires size[0]*size[1] == edges.shape[1]"));
 
 	// outputs
@@ -66,27 +165,374 @@ public:
 	int *num_segments = &(num_segments_flat(0));
 
 	// assign the labels via labelprop and compute num_segments per example
-	assignLabels(B, H, W, k, num_steps_, defensive_, edges, labels, num_segments);
+	std::shared_ptr<const StencilTopology> topology = cachedTopology(H, W, k);
+	auto worker_threads = *(context->device()->tensorflow_cpu_worker_threads());
+	TraceMePhases tracer;
+	std::vector<GraphStats> stats(debug_stats_ ? B : 0);
+	GraphStats *ex_stats = debug_stats_ ? stats.data() : NULL;
+	if (tile_size_ > 0 && (H > tile_size_ || W > tile_size_)){
+	    OP_REQUIRES(context, topology != nullptr, errors::InvalidArgument("LabelProp requires (2k+1)**2 <= 64 for tiled labelprop"));
+	    assignLabelsTiled(B, num_steps_, defensive_, tile_size_, *topology, worker_threads, seed, edges, labels, num_segments, &tracer,
+			      ex_stats);
+	}
+	else{
+	    ScopedScratch scratch(scratch_pool_);
+	    assignLabels(B, H, W, k, num_steps_, defensive_, topology.get(), pixGraphEdges(edges), labels, num_segments, seed, &tracer,
+			 ex_stats, scratch.get());
+	}
+	if (max_segments_ > 0){
+	    profiler::TraceMe cap_trace("cap_segments");
+	    capSegmentLabels(B, H, W, k, max_segments_, worker_threads, edges, labels, num_segments);
+	}
+
+	// labels are dense in [0,sum(num_segments)), so a counting sort groups the pixels
+	int num_labels = 0;
+	for (int b=0; b<B; b++)
+	    num_labels += num_segments[b];
+	int64 num_pixels = segment_pixels_ ? int64(B)*H*W : 0;
+	Tensor *offsets_tensor=NULL;
+	OP_REQUIRES_OK(context, context->allocate_output(2, TensorShape{segment_pixels_ ? num_labels + 1 : 0}, &offsets_tensor));
+	Tensor *pixels_tensor=NULL;
+	OP_REQUIRES_OK(context, context->allocate_output(3, TensorShape{num_pixels}, &pixels_tensor));
+	if (segment_pixels_){
+	    profiler::TraceMe csr_trace("segment_pixels");
+	    rowsToCSR(num_pixels, labels, num_labels, offsets_tensor->flat<int>().data(), pixels_tensor->flat<int>().data());
+	}
+
+	Tensor *debug_tensor=NULL;
+	TensorShape debug_shape = debug_stats_ ? TensorShape{B, graphStatsColumns(num_steps_)} : TensorShape{0, 0};
+	OP_REQUIRES_OK(context, context->allocate_output(4, debug_shape, &debug_tensor));
+	if (debug_stats_)
+	    writeGraphStats(stats, num_steps_, debug_tensor->flat<float>().data());
+    }
+};
+
+REGISTER_KERNEL_BUILDER(Name("LabelProp").Device(DEVICE_CPU).TypeConstraint<bool>("T"), LabelPropOp<bool>);
+REGISTER_KERNEL_BUILDER(Name("LabelProp").Device(DEVICE_CPU).TypeConstraint<uint32>("T"), LabelPropOp<uint32>);
+REGISTER_KERNEL_BUILDER(Name("LabelProp").Device(DEVICE_CPU).TypeConstraint<uint64>("T"), LabelPropOp<uint64>);
+
+// Packs [B,HW,(2k+1)**2] stencil edges into one bitmask per feature, bit e
+// set where edges[b,i,e] is true, for LabelProp's packed edge input.
+
+REGISTER_OP("PackStencilEdges")
+    .Attr("out_type: {uint32, uint64} = DT_UINT64")
+    .Input("edges: bool") // [B,HW,(2k+1)**2]
+    .Output("packed_edges: out_type") // [B,HW]
+    .SetShapeFn([](::tensorflow::shape_inference::InferenceContext* c) {
+	    c->set_output(0, c->Matrix(c->Dim(c->input(0),0), c->Dim(c->input(0),1)));
+	    return Status::OK();
+	});
+
+template <typename M>
+class PackStencilEdgesOp : public OpKernel{
+public:
+    explicit PackStencilEdgesOp(OpKernelConstruction *context):OpKernel(context){}
+    void Compute(OpKernelContext *context) override {
+	const Tensor &edges_tensor = context->input(0);
+	OP_REQUIRES(context, edges_tensor.dims()==3, errors::InvalidArgument("PackStencilEdges requires edges of shape (batch, H*W, (2k+1)**2)"));
+	int B = edges_tensor.shape().dim_size(0);
+	int N = edges_tensor.shape().dim_size(1);
+	int K = edges_tensor.shape().dim_size(2);
+	OP_REQUIRES(context, K <= int(8*sizeof(M)), errors::InvalidArgument("PackStencilEdges requires (2k+1)**2 <= the bits of out_type"));
+
+	Tensor *packed_tensor = NULL;
+	OP_REQUIRES_OK(context, context->allocate_output(0, TensorShape{B,N}, &packed_tensor));
+	const bool *edges = edges_tensor.flat<bool>().data();
+	M *packed = packed_tensor->flat<M>().data();
+	for (int64 i=0; i<int64(B)*N; i++){
+	    M m = 0;
+	    for (int e=0; e<K; e++)
+		m |= M(edges[i*K + e]) << e;
+	    packed[i] = m;
+	}
+    }
+};
+
+REGISTER_KERNEL_BUILDER(Name("PackStencilEdges").Device(DEVICE_CPU).TypeConstraint<uint32>("out_type"), PackStencilEdgesOp<uint32>);
+REGISTER_KERNEL_BUILDER(Name("PackStencilEdges").Device(DEVICE_CPU).TypeConstraint<uint64>("out_type"), PackStencilEdgesOp<uint64>);
+
+// Like LabelProp, but each example is a [T,H,W] video and every feature has
+// edges to its (2kt+1)x(2k+1)x(2k+1) spatiotemporal neighborhood, so labels
+// propagate across frames and segment ids are consistent over time.
+// Sweeps are shuffled from seed and seed2 as in LabelProp.
+
+REGISTER_OP("LabelProp3D")
+    .Attr("num_steps: int") // num steps to run op
+    .Attr("kt: int = 1") // temporal half width of the neighborhood
+    .Attr("defensive: bool = false") // whether to do defensive labelprop
+    .Attr("seed: int = 0")
+    .Attr("seed2: int = 0")
+    .Input("edges: bool") // connectivity matrix of shape [B,THW,(2kt+1)*(2k+1)**2]
+    .Input("size: int32") // [T,H,W]
+    .Output("labels: int32") // [B,THW] labels in increasing order
+    .Output("num_segments: int32") // [B] number of segments (unique labels) per example
+    .SetIsStateful()
+    .SetShapeFn([](::tensorflow::shape_inference::InferenceContext* c) {
+	    c->set_output(0, c->Matrix(c->Dim(c->input(0),0), c->Dim(c->input(0),1)));
+	    c->set_output(1, c->Vector(c->Dim(c->input(0),0)));
+	    return Status::OK();
+	});
+
+class LabelProp3DOp : public OpKernel{
+private:
+    int num_steps_;
+    int kt_;
+    bool defensive_;
+    GuardedPhiloxRandom generator_;
+public:
+    explicit LabelProp3DOp(OpKernelConstruction *context):OpKernel(context){
+	OP_REQUIRES_OK(context, context->GetAttr("num_steps", &num_steps_));
+	OP_REQUIRES_OK(context, context->GetAttr("kt", &kt_));
+	OP_REQUIRES_OK(context, context->GetAttr("defensive", &defensive_));
+	OP_REQUIRES(context, kt_ >= 0, errors::InvalidArgument("LabelProp3D requires kt >= 0"));
+	OP_REQUIRES_OK(context, generator_.Init(context));
+    }
+    void Compute(OpKernelContext *context) override {
+	// edges input
+	const Tensor &edges_tensor = context->input(0);
+	OP_REQUIRES(context, edges_tensor.dims()==3, errors::InvalidArgument("LabelProp3D requires edges of shape (batch, T*H*W, (2kt+1)*(2k+1)**2)"));
+	int B = edges_tensor.shape().dim_size(0);
+	int K = edges_tensor.shape().dim_size(2);
+	OP_REQUIRES(context, K % (2*kt_ + 1) == 0, errors::InvalidArgument("LabelProp3D requires edges.shape[2] == (2kt+1)*(2k+1)**2"));
+	int k = int((std::sqrt(K / (2*kt_ + 1))-1) / 2); // kernel half width
+	OP_REQUIRES(context, (2*kt_ + 1)*(2*k + 1)*(2*k + 1) == K, errors::InvalidArgument("LabelProp3D requires edges.shape[2] == (2kt+1)*(2k+1)**2"));
+	const bool *edges = edges_tensor.flat<bool>().data();
+
+	// size input
+	const Tensor &size_tensor = context->input(1);
+	OP_REQUIRES(context, size_tensor.NumElements()==3, errors::InvalidArgument("LabelProp3D requires size = [T,H,W]"));
+	const int *size = size_tensor.flat<int>().data();
+	int T = size[0]; int H = size[1]; int W = size[2];
+	OP_REQUIRES(context, T > 0 && H > 0 && W > 0, errors::InvalidArgument("LabelProp3D requires positive size = [T,H,W]"));
+	OP_REQUIRES(context, edges_tensor.shape().dim_size(1)==int64(T)*H*W, errors::InvalidArgument("LabelProp3D requires size[0]*size[1]*size[2] == edges.shape[1]"));
+
+	// outputs
+	Tensor *labels_tensor = NULL;
+	OP_REQUIRES_OK(context, context->allocate_output(0, TensorShape{B,T*H*W}, &labels_tensor));
+	int *labels = labels_tensor->flat<int>().data();
+	Tensor *num_segments_tensor = NULL;
+	OP_REQUIRES_OK(context, context->allocate_output(1, TensorShape{B}, &num_segments_tensor));
+	int *num_segments = num_segments_tensor->flat<int>().data();
+
+	unsigned seed = generator_.ReserveSamples128(1)()[0];
+	assignLabels(B, T, H, W, k, kt_, num_steps_, defensive_, seed, edges, labels, num_segments);
     }
 };
 
-REGISTER_KERNEL_BUILDER(Name("LabelProp").Device(DEVICE_CPU), LabelPropOp);
+REGISTER_KERNEL_BUILDER(Name("LabelProp3D").Device(DEVICE_CPU), LabelProp3DOp);
+
+// Like LabelProp, but edges are nonnegative float affinities and each feature
+// takes the label with the largest summed affinity over its neighborhood
+// (including itself) rather than the most common one. Affinities below
+// min_affinity don't vote. With method 'felzenszwalb' the same affinities are
+// instead segmented deterministically by graph-based merging (see
+// felzenszwalbSegment in graphs.h), with the same outputs. Labelprop sweeps
+// are shuffled from seed and seed2 as in LabelProp.
+
+REGISTER_OP("LabelPropSoft")
+    .Attr("num_steps: int") // num steps to run op
+    .Attr("min_affinity: float = 0.0") // affinities below this are ignored
+    .Attr("method: {'labelprop', 'felzenszwalb'} = 'labelprop'")
+    .Attr("scale: float = 1.0") // felzenszwalb: larger values give larger segments
+    .Attr("min_size: int = 0") // felzenszwalb: segments smaller than this are merged into a neighbor
+    .Attr("seed: int = 0")
+    .Attr("seed2: int = 0")
+    .Input("affinities: float32") // soft connectivity matrix of shape [B,HW,(2k+1)**2]
+    .Input("size: int32") // [H,W]
+    .Output("labels: int32") // [B,HW] labels in increasing order
+    .Output("num_segments: int32") // [B] number of segments (unique labels) per example
+    .SetIsStateful()
+    .SetShapeFn([](::tensorflow::shape_inference::InferenceContext* c) {
+	    c->set_output(0, c->Matrix(c->Dim(c->input(0),0), c->Dim(c->input(0),1)));
+	    c->set_output(1, c->Vector(c->Dim(c->input(0),0)));
+	    return Status::OK();
+	});
+
+struct SoftSegmentParams{
+    int num_steps;
+    float min_affinity;
+    bool felzenszwalb;
+    float scale;
+    int min_size;
+};
+
+static void assignLabelsSoft(int B, int H, int W, int k, const SoftSegmentParams &p, unsigned seed, const float *affinities, int *labels,
+			     int *num_segments, GraphScratch *scratch); // declaration
+
+class LabelPropSoftOp : public OpKernel{
+private:
+    SoftSegmentParams params_;
+    GuardedPhiloxRandom generator_;
+    ScratchPool scratch_pool_; // graph storage kept across calls, one per concurrent call
+public:
+    explicit LabelPropSoftOp(OpKernelConstruction *context):OpKernel(context){
+	string method;
+	OP_REQUIRES_OK(context, context->GetAttr("num_steps", &params_.num_steps));
+	OP_REQUIRES_OK(context, context->GetAttr("min_affinity", &params_.min_affinity));
+	OP_REQUIRES_OK(context, context->GetAttr("method", &method));
+	OP_REQUIRES_OK(context, context->GetAttr("scale", &params_.scale));
+	OP_REQUIRES_OK(context, context->GetAttr("min_size", &params_.min_size));
+	params_.felzenszwalb = (method == "felzenszwalb");
+	OP_REQUIRES_OK(context, generator_.Init(context));
+    }
+    void Compute(OpKernelContext *context) override {
+	// affinities input
+	const Tensor &affinities_tensor = context->input(0);
+	OP_REQUIRES(context, affinities_tensor.dims()==3, errors::InvalidArgument("LabelPropSoft requires affinities of shape (batch, H*W, (2k+1)**2)"));
+	int B = affinities_tensor.shape().dim_size(0);
+	int K = affinities_tensor.shape().dim_size(2);
+	int k = int((std::sqrt(K)-1) / 2); // kernel half width
+	OP_REQUIRES(context, (2*k+1)*(2*k+1)==K, errors::InvalidArgument("LabelPropSoft requires affinities.shape[2] == (2k+1)**2"));
+	const float *affinities = affinities_tensor.flat<float>().data();
+
+	// size input
+	const Tensor &size_tensor = context->input(1);
+	OP_REQUIRES(context, size_tensor.NumElements()==2, errors::InvalidArgument("LabelPropSoft requires size = [H,W]"));
+	const int *size = size_tensor.flat<int>().data();
+	int H = size[0]; int W = size[1];
+	OP_REQUIRES(context, affinities_tensor.shape().dim_size(1)==(H*W), errors::InvalidArgument("LabelPropSoft requires size[0]*size[1] == affinities.shape[1]"));
+
+	// outputs
+	Tensor *labels_tensor = NULL;
+	OP_REQUIRES_OK(context, context->allocate_output(0, TensorShape{B,H*W}, &labels_tensor));
+	int *labels = labels_tensor->flat<int>().data();
+	Tensor *num_segments_tensor = NULL;
+	OP_REQUIRES_OK(context, context->allocate_output(1, TensorShape{B}, &num_segments_tensor));
+	int *num_segments = num_segments_tensor->flat<int>().data();
+
+	unsigned seed = generator_.ReserveSamples128(1)()[0];
+	ScopedScratch scratch(scratch_pool_);
+	assignLabelsSoft(B, H, W, k, params_, seed, affinities, labels, num_segments, scratch.get());
+    }
+};
+
+REGISTER_KERNEL_BUILDER(Name("LabelPropSoft").Device(DEVICE_CPU), LabelPropSoftOp);
+
+// Builds the region adjacency graph of LabelProp's output for the next level
+// of grouping. Two segments of an example are adjacent if any pair of their
+// pixels are stencil neighbours; each adjacency is emitted in both directions
+// as (example_idx, Lnode_idx, Rnode_idx) with per-example node indices, so the
+// edges can be passed straight to LabelPropFc along with num_segments. Edges
+// are sorted by example, then Lnode, then Rnode, and rag_offsets gives the
+// CSR row of each segment over all examples.
+
+REGISTER_OP("SegmentAdjacency")
+    .Input("labels: int32") // [B,HW] output of LabelProp, increasing over examples
+    .Input("num_segments: int32") // [B] output of LabelProp
+    .Input("edges: bool") // [B,HW,(2k+1)**2] edges LabelProp was run on
+    .Input("size: int32") // [H,W]
+    .Output("rag_edges: int32") // [E,3] edges (example_idx, Lnode_idx, Rnode_idx) for LabelPropFc
+    .Output("rag_offsets: int32") // [sum(num_segments)+1] CSR offsets of each segment's edges
+    .Output("boundary_counts: int32") // [E] stencil neighbour pixel pairs between the two segments
+    .Output("edge_agreement: float32") // [E] mean stencil edge value over those pairs, in [0,1]
+    .SetShapeFn([](::tensorflow::shape_inference::InferenceContext* c) {
+	    c->set_output(0, c->Matrix(c->UnknownDim(), 3));
+	    c->set_output(1, c->Vector(c->UnknownDim()));
+	    c->set_output(2, c->Vector(c->UnknownDim()));
+	    c->set_output(3, c->Vector(c->UnknownDim()));
+	    return Status::OK();
+	});
+
+class SegmentAdjacencyOp : public OpKernel{
+public:
+    explicit SegmentAdjacencyOp(OpKernelConstruction *context):OpKernel(context){}
+    void Compute(OpKernelContext *context) override {
+	const Tensor &labels_tensor = context->input(0);
+	const Tensor &num_segments_tensor = context->input(1);
+	const Tensor &edges_tensor = context->input(2);
+	const Tensor &size_tensor = context->input(3);
+	OP_REQUIRES(context, edges_tensor.dims()==3, errors::InvalidArgument("SegmentAdjacency requires edges of shape (batch, H*W, (2k+1)**2)"));
+	int B = edges_tensor.shape().dim_size(0);
+	int K = edges_tensor.shape().dim_size(2);
+	int k = int((std::sqrt(K)-1) / 2); // kernel half width
+	OP_REQUIRES(context, (2*k+1)*(2*k+1)==K, errors::InvalidArgument("SegmentAdjacency requires edges.shape[2] == (2k+1)**2"));
+	OP_REQUIRES(context, size_tensor.NumElements()==2, errors::InvalidArgument("SegmentAdjacency requires size = [H,W]"));
+	const int *size = size_tensor.flat<int>().data();
+	int H = size[0]; int W = size[1];
+	OP_REQUIRES(context, edges_tensor.shape().dim_size(1)==(H*W), errors::InvalidArgument("SegmentAdjacency requires size[0]*size[1] == edges.shape[1]"));
+	OP_REQUIRES(context, labels_tensor.NumElements()==int64(B)*H*W, errors::InvalidArgument("SegmentAdjacency requires labels of shape (batch, H*W)"));
+	OP_REQUIRES(context, num_segments_tensor.shape()==(TensorShape{B}), errors::InvalidArgument("SegmentAdjacency requires num_segments of shape (batch,)"));
+
+	const int *labels = labels_tensor.flat<int>().data();
+	const int *num_segments = num_segments_tensor.flat<int>().data();
+	const bool *edges = edges_tensor.flat<bool>().data();
+	int HW = H*W;
+
+	// per-example label offsets, and labels must lie in their example's range
+	std::vector<int> offsets(B+1, 0);
+	for (int b=0; b<B; b++)
+	    offsets[b+1] = offsets[b] + num_segments[b];
+	for (int b=0; b<B; b++)
+	    for (int i=0; i<HW; i++)
+		OP_REQUIRES(context, labels[b*HW + i] >= offsets[b] && labels[b*HW + i] < offsets[b+1],
+			    errors::InvalidArgument("SegmentAdjacency requires labels and num_segments from LabelProp"));
+
+	// build each example's graph independently, then concatenate
+	std::vector<std::vector<int> > rag_offsets(B), nbrs(B), counts(B);
+	std::vector<std::vector<float> > agreement(B);
+	auto build_examples = [&](int64 start, int64 limit){
+	    std::vector<int> local(HW);
+	    for (int64 b=start; b<limit; b++){
+		for (int i=0; i<HW; i++)
+		    local[i] = labels[b*HW + i] - offsets[b];
+		segmentAdjacency(H, W, k, num_segments[b], local.data(), &edges[b*HW*K], rag_offsets[b], nbrs[b], counts[b], agreement[b]);
+	    }
+	};
+	auto worker_threads = *(context->device()->tensorflow_cpu_worker_threads());
+	Shard(worker_threads.num_threads, worker_threads.workers, B, int64(HW)*K*4, build_examples);
+
+	int64 E = 0;
+	for (int b=0; b<B; b++)
+	    E += nbrs[b].size();
+	Tensor *rag_edges_tensor = NULL;
+	OP_REQUIRES_OK(context, context->allocate_output(0, TensorShape{E,3}, &rag_edges_tensor));
+	Tensor *rag_offsets_tensor = NULL;
+	OP_REQUIRES_OK(context, context->allocate_output(1, TensorShape{offsets[B]+1}, &rag_offsets_tensor));
+	Tensor *counts_tensor = NULL;
+	OP_REQUIRES_OK(context, context->allocate_output(2, TensorShape{E}, &counts_tensor));
+	Tensor *agreement_tensor = NULL;
+	OP_REQUIRES_OK(context, context->allocate_output(3, TensorShape{E}, &agreement_tensor));
+	int *rag_edges_out = rag_edges_tensor->flat<int>().data();
+	int *rag_offsets_out = rag_offsets_tensor->flat<int>().data();
+	int *counts_out = counts_tensor->flat<int>().data();
+	float *agreement_out = agreement_tensor->flat<float>().data();
+
+	int e = 0;
+	rag_offsets_out[0] = 0;
+	for (int b=0; b<B; b++){
+	    for (int i=0; i<num_segments[b]; i++){
+		for (int r=rag_offsets[b][i]; r<rag_offsets[b][i+1]; r++){
+		    rag_edges_out[e*3 + 0] = b;
+		    rag_edges_out[e*3 + 1] = i;
+		    rag_edges_out[e*3 + 2] = nbrs[b][r];
+		    counts_out[e] = counts[b][r];
+		    agreement_out[e] = agreement[b][r];
+		    e++;
+		}
+		rag_offsets_out[offsets[b] + i + 1] = e;
+	    }
+	}
+    }
+};
+
+REGISTER_KERNEL_BUILDER(Name("SegmentAdjacency").Device(DEVICE_CPU), SegmentAdjacencyOp);
 
 using namespace std;
 
 // assigns an integer label for each b, h, w in increasing order across examples
-static void assignLabels(int B, int H, int W, int k, int num_steps, bool defensive, const bool *edges, int *labels, int *num_segments){
+static void assignLabels(int B, int T, int H, int W, int k, int kt, int num_steps, bool defensive, unsigned seed, const bool *edges,
+			 int *labels, int *num_segments){
     // constants
-    int edges_per_ex = H*W*(std::pow((2*k + 1), 2)); int N = H*W;
+    int edges_per_ex = T*H*W*(2*kt + 1)*(std::pow((2*k + 1), 2)); int N = T*H*W;
     bool relabel=true; bool shuffle=true;
 
     int segments_now=0;
 
     // loop across batches
     for (int b=0; b<B; b++){
-	// do label prop w random seed
-	std::srand(std::time(0));
-	PixGraph G(H, W, k, &edges[b*edges_per_ex]); // edges for this example
+	// do label prop w this example's seed
+	PixGraph G(T, H, W, k, kt, &edges[b*edges_per_ex]); // edges for this example
+	G.seed(exampleSeed(seed, b));
 	for (int n=0; n<num_steps; n++)
 	    G.labelPropStep(defensive);
 	G.setNumLabels(relabel, shuffle, segments_now);
@@ -102,3 +548,145 @@ static void assignLabels(int B, int H, int W, int k, int num_steps, bool defensi
 	segments_now = segments_now + G.num_labels;
     }
 }
+
+
+// stencil edges of one example as bools, unpacking packed edges into buf
+static const bool *stencilBools(const bool *edges, int /* N */, int /* K */, std::vector<char> & /* buf */){ return edges; }
+template <typename M>
+static const bool *stencilBools(const M *masks, int N, int K, std::vector<char> &buf){
+    buf.resize(int64(N)*K);
+    for (int i=0; i<N; i++)
+	for (int e=0; e<K; e++)
+	    buf[int64(i)*K + e] = (masks[i] >> e) & 1;
+    return reinterpret_cast<const bool*>(buf.data());
+}
+
+// merges each example's smallest segments, by the stencil edges between segments, down to max_segments
+template <typename E>
+static void capSegmentLabels(int B, int H, int W, int k, int max_segments, const DeviceBase::CpuWorkerThreads &workers,
+			     const E *edges, int *labels, int *num_segments){
+    int N = H*W; int K = (2*k + 1)*(2*k + 1);
+    int64 edges_per_ex = std::is_same<E, bool>::value ? int64(N)*K : int64(N);
+    std::vector<int> offsets(B);
+    for (int b=1; b<B; b++)
+	offsets[b] = offsets[b-1] + num_segments[b-1];
+
+    // cap each example with labels local to it, then renumber across the batch
+    auto cap_examples = [&](int64 start, int64 limit){
+	std::vector<char> buf; std::vector<int> rag_offsets, nbrs, counts; std::vector<float> agreement;
+	for (int64 b=start; b<limit; b++){
+	    int S = num_segments[b];
+	    int *ex_labels = &labels[b*N];
+	    for (int i=0; i<N; i++)
+		ex_labels[i] -= offsets[b];
+	    if (S <= max_segments)
+		continue;
+	    std::vector<int> sizes(S, 0);
+	    for (int i=0; i<N; i++)
+		sizes[ex_labels[i]]++;
+	    const bool *ex_edges = stencilBools(&edges[b*edges_per_ex], N, K, buf);
+	    segmentAdjacency(H, W, k, S, ex_labels, ex_edges, rag_offsets, nbrs, counts, agreement);
+
+	    // weight each neighboring pair by its number of edges
+	    std::vector<int> pairs; std::vector<float> weights;
+	    for (int i=0; i<S; i++){
+		for (int p=rag_offsets[i]; p<rag_offsets[i+1]; p++){
+		    if (nbrs[p] < i)
+			continue;
+		    pairs.push_back(i); pairs.push_back(nbrs[p]);
+		    weights.push_back(counts[p]*agreement[p]);
+		}
+	    }
+	    std::vector<int> segment_map(S);
+	    num_segments[b] = capSegments(S, sizes.data(), weights.size(), pairs.data(), weights.data(), max_segments, segment_map.data());
+	    for (int i=0; i<N; i++)
+		ex_labels[i] = segment_map[ex_labels[i]];
+	}
+    };
+    Shard(workers.num_threads, workers.workers, B, int64(N)*K*4, cap_examples);
+
+    int segments_now = 0;
+    for (int b=0; b<B; b++){
+	for (int i=0; i<N; i++)
+	    labels[b*N + i] += segments_now;
+	segments_now += num_segments[b];
+    }
+}
+
+// as the single-frame assignLabels, sweeping the tiles of each example in parallel
+template <typename E>
+static void assignLabelsTiled(int B, int num_steps, bool defensive, int tile_size, const StencilTopology &topology,
+			      const DeviceBase::CpuWorkerThreads &workers, unsigned seed, const E *edges, int *labels, int *num_segments,
+			      PhaseTracer *tracer, GraphStats *stats){
+    int N = topology.H*topology.W;
+    int64 edges_per_ex = std::is_same<E, bool>::value ? int64(N)*topology.max_edges : int64(N);
+    int64 tile_cost = int64(tile_size)*tile_size*topology.max_edges*4;
+    bool shuffle=true;
+    int segments_now=0;
+    for (int b=0; b<B; b++){
+	GraphStats *ex_stats = stats ? &stats[b] : NULL;
+	ScopedPhase example(NULL, NULL, ex_stats, &GraphStats::total_seconds);
+	auto ex_edges = pixGraphEdges(&edges[b*edges_per_ex]);
+	ScopedPhase build(tracer, "build_graph", ex_stats, &GraphStats::build_seconds);
+	TiledPixGraph G(topology, tile_size, exampleSeed(seed, b));
+	int T = G.numTiles();
+	Shard(workers.num_threads, workers.workers, T, tile_cost, [&](int64 start, int64 limit){
+		for (int64 t=start; t<limit; t++)
+		    G.initTile(t, ex_edges);
+	    });
+	build.end();
+
+	ScopedPhase propagate(tracer, "propagate", ex_stats, &GraphStats::propagate_seconds);
+	for (int n=0; n<num_steps; n++){
+	    std::atomic<int> changes(0);
+	    Shard(workers.num_threads, workers.workers, T, tile_cost, [&](int64 start, int64 limit){
+		    int tile_changes = 0;
+		    for (int64 t=start; t<limit; t++)
+			tile_changes += G.sweepTile(t, defensive);
+		    changes += tile_changes;
+		});
+	    Shard(workers.num_threads, workers.workers, T, int64(tile_size)*topology.k*8, [&](int64 start, int64 limit){
+		    for (int64 t=start; t<limit; t++)
+			G.refreshHalo(t);
+		});
+	    if (ex_stats)
+		ex_stats->changes.push_back(changes);
+	}
+	propagate.end();
+	if (ex_stats)
+	    ex_stats->sweeps = num_steps;
+
+	ScopedPhase relabel(tracer, "merge_seams", ex_stats, &GraphStats::relabel_seconds);
+	num_segments[b] = G.mergeSeams(shuffle, segments_now, &labels[b*N]);
+	segments_now = segments_now + num_segments[b];
+    }
+}
+
+// as assignLabels, with affinity-weighted votes or felzenszwalb merging
+static void assignLabelsSoft(int B, int H, int W, int k, const SoftSegmentParams &p, unsigned seed, const float *affinities, int *labels,
+			     int *num_segments, GraphScratch *scratch){
+    int edges_per_ex = H*W*(2*k + 1)*(2*k + 1); int N = H*W;
+    bool relabel=true; bool shuffle=true;
+
+    int segments_now=0;
+    for (int b=0; b<B; b++){
+	if (p.felzenszwalb){
+	    num_segments[b] = felzenszwalbSegment(H, W, k, &affinities[b*edges_per_ex], p.min_affinity, p.scale, p.min_size,
+						  segments_now, &labels[b*N]);
+	    segments_now = segments_now + num_segments[b];
+	    continue;
+	}
+
+	PixGraph G(H, W, k, &affinities[b*edges_per_ex], p.min_affinity, scratch);
+	G.seed(exampleSeed(seed, b));
+	for (int n=0; n<p.num_steps; n++)
+	    G.labelPropStepWeighted();
+	G.setNumLabels(relabel, shuffle, segments_now);
+
+	int offset = b*N;
+	for (int i=0; i<N; i++)
+	    labels[offset + i] = G.V[i];
+	num_segments[b] = G.num_labels;
+	segments_now = segments_now + G.num_labels;
+    }
+}
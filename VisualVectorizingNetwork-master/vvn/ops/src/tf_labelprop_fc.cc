@@ -1,41 +1,77 @@
 #include "tensorflow/core/framework/op.h"
 #include "tensorflow/core/framework/op_kernel.h"
 #include "tensorflow/core/framework/shape_inference.h"
+#include "tensorflow/core/util/guarded_philox_random.h"
 #include "graphs.h"
+#include "tf_async_pool.h"
+#include "tf_graph_trace.h"
 
 using namespace tensorflow;
 
 // Propagates labels on graphs with arbitrary connectivity. Operates on
 // B graphs with num_nodes[b] nodes each, with edges defined by the
 // variable length tensor edges.
-// Returns the labels of each node in each example.
+// Returns the labels of each node in each example. If max_segments > 0, the
+// smallest segments of each example are merged into the neighbor they share
+// the most edges with until at most max_segments remain. If debug_stats, the
+// per-example timings and label changes of each sweep are returned in debug
+// as for LabelProp, which also shuffles each sweep from seed and seed2.
 
 REGISTER_OP("LabelPropFc")
     .Attr("num_steps: int") // num steps to run op
     .Attr("sort_edges: bool = true") // whether to sort the edges in increasing order of example
+    .Attr("max_segments: int = 0") // cap on segments per example, 0 for none
+    .Attr("debug_stats: bool = false") // whether to output debug
+    .Attr("seed: int = 0")
+    .Attr("seed2: int = 0")
     .Input("num_nodes: int32") // [B] number of nodes in each of B examples
     .Input("edges: int32") // edges across all examples, [?,3] where edges[i] = (batch_ind, sender_node_idx, receiver_node_idx)
     .Output("labels: int32") // [sum(num_nodes)] of new labels for each node
     .Output("num_segments: int32") // [B] number of segments (unique labels) per example
+    .Output("debug: float32") // [B,5+num_steps] per-example stats, or [0,0]
+    .SetIsStateful()
     .SetShapeFn([](::tensorflow::shape_inference::InferenceContext* c) {
+	int num_steps; bool debug_stats;
+	TF_RETURN_IF_ERROR(c->GetAttr("num_steps", &num_steps));
+	TF_RETURN_IF_ERROR(c->GetAttr("debug_stats", &debug_stats));
 	::tensorflow::shape_inference::ShapeHandle output = c->MakeShape({c->UnknownDim()});
 	c->set_output(0, output);
 	c->set_output(1, c->Vector(c->Dim(c->input(0),0)));
+	if (debug_stats)
+	    c->set_output(2, c->Matrix(c->Dim(c->input(0),0), graphStatsColumns(num_steps)));
+	else
+	    c->set_output(2, c->Matrix(0, 0));
 	return Status::OK();
 	});
 
-static void assignLabelsFC(int B, int E, const int *num_nodes, const int *edges, int *labels, int *num_segments, int num_steps, bool sort_edges); // declaration
+static void capSegmentLabelsFC(int B, int E, const int *num_nodes, const int *edges, int max_segments, int *labels, int *num_segments);
 
-class LabelPropFcOp : public OpKernel{
+class LabelPropFcOp : public AsyncOpKernel{
 private:
     int num_steps_;
     bool sort_edges_;
+    int max_segments_;
+    bool debug_stats_;
+    ScratchPool scratch_pool_; // graph storage kept across calls, one per concurrent call
+    GuardedPhiloxRandom generator_;
 public:
-    explicit LabelPropFcOp(OpKernelConstruction *context):OpKernel(context){
+    explicit LabelPropFcOp(OpKernelConstruction *context):AsyncOpKernel(context){
 	OP_REQUIRES_OK(context, context->GetAttr("num_steps", &num_steps_));
 	OP_REQUIRES_OK(context, context->GetAttr("sort_edges", &sort_edges_));
+	OP_REQUIRES_OK(context, context->GetAttr("max_segments", &max_segments_));
+	OP_REQUIRES_OK(context, context->GetAttr("debug_stats", &debug_stats_));
+	OP_REQUIRES_OK(context, generator_.Init(context));
     }
-    void Compute(OpKernelContext *context) override {
+    void ComputeAsync(OpKernelContext *context, DoneCallback done) override {
+	// run on the graph op pool and signal done when finished or failed
+	graphOpPool()->Schedule([this, context, done](){
+		computeLabels(context);
+		done();
+	    });
+    }
+    void computeLabels(OpKernelContext *context){
+	profiler::TraceMe trace("LabelPropFc");
+	unsigned seed = generator_.ReserveSamples128(1)()[0]; // of this call, each example's is derived from it
 	// num_nodes input
 	const Tensor &num_nodes_tensor = context->input(0);
 	OP_REQUIRES(context, num_nodes_tensor.dims()==1, errors::InvalidArgument("num_nodes must be a rank 1 tensor indicating number of nodes per example."));
@@ -69,7 +105,21 @@ public:
 	int *num_segments = &num_segments_flat(0); // pointer to num_segments output
 
 	// assign labels
-	assignLabelsFC(B, E, num_nodes, edges, labels, num_segments, num_steps_, sort_edges_);
+	TraceMePhases tracer;
+	std::vector<GraphStats> stats(debug_stats_ ? B : 0);
+	ScopedScratch scratch(scratch_pool_);
+	assignLabelsFC(B, E, num_nodes, edges, labels, num_segments, num_steps_, sort_edges_, seed, &tracer,
+		       debug_stats_ ? stats.data() : NULL, scratch.get());
+	if (max_segments_ > 0){
+	    profiler::TraceMe cap_trace("cap_segments");
+	    capSegmentLabelsFC(B, E, num_nodes, edges, max_segments_, labels, num_segments);
+	}
+
+	Tensor *debug_tensor = NULL;
+	TensorShape debug_shape = debug_stats_ ? TensorShape{B, graphStatsColumns(num_steps_)} : TensorShape{0, 0};
+	OP_REQUIRES_OK(context, context->allocate_output(2, debug_shape, &debug_tensor));
+	if (debug_stats_)
+	    writeGraphStats(stats, num_steps_, debug_tensor->flat<float>().data());
     }
 };
 
@@ -77,62 +127,42 @@ REGISTER_KERNEL_BUILDER(Name("LabelPropFc").Device(DEVICE_CPU), LabelPropFcOp);
 
 using namespace std;
 
-// constructs a graph of size num_nodes[b] for b in range(B), adds the appropriate edges, and does labelprop to reassign node labels.
-// if sort_edges, then the edges
-static void assignLabelsFC(int B, int E, const int *num_nodes, const int *edges, int *labels, int *num_segments, int num_steps, bool sort_edges){
-    // either make a copy of edges and sort or just reference
-    int **sedges = new int*[E];
-    for (int e=0; e<E; e++){
-    	sedges[e] = new int[3];
-    	for (int i=0; i<3; i++)
-    	    sedges[e][i] = edges[e*3 + i];
-    }
-    if (sort_edges)
-    	std::sort(&sedges[0], &sedges[E], [&](int *ei, int *ej){return ei[0] < ej[0];});
-
-    // debug print
-    // printf("Edges post sorting\n");
-    // for (int e=0; e<E; e++){
-    // 	for (int i=0; i<3; i++)
-    // 	    std::cout << sedges[e][i] << " ";
-    // 	std::cout << endl;
-    // }
-    // std::cout << endl;
-
-    // set labels and num segments output
-    int offset = 0; int edge_ctr = 0;
-    int nodes_so_far = 0;
+// merges each example's smallest segments, by the edges between segments, down to max_segments
+static void capSegmentLabelsFC(int B, int E, const int *num_nodes, const int *edges, int max_segments, int *labels, int *num_segments){
+    std::vector<int> node_offsets(B + 1, 0); std::vector<int> label_offsets(B + 1, 0);
     for (int b=0; b<B; b++){
+	node_offsets[b+1] = node_offsets[b] + num_nodes[b];
+	label_offsets[b+1] = label_offsets[b] + num_segments[b];
+    }
 
-    	int V = num_nodes[b]; // num nodes in this graph
-	Graph G(V, true); // init graph for labelprop
+    // segment pairs joined by each edge, grouped by example; like the stencil
+    // neighbors off the image, edges outside the examples or their nodes join nothing
+    std::vector<std::vector<int> > pairs(B);
+    for (int e=0; e<E; e++){
+	int b = edges[e*3]; int v = edges[e*3 + 1]; int w = edges[e*3 + 2];
+	if (b < 0 || b >= B || v < 0 || v >= num_nodes[b] || w < 0 || w >= num_nodes[b])
+	    continue;
+	int offset = node_offsets[b];
+	pairs[b].push_back(labels[offset + v] - label_offsets[b]);
+	pairs[b].push_back(labels[offset + w] - label_offsets[b]);
+    }
 
-	// add edges
-	while ((E - edge_ctr) && (sedges[edge_ctr][0] == b)){
-	    // std::cout << sedges[edge_ctr][0] << " " << sedges[edge_ctr][1] << " " << sedges[edge_ctr][2] << endl;
-	    G.addEdge(sedges[edge_ctr][1], sedges[edge_ctr][2]);
-	    edge_ctr++;
+    int segments_now = 0;
+    for (int b=0; b<B; b++){
+	int S = num_segments[b];
+	int *ex_labels = &labels[node_offsets[b]];
+	if (S > max_segments){
+	    std::vector<int> sizes(S, 0);
+	    for (int v=0; v<num_nodes[b]; v++)
+		sizes[ex_labels[v] - label_offsets[b]]++;
+	    std::vector<float> weights(pairs[b].size() / 2, 1.0f);
+	    std::vector<int> segment_map(S);
+	    num_segments[b] = capSegments(S, sizes.data(), weights.size(), pairs[b].data(), weights.data(), max_segments, segment_map.data());
+	    for (int v=0; v<num_nodes[b]; v++)
+		ex_labels[v] = segment_map[ex_labels[v] - label_offsets[b]] + label_offsets[b];
 	}
-
-	// do the labelprop and reset labels
-	std::srand(std::time(0));
-	for (int n=0; n<num_steps; n++)
-	    G.labelPropStep(false);
-	G.setNumLabels(true, offset);
-
-	// assign outputs
-	for (int v=0; v<V; v++)
-	    labels[nodes_so_far + v] = G.cc_ids[v];
-	num_segments[b] = G.num_labels;
-
-	// update
-	offset = offset + G.num_labels;
-	nodes_so_far = nodes_so_far + V;
+	for (int v=0; v<num_nodes[b]; v++)
+	    ex_labels[v] += segments_now - label_offsets[b];
+	segments_now += num_segments[b];
     }
-
-    // free memory
-    for (int e=0; e<E; e++)
-    	delete[] sedges[e];
-    delete[] sedges;
-
 }
@@ -5,6 +5,8 @@
 #include "tensorflow/core/framework/op_kernel.h"
 #include "tensorflow/core/framework/op.h"
 #include "tensorflow/core/framework/shape_inference.h"
+#include "tensorflow/core/profiler/lib/traceme.h"
+#include "nndistance.h"
 
 using namespace tensorflow;
 
@@ -25,30 +27,6 @@ REGISTER_OP("NnDistanceGrad")
 .Output("grad_xyz1: float32")
 .Output("grad_xyz2: float32");
 
-static void nnsearch(int b,int n,int m,const float * xyz1,const float * xyz2,float * dist,int * idx){
-	for (int i=0;i<b;i++){
-		for (int j=0;j<n;j++){
-			float x1=xyz1[(i*n+j)*3+0];
-			float y1=xyz1[(i*n+j)*3+1];
-			float z1=xyz1[(i*n+j)*3+2];
-			double best=0;
-			int besti=0;
-			for (int k=0;k<m;k++){
-				float x2=xyz2[(i*m+k)*3+0]-x1;
-				float y2=xyz2[(i*m+k)*3+1]-y1;
-				float z2=xyz2[(i*m+k)*3+2]-z1;
-				double d=x2*x2+y2*y2+z2*z2;
-				if (k==0 || d<best){
-					best=d;
-					besti=k;
-				}
-			}
-			dist[i*n+j]=best;
-			idx[i*n+j]=besti;
-		}
-	}
-}
-
 class NnDistanceOp : public OpKernel{
 	public:
 		explicit NnDistanceOp(OpKernelConstruction* context):OpKernel(context){}
@@ -83,8 +61,14 @@ class NnDistanceOp : public OpKernel{
 			int * idx1=&(idx1_flat(0));
 			float * dist2=&(dist2_flat(0));
 			int * idx2=&(idx2_flat(0));
-			nnsearch(b,n,m,xyz1,xyz2,dist1,idx1);
-			nnsearch(b,m,n,xyz2,xyz1,dist2,idx2);
+			{
+				profiler::TraceMe trace("NnDistance:xyz1_to_xyz2");
+				nnsearch(b,n,m,3,xyz1,xyz2,dist1,idx1);
+			}
+			{
+				profiler::TraceMe trace("NnDistance:xyz2_to_xyz1");
+				nnsearch(b,m,n,3,xyz2,xyz1,dist2,idx2);
+			}
 		}
 };
 REGISTER_KERNEL_BUILDER(Name("NnDistance").Device(DEVICE_CPU), NnDistanceOp);
@@ -134,6 +118,7 @@ class NnDistanceGradOp : public OpKernel{
 				grad_xyz1[i]=0;
 			for (int i=0;i<b*m*3;i++)
 				grad_xyz2[i]=0;
+			profiler::TraceMe trace("NnDistanceGrad:scatter");
 			for (int i=0;i<b;i++){
 				for (int j=0;j<n;j++){
 					float x1=xyz1[(i*n+j)*3+0];
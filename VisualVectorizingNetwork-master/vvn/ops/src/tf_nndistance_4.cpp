@@ -1,6 +1,8 @@
 #include "tensorflow/core/framework/op_kernel.h"
 #include "tensorflow/core/framework/op.h"
 #include "tensorflow/core/framework/shape_inference.h"
+#include "tensorflow/core/profiler/lib/traceme.h"
+#include "nndistance.h"
 
 REGISTER_OP("NnDistance4")
     .Input("xyz1: float32")
@@ -20,48 +22,6 @@ REGISTER_OP("NnDistance4Grad")
     .Output("grad_xyz2: float32");
 using namespace tensorflow;
 
-static void nnsearch(int b,int n,int m,const float * xyz1,const float * xyz2,float * dist,int * idx){
-        for (int i=0;i<b;i++){
-                for (int j=0;j<n;j++){
-                        float x1=xyz1[(i*n+j)*12+0];
-                        float y1=xyz1[(i*n+j)*12+1];
-                        float z1=xyz1[(i*n+j)*12+2];
-                        float x1_1=xyz1[(i*n+j)*12+3];
-                        float y1_1=xyz1[(i*n+j)*12+4];
-                        float z1_1=xyz1[(i*n+j)*12+5];
-                        float x1_2=xyz1[(i*n+j)*12+6];
-                        float y1_2=xyz1[(i*n+j)*12+7];
-                        float z1_2=xyz1[(i*n+j)*12+8];
-                        float x1_3=xyz1[(i*n+j)*12+9];
-                        float y1_3=xyz1[(i*n+j)*12+10];
-                        float z1_3=xyz1[(i*n+j)*12+11];
-                        double best=0;
-                        int besti=0;
-                        for (int k=0;k<m;k++){
-                                float x2=xyz2[(i*m+k)*12+0]-x1;
-                                float y2=xyz2[(i*m+k)*12+1]-y1;
-                                float z2=xyz2[(i*m+k)*12+2]-z1;
-                                float x2_1=xyz2[(i*m+k)*12+3]-x1_1;
-                                float y2_1=xyz2[(i*m+k)*12+4]-y1_1;
-                                float z2_1=xyz2[(i*m+k)*12+5]-z1_1;
-                                float x2_2=xyz2[(i*m+k)*12+6]-x1_2;
-                                float y2_2=xyz2[(i*m+k)*12+7]-y1_2;
-                                float z2_2=xyz2[(i*m+k)*12+8]-z1_2;
-                                float x2_3=xyz2[(i*m+k)*12+9]-x1_3;
-                                float y2_3=xyz2[(i*m+k)*12+10]-y1_3;
-                                float z2_3=xyz2[(i*m+k)*12+11]-z1_3;
-                                double d=x2*x2+y2*y2+z2*z2+x2_1*x2_1+y2_1*y2_1+z2_1*z2_1+x2_2*x2_2+y2_2*y2_2+z2_2*z2_2+x2_3*x2_3+y2_3*y2_3+z2_3*z2_3;
-                                if (k==0 || d<best){
-                                        best=d;
-                                        besti=k;
-                                }
-                        }
-                        dist[i*n+j]=best;
-                        idx[i*n+j]=besti;
-                }
-        }
-}
-
 class NnDistance4Op : public OpKernel{
         public:
                 explicit NnDistance4Op(OpKernelConstruction* context):OpKernel(context){}
@@ -96,8 +56,14 @@ class NnDistance4Op : public OpKernel{
                         int * idx1=&(idx1_flat(0));
                         float * dist2=&(dist2_flat(0));
                         int * idx2=&(idx2_flat(0));
-                        nnsearch(b,n,m,xyz1,xyz2,dist1,idx1);
-                        nnsearch(b,m,n,xyz2,xyz1,dist2,idx2);
+                        {
+                                profiler::TraceMe trace("NnDistance4:xyz1_to_xyz2");
+                                nnsearch(b,n,m,12,xyz1,xyz2,dist1,idx1);
+                        }
+                        {
+                                profiler::TraceMe trace("NnDistance4:xyz2_to_xyz1");
+                                nnsearch(b,m,n,12,xyz2,xyz1,dist2,idx2);
+                        }
                 }
 };
 REGISTER_KERNEL_BUILDER(Name("NnDistance4").Device(DEVICE_CPU), NnDistance4Op);
@@ -147,6 +113,7 @@ class NnDistance4GradOp : public OpKernel{
                                 grad_xyz1[i]=0;
                         for (int i=0;i<b*m*12;i++)
                                 grad_xyz2[i]=0;
+                        profiler::TraceMe trace("NnDistance4Grad:scatter");
                         for (int i=0;i<b;i++){
                                 for (int j=0;j<n;j++){
                                         float x1=xyz1[(i*n+j)*12+0];
@@ -0,0 +1,180 @@
+#include "tensorflow/core/framework/op.h"
+#include "tensorflow/core/framework/op_kernel.h"
+#include "tensorflow/core/framework/shape_inference.h"
+#include "tensorflow/core/util/work_sharder.h"
+#include "particles.h"
+
+using namespace tensorflow;
+
+// Decides which of N projected particles are hidden behind another particle.
+// A particle p is occluded if some particle q lies within p_radius of it in
+// image space and is closer to the camera (q_z > p_z). Instead of comparing
+// all [N,N] pairs, each frame's particles are bucketed into a screen-space
+// grid sorted by depth, so p is only tested against nearer particles in the
+// neighbouring cells. Returns the same not_occluded_mask as the pairwise
+// occlude_particles_in_camera_volume in models/rendering.py.
+
+REGISTER_OP("OccludeParticles")
+    .Attr("p_radius: float") // image-space radius of each particle's disc
+    .Input("coordinates: float32") // [B,T,N,2] (h,w) image coordinates
+    .Input("depths: float32") // [B,T,N,1] depths in camera space, negative in front of camera
+    .Input("mask: float32") // [B,T,N,1] 1.0 for real particles, 0.0 for fake ones
+    .Output("not_occluded_mask: float32") // [B,T,N,1] 1.0 where a real particle is visible
+    .SetShapeFn([](::tensorflow::shape_inference::InferenceContext* c) {
+	    c->set_output(0, c->input(1));
+	    return Status::OK();
+	});
+
+class OccludeParticlesOp : public OpKernel{
+private:
+    float p_radius_;
+public:
+    explicit OccludeParticlesOp(OpKernelConstruction *context):OpKernel(context){
+	OP_REQUIRES_OK(context, context->GetAttr("p_radius", &p_radius_));
+    }
+    void Compute(OpKernelContext *context) override {
+	const Tensor &coords_tensor = context->input(0);
+	const Tensor &depths_tensor = context->input(1);
+	const Tensor &mask_tensor = context->input(2);
+	OP_REQUIRES(context, coords_tensor.dims()==4 && coords_tensor.shape().dim_size(3)==2, errors::InvalidArgument("OccludeParticles requires coordinates of shape (B,T,N,2)"));
+	int B = coords_tensor.shape().dim_size(0);
+	int T = coords_tensor.shape().dim_size(1);
+	int N = coords_tensor.shape().dim_size(2);
+	OP_REQUIRES(context, depths_tensor.shape()==(TensorShape{B,T,N,1}), errors::InvalidArgument("OccludeParticles requires depths of shape (B,T,N,1)"));
+	OP_REQUIRES(context, mask_tensor.shape()==(TensorShape{B,T,N,1}), errors::InvalidArgument("OccludeParticles requires mask of shape (B,T,N,1)"));
+
+	auto coords_flat = coords_tensor.flat<float>();
+	const float *coords = &coords_flat(0);
+	auto depths_flat = depths_tensor.flat<float>();
+	const float *depths = &depths_flat(0);
+	auto mask_flat = mask_tensor.flat<float>();
+	const float *mask = &mask_flat(0);
+
+	Tensor *not_occluded_tensor = NULL;
+	OP_REQUIRES_OK(context, context->allocate_output(0, TensorShape{B,T,N,1}, &not_occluded_tensor));
+	if (B*T*N == 0)
+	    return;
+	auto not_occluded_flat = not_occluded_tensor->flat<float>();
+	float *not_occluded = &not_occluded_flat(0);
+
+	// frames are independent
+	float p_radius = p_radius_;
+	auto occlude_frames = [=](int64 start, int64 limit){
+	    ScreenGrid grid;
+	    for (int64 f=start; f<limit; f++)
+		occludeParticles(N, &coords[f*N*2], &depths[f*N], &mask[f*N], p_radius, &not_occluded[f*N], grid);
+	};
+	auto worker_threads = *(context->device()->tensorflow_cpu_worker_threads());
+	Shard(worker_threads.num_threads, worker_threads.workers, B*T, int64(N)*64, occlude_frames);
+    }
+};
+
+REGISTER_KERNEL_BUILDER(Name("OccludeParticles").Device(DEVICE_CPU), OccludeParticlesOp);
+
+// Fuses project_and_occlude_particles into a single pass per frame: puts the
+// xyz dims of the particles in camera-relative coordinates (unless they already
+// are), projects them onto an image of size im_size, cleans up non-finite and
+// out-of-range coordinates, resolves occlusions on the screen-space grid and
+// rounds the coordinates to image indices. Matrices may be shared [4,4] or
+// given per frame as [B,T,4,4].
+
+REGISTER_OP("ProjectAndOccludeParticles")
+    .Attr("im_size: list(int)") // [H,W]
+    .Attr("p_radius: float") // image-space radius of each particle's disc
+    .Attr("xyz_dim: int = 0") // first of the three xyz dims of each particle
+    .Attr("agent_centered: bool = true") // if false, camera_matrix maps raw particles to camera coordinates
+    .Attr("coord_max: float = 1000.0") // image coordinates are clipped to +-coord_max
+    .Attr("eps: float = 1e-8") // added to the homogeneous coordinate before normalizing
+    .Input("particles: float32") // [B,T,N,D]
+    .Input("projection_matrix: float32") // [4,4] or [B,T,4,4]
+    .Input("camera_matrix: float32") // [4,4] or [B,T,4,4], ignored if agent_centered
+    .Input("mask: float32") // [B,T,N,1] 1.0 for real particles, 0.0 for fake ones
+    .Output("particles_im_indices: int32") // [B,T,N,2] (h,w) indices into the image
+    .Output("not_occluded_mask: float32") // [B,T,N,1] 1.0 where a real particle is visible
+    .Output("particles_im_coordinates: float32") // [B,T,N,2] float (h,w) coordinates
+    .SetShapeFn([](::tensorflow::shape_inference::InferenceContext* c) {
+	    ::tensorflow::shape_inference::ShapeHandle coords_shape;
+	    TF_RETURN_IF_ERROR(c->ReplaceDim(c->input(0), 3, c->MakeDim(2), &coords_shape));
+	    c->set_output(0, coords_shape);
+	    c->set_output(1, c->input(3));
+	    c->set_output(2, coords_shape);
+	    return Status::OK();
+	});
+
+class ProjectAndOccludeParticlesOp : public OpKernel{
+private:
+    std::vector<int> im_size_;
+    float p_radius_;
+    int xyz_dim_;
+    bool agent_centered_;
+    float coord_max_;
+    float eps_;
+public:
+    explicit ProjectAndOccludeParticlesOp(OpKernelConstruction *context):OpKernel(context){
+	OP_REQUIRES_OK(context, context->GetAttr("im_size", &im_size_));
+	OP_REQUIRES(context, im_size_.size()==2, errors::InvalidArgument("ProjectAndOccludeParticles requires im_size = [H,W]"));
+	OP_REQUIRES_OK(context, context->GetAttr("p_radius", &p_radius_));
+	OP_REQUIRES_OK(context, context->GetAttr("xyz_dim", &xyz_dim_));
+	OP_REQUIRES_OK(context, context->GetAttr("agent_centered", &agent_centered_));
+	OP_REQUIRES_OK(context, context->GetAttr("coord_max", &coord_max_));
+	OP_REQUIRES_OK(context, context->GetAttr("eps", &eps_));
+    }
+    void Compute(OpKernelContext *context) override {
+	const Tensor &particles_tensor = context->input(0);
+	const Tensor &pmat_tensor = context->input(1);
+	const Tensor &vmat_tensor = context->input(2);
+	const Tensor &mask_tensor = context->input(3);
+	OP_REQUIRES(context, particles_tensor.dims()==4, errors::InvalidArgument("ProjectAndOccludeParticles requires particles of shape (B,T,N,D)"));
+	int B = particles_tensor.shape().dim_size(0);
+	int T = particles_tensor.shape().dim_size(1);
+	int N = particles_tensor.shape().dim_size(2);
+	int D = particles_tensor.shape().dim_size(3);
+	OP_REQUIRES(context, xyz_dim_ >= 0 && xyz_dim_ + 3 <= D, errors::InvalidArgument("ProjectAndOccludeParticles requires particles[...,xyz_dim:xyz_dim+3] to be in range"));
+	OP_REQUIRES(context, mask_tensor.shape()==(TensorShape{B,T,N,1}), errors::InvalidArgument("ProjectAndOccludeParticles requires mask of shape (B,T,N,1)"));
+	bool pmat_per_frame = (pmat_tensor.shape()==(TensorShape{B,T,4,4}));
+	OP_REQUIRES(context, pmat_per_frame || pmat_tensor.shape()==(TensorShape{4,4}), errors::InvalidArgument("ProjectAndOccludeParticles requires projection_matrix of shape (4,4) or (B,T,4,4)"));
+	bool vmat_per_frame = (vmat_tensor.shape()==(TensorShape{B,T,4,4}));
+	OP_REQUIRES(context, agent_centered_ || vmat_per_frame || vmat_tensor.shape()==(TensorShape{4,4}), errors::InvalidArgument("ProjectAndOccludeParticles requires camera_matrix of shape (4,4) or (B,T,4,4)"));
+	int H = im_size_[0]; int W = im_size_[1];
+
+	auto particles_flat = particles_tensor.flat<float>();
+	const float *particles = particles_flat.data();
+	auto pmat_flat = pmat_tensor.flat<float>();
+	const float *pmat = pmat_flat.data();
+	auto vmat_flat = vmat_tensor.flat<float>();
+	const float *vmat = agent_centered_ ? NULL : vmat_flat.data();
+	auto mask_flat = mask_tensor.flat<float>();
+	const float *mask = mask_flat.data();
+
+	// outputs
+	Tensor *inds_tensor = NULL;
+	OP_REQUIRES_OK(context, context->allocate_output(0, TensorShape{B,T,N,2}, &inds_tensor));
+	Tensor *not_occluded_tensor = NULL;
+	OP_REQUIRES_OK(context, context->allocate_output(1, TensorShape{B,T,N,1}, &not_occluded_tensor));
+	Tensor *coords_tensor = NULL;
+	OP_REQUIRES_OK(context, context->allocate_output(2, TensorShape{B,T,N,2}, &coords_tensor));
+	if (B*T*N == 0)
+	    return;
+	int *inds = inds_tensor->flat<int>().data();
+	float *not_occluded = not_occluded_tensor->flat<float>().data();
+	float *coords = coords_tensor->flat<float>().data();
+
+	int xyz_dim = xyz_dim_; float p_radius = p_radius_;
+	float coord_max = coord_max_; float eps = eps_;
+	auto project_frames = [=](int64 start, int64 limit){
+	    ScreenGrid grid;
+	    std::vector<float> depths(N);
+	    for (int64 f=start; f<limit; f++){
+		const float *V = (vmat == NULL) ? NULL : &vmat[vmat_per_frame ? f*16 : 0];
+		const float *P = &pmat[pmat_per_frame ? f*16 : 0];
+		projectParticles(N, D, xyz_dim, &particles[f*N*D], V, P, H, W, coord_max, eps, &coords[f*N*2], depths.data());
+		occludeParticles(N, &coords[f*N*2], depths.data(), &mask[f*N], p_radius, &not_occluded[f*N], grid);
+		coordsToIndices(N, H, W, &coords[f*N*2], &inds[f*N*2]);
+	    }
+	};
+	auto worker_threads = *(context->device()->tensorflow_cpu_worker_threads());
+	Shard(worker_threads.num_threads, worker_threads.workers, B*T, int64(N)*(64 + 2*D), project_frames);
+    }
+};
+
+REGISTER_KERNEL_BUILDER(Name("ProjectAndOccludeParticles").Device(DEVICE_CPU), ProjectAndOccludeParticlesOp);
@@ -0,0 +1,70 @@
+#include "tensorflow/core/framework/op.h"
+#include "tensorflow/core/framework/op_kernel.h"
+#include "tensorflow/core/framework/shape_inference.h"
+#include "tensorflow/core/util/work_sharder.h"
+#include "sampling.h"
+
+using namespace tensorflow;
+
+// Downsamples each example's valid points to num_points by farthest-point
+// sampling: starting from the first valid point, repeatedly picks the point
+// farthest (in squared euclidean distance over all D dims) from those already
+// picked. Examples with fewer valid points than num_points are padded with
+// repeats of the first sample, which sampled_mask marks as 0. With no points
+// at all (N == 0), inds are 0 and sampled_mask is 0, so they must not be
+// gathered from.
+
+REGISTER_OP("FarthestPointSample")
+    .Attr("num_points: int >= 1") // P
+    .Input("points: float32") // [B,N,D]
+    .Input("mask: float32") // [B,N] nonzero for valid points
+    .Output("inds: int32") // [B,P] indices into the N points
+    .Output("sampled_mask: float32") // [B,P] 1.0 where inds is a distinct valid point
+    .SetShapeFn([](::tensorflow::shape_inference::InferenceContext* c) {
+	    int P;
+	    TF_RETURN_IF_ERROR(c->GetAttr("num_points", &P));
+	    ::tensorflow::shape_inference::ShapeHandle points_shape;
+	    TF_RETURN_IF_ERROR(c->WithRank(c->input(0), 3, &points_shape));
+	    c->set_output(0, c->Matrix(c->Dim(points_shape, 0), P));
+	    c->set_output(1, c->Matrix(c->Dim(points_shape, 0), P));
+	    return Status::OK();
+	});
+
+class FarthestPointSampleOp : public OpKernel{
+private:
+    int num_points_;
+public:
+    explicit FarthestPointSampleOp(OpKernelConstruction *context):OpKernel(context){
+	OP_REQUIRES_OK(context, context->GetAttr("num_points", &num_points_));
+    }
+    void Compute(OpKernelContext *context) override {
+	const Tensor &points_tensor = context->input(0);
+	const Tensor &mask_tensor = context->input(1);
+	OP_REQUIRES(context, points_tensor.dims()==3, errors::InvalidArgument("FarthestPointSample requires points of shape (B,N,D)"));
+	int B = points_tensor.shape().dim_size(0);
+	int N = points_tensor.shape().dim_size(1);
+	int D = points_tensor.shape().dim_size(2);
+	OP_REQUIRES(context, mask_tensor.shape()==(TensorShape{B,N}), errors::InvalidArgument("FarthestPointSample requires mask of shape (B,N)"));
+	int P = num_points_;
+
+	const float *points = points_tensor.flat<float>().data();
+	const float *mask = mask_tensor.flat<float>().data();
+
+	Tensor *inds_tensor = NULL;
+	OP_REQUIRES_OK(context, context->allocate_output(0, TensorShape{B,P}, &inds_tensor));
+	Tensor *sampled_tensor = NULL;
+	OP_REQUIRES_OK(context, context->allocate_output(1, TensorShape{B,P}, &sampled_tensor));
+	int *inds = inds_tensor->flat<int>().data();
+	float *sampled = sampled_tensor->flat<float>().data();
+
+	// examples are independent
+	auto sample_examples = [&](int64 start, int64 limit){
+	    for (int64 b=start; b<limit; b++)
+		farthestPointSample(N, D, &points[b*N*D], &mask[b*N], P, &inds[b*P], &sampled[b*P]);
+	};
+	auto worker_threads = *(context->device()->tensorflow_cpu_worker_threads());
+	Shard(worker_threads.num_threads, worker_threads.workers, B, int64(P)*N*(3*D + 4), sample_examples);
+    }
+};
+
+REGISTER_KERNEL_BUILDER(Name("FarthestPointSample").Device(DEVICE_CPU), FarthestPointSampleOp);
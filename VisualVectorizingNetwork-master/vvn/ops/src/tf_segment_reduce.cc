@@ -0,0 +1,200 @@
+#include "tensorflow/core/framework/op.h"
+#include "tensorflow/core/framework/op_kernel.h"
+#include "tensorflow/core/framework/shape_inference.h"
+#include "tensorflow/core/util/work_sharder.h"
+#include "segments.h"
+
+using namespace tensorflow;
+
+// Deterministic replacement for the unsorted_segment_* calls in sum_effects.
+// ReceiverCsr groups E (batch_idx, time_idx, receiver_idx) triples by flat
+// receiver with a stable counting sort; the resulting CSR can be computed once
+// and shared by every reduction over the same receivers. SegmentReduceCsr then
+// reduces [E,C] values into [B*T*N,C] rows in parallel, each row summed in a
+// fixed order without atomics.
+
+REGISTER_OP("ReceiverCsr")
+    .Attr("batch_size: int")
+    .Attr("time: int")
+    .Attr("num_nodes: int")
+    .Input("receiver_idxs: int32") // [E,3] of (batch_idx, time_idx, receiver_idx)
+    .Output("offsets: int32") // [B*T*N+1] start of each receiver's items in order
+    .Output("order: int32") // [E] item inds grouped by receiver
+    .SetShapeFn([](::tensorflow::shape_inference::InferenceContext* c) {
+	    int B; int T; int N;
+	    TF_RETURN_IF_ERROR(c->GetAttr("batch_size", &B));
+	    TF_RETURN_IF_ERROR(c->GetAttr("time", &T));
+	    TF_RETURN_IF_ERROR(c->GetAttr("num_nodes", &N));
+	    c->set_output(0, c->Vector(c->MakeDim(B*T*N + 1)));
+	    c->set_output(1, c->Vector(c->Dim(c->input(0), 0)));
+	    return Status::OK();
+	});
+
+REGISTER_OP("SegmentReduceCsr")
+    .Attr("reduction: {'sum', 'mean', 'max'} = 'sum'")
+    .Input("values: float32") // [E,C]
+    .Input("offsets: int32") // [R+1]
+    .Input("order: int32") // [E]
+    .Output("output: float32") // [R,C]
+    .SetShapeFn([](::tensorflow::shape_inference::InferenceContext* c) {
+	    ::tensorflow::shape_inference::DimensionHandle num_rows;
+	    TF_RETURN_IF_ERROR(c->Add(c->Dim(c->input(1), 0), -1, &num_rows));
+	    c->set_output(0, c->Matrix(num_rows, c->Dim(c->input(0), 1)));
+	    return Status::OK();
+	});
+
+REGISTER_OP("SegmentReduceCsrGrad")
+    .Attr("reduction: {'sum', 'mean', 'max'} = 'sum'")
+    .Input("values: float32") // [E,C]
+    .Input("offsets: int32") // [R+1]
+    .Input("order: int32") // [E]
+    .Input("output: float32") // [R,C] forward output, needed for max
+    .Input("grad_output: float32") // [R,C]
+    .Output("grad_values: float32") // [E,C]
+    .SetShapeFn([](::tensorflow::shape_inference::InferenceContext* c) {
+	    c->set_output(0, c->input(0));
+	    return Status::OK();
+	});
+
+class ReceiverCsrOp : public OpKernel{
+private:
+    int B; int T; int N;
+public:
+    explicit ReceiverCsrOp(OpKernelConstruction *context):OpKernel(context){
+	OP_REQUIRES_OK(context, context->GetAttr("batch_size", &B));
+	OP_REQUIRES_OK(context, context->GetAttr("time", &T));
+	OP_REQUIRES_OK(context, context->GetAttr("num_nodes", &N));
+    }
+    void Compute(OpKernelContext *context) override {
+	const Tensor &idxs_tensor = context->input(0);
+	OP_REQUIRES(context, idxs_tensor.dims()==2 && idxs_tensor.shape().dim_size(1)==3, errors::InvalidArgument("ReceiverCsr requires receiver_idxs of shape (E,3)"));
+	int E = idxs_tensor.shape().dim_size(0);
+	const int *idxs = idxs_tensor.flat<int>().data();
+
+	Tensor *offsets_tensor = NULL;
+	OP_REQUIRES_OK(context, context->allocate_output(0, TensorShape{B*T*N + 1}, &offsets_tensor));
+	Tensor *order_tensor = NULL;
+	OP_REQUIRES_OK(context, context->allocate_output(1, TensorShape{E}, &order_tensor));
+	int *offsets = offsets_tensor->flat<int>().data();
+	int *order = order_tensor->flat<int>().data();
+	OP_REQUIRES(context, receiverIdxsCSR(E, idxs, B, T, N, offsets, order),
+		    errors::InvalidArgument("ReceiverCsr receiver_idxs must be in range of (batch_size, time, num_nodes)"));
+    }
+};
+
+REGISTER_KERNEL_BUILDER(Name("ReceiverCsr").Device(DEVICE_CPU), ReceiverCsrOp);
+
+static SegmentReduction parseReduction(const string &reduction){
+    if (reduction == "mean")
+	return SEGMENT_MEAN;
+    else if (reduction == "max")
+	return SEGMENT_MAX;
+    return SEGMENT_SUM;
+}
+
+// checks that offsets and order describe a grouping of all E values into R rows
+static void checkCSR(OpKernelContext *context, const Tensor &values_tensor, const Tensor &offsets_tensor, const Tensor &order_tensor){
+    OP_REQUIRES(context, values_tensor.dims()==2, errors::InvalidArgument("SegmentReduceCsr requires values of shape (E,C)"));
+    OP_REQUIRES(context, offsets_tensor.dims()==1 && offsets_tensor.shape().dim_size(0) >= 1, errors::InvalidArgument("SegmentReduceCsr requires offsets of shape (R+1,)"));
+    int E = values_tensor.shape().dim_size(0);
+    OP_REQUIRES(context, order_tensor.shape()==(TensorShape{E}), errors::InvalidArgument("SegmentReduceCsr requires order of shape (E,)"));
+    int R = offsets_tensor.shape().dim_size(0) - 1;
+    const int *offsets = offsets_tensor.flat<int>().data();
+    const int *order = order_tensor.flat<int>().data();
+    bool valid = (offsets[0] == 0) && (offsets[R] == E);
+    for (int i=0; i<R && valid; i++)
+	valid = (offsets[i] <= offsets[i+1]);
+    std::vector<bool> seen(E, false);
+    for (int e=0; e<E && valid; e++){
+	valid = (order[e] >= 0) && (order[e] < E) && !seen[order[e]];
+	if (valid)
+	    seen[order[e]] = true;
+    }
+    OP_REQUIRES(context, valid, errors::InvalidArgument("SegmentReduceCsr requires offsets and order from ReceiverCsr over the same values"));
+}
+
+class SegmentReduceCsrOp : public OpKernel{
+private:
+    SegmentReduction reduction_;
+public:
+    explicit SegmentReduceCsrOp(OpKernelConstruction *context):OpKernel(context){
+	string reduction;
+	OP_REQUIRES_OK(context, context->GetAttr("reduction", &reduction));
+	reduction_ = parseReduction(reduction);
+    }
+    void Compute(OpKernelContext *context) override {
+	const Tensor &values_tensor = context->input(0);
+	const Tensor &offsets_tensor = context->input(1);
+	const Tensor &order_tensor = context->input(2);
+	checkCSR(context, values_tensor, offsets_tensor, order_tensor);
+	if (!context->status().ok())
+	    return;
+	int E = values_tensor.shape().dim_size(0);
+	int C = values_tensor.shape().dim_size(1);
+	int R = offsets_tensor.shape().dim_size(0) - 1;
+
+	Tensor *output_tensor = NULL;
+	OP_REQUIRES_OK(context, context->allocate_output(0, TensorShape{R,C}, &output_tensor));
+	if (R*C == 0)
+	    return;
+	const float *values = values_tensor.flat<float>().data();
+	const int *offsets = offsets_tensor.flat<int>().data();
+	const int *order = order_tensor.flat<int>().data();
+	float *output = output_tensor->flat<float>().data();
+
+	SegmentReduction reduction = reduction_;
+	auto reduce_rows = [=](int64 start, int64 limit){
+	    segmentReduce(reduction, start, limit, C, values, offsets, order, output);
+	};
+	auto worker_threads = *(context->device()->tensorflow_cpu_worker_threads());
+	Shard(worker_threads.num_threads, worker_threads.workers, R, (int64(E) / R + 1) * C, reduce_rows);
+    }
+};
+
+REGISTER_KERNEL_BUILDER(Name("SegmentReduceCsr").Device(DEVICE_CPU), SegmentReduceCsrOp);
+
+class SegmentReduceCsrGradOp : public OpKernel{
+private:
+    SegmentReduction reduction_;
+public:
+    explicit SegmentReduceCsrGradOp(OpKernelConstruction *context):OpKernel(context){
+	string reduction;
+	OP_REQUIRES_OK(context, context->GetAttr("reduction", &reduction));
+	reduction_ = parseReduction(reduction);
+    }
+    void Compute(OpKernelContext *context) override {
+	const Tensor &values_tensor = context->input(0);
+	const Tensor &offsets_tensor = context->input(1);
+	const Tensor &order_tensor = context->input(2);
+	checkCSR(context, values_tensor, offsets_tensor, order_tensor);
+	if (!context->status().ok())
+	    return;
+	int C = values_tensor.shape().dim_size(1);
+	int R = offsets_tensor.shape().dim_size(0) - 1;
+	const Tensor &output_tensor = context->input(3);
+	const Tensor &grad_output_tensor = context->input(4);
+	OP_REQUIRES(context, output_tensor.shape()==(TensorShape{R,C}), errors::InvalidArgument("SegmentReduceCsrGrad requires output of shape (R,C)"));
+	OP_REQUIRES(context, grad_output_tensor.shape()==(TensorShape{R,C}), errors::InvalidArgument("SegmentReduceCsrGrad requires grad_output of shape (R,C)"));
+
+	Tensor *grad_values_tensor = NULL;
+	OP_REQUIRES_OK(context, context->allocate_output(0, values_tensor.shape(), &grad_values_tensor));
+	if (values_tensor.NumElements() == 0)
+	    return;
+	const float *values = values_tensor.flat<float>().data();
+	const int *offsets = offsets_tensor.flat<int>().data();
+	const int *order = order_tensor.flat<int>().data();
+	const float *output = output_tensor.flat<float>().data();
+	const float *grad_output = grad_output_tensor.flat<float>().data();
+	float *grad_values = grad_values_tensor->flat<float>().data();
+
+	// each value belongs to exactly one row, so rows write disjoint gradients
+	SegmentReduction reduction = reduction_;
+	auto backprop_rows = [=](int64 start, int64 limit){
+	    segmentReduceGrad(reduction, start, limit, C, values, offsets, order, output, grad_output, grad_values);
+	};
+	auto worker_threads = *(context->device()->tensorflow_cpu_worker_threads());
+	Shard(worker_threads.num_threads, worker_threads.workers, R, (values_tensor.NumElements() / R + 1) * 2, backprop_rows);
+    }
+};
+
+REGISTER_KERNEL_BUILDER(Name("SegmentReduceCsrGrad").Device(DEVICE_CPU), SegmentReduceCsrGradOp);
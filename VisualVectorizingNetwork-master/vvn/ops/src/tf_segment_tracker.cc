@@ -0,0 +1,144 @@
+#include "tensorflow/core/framework/op.h"
+#include "tensorflow/core/framework/op_kernel.h"
+#include "tensorflow/core/framework/resource_mgr.h"
+#include "tensorflow/core/framework/shape_inference.h"
+#include "tensorflow/core/platform/mutex.h"
+#include "tensorflow/core/util/work_sharder.h"
+#include "segments.h"
+
+using namespace tensorflow;
+
+// Gives the segments of each frame ids that are stable over time. Each of the
+// B examples is its own stream; the tracker keeps the track id of every pixel
+// in its previous frame, and matches the new frame's segments to those tracks
+// by pixel overlap IoU (see matchSegmentsIoU). Matched segments keep their
+// track's id and the rest start new tracks. The state lives in the resource
+// manager under container/shared_name, so it persists across session.run
+// calls; reset starts every stream over, as does a change of shape.
+
+REGISTER_OP("TrackSegments")
+    .Attr("iou_thresh: float = 0.5") // min IoU for a segment to continue a track
+    .Attr("container: string = ''")
+    .Attr("shared_name: string = ''")
+    .Input("labels: int32") // [B,HW] LabelProp labels, increasing over examples
+    .Input("num_segments: int32") // [B] number of segments per example
+    .Input("reset: bool") // [] whether to start new streams at this frame
+    .Output("track_ids: int32") // [B,HW] track of each pixel, in [0,num_tracks[b])
+    .Output("segment_tracks: int32") // [sum(num_segments)] track of each label
+    .Output("num_tracks: int32") // [B] tracks started so far in each stream
+    .SetIsStateful()
+    .SetShapeFn([](::tensorflow::shape_inference::InferenceContext* c) {
+	    c->set_output(0, c->input(0));
+	    c->set_output(1, c->Vector(c->UnknownDim()));
+	    c->set_output(2, c->input(1));
+	    return Status::OK();
+	});
+
+class SegmentTracker : public ResourceBase{
+public:
+    mutex mu;
+    std::vector<std::vector<int> > track_ids GUARDED_BY(mu); // [B][HW] previous frame's track of each pixel
+    std::vector<int> num_tracks GUARDED_BY(mu); // [B]
+
+    string DebugString() const override { return "SegmentTracker"; }
+};
+
+static void trackSegments(int N, int S, int offset, float iou_thresh, const int *labels, std::vector<int> &prev_tracks, int &num_tracks,
+			  int *track_ids, int *segment_tracks);
+
+class TrackSegmentsOp : public OpKernel{
+private:
+    float iou_thresh_;
+    ContainerInfo cinfo_;
+public:
+    explicit TrackSegmentsOp(OpKernelConstruction *context):OpKernel(context){
+	OP_REQUIRES_OK(context, context->GetAttr("iou_thresh", &iou_thresh_));
+	OP_REQUIRES_OK(context, cinfo_.Init(context->resource_manager(), def()));
+    }
+    ~TrackSegmentsOp() override {
+	// a tracker without a shared_name belongs to this kernel alone
+	if (cinfo_.resource_is_private_to_kernel())
+	    cinfo_.resource_manager()->Delete<SegmentTracker>(cinfo_.container(), cinfo_.name());
+    }
+    void Compute(OpKernelContext *context) override {
+	const Tensor &labels_tensor = context->input(0);
+	const Tensor &num_segments_tensor = context->input(1);
+	const Tensor &reset_tensor = context->input(2);
+	OP_REQUIRES(context, labels_tensor.dims()==2, errors::InvalidArgument("TrackSegments requires labels of shape (B,HW)"));
+	int B = labels_tensor.shape().dim_size(0);
+	int N = labels_tensor.shape().dim_size(1);
+	OP_REQUIRES(context, num_segments_tensor.shape()==(TensorShape{B}), errors::InvalidArgument("TrackSegments requires num_segments of shape (B)"));
+	OP_REQUIRES(context, reset_tensor.NumElements()==1, errors::InvalidArgument("TrackSegments requires a scalar reset"));
+	const int *labels = labels_tensor.flat<int>().data();
+	const int *num_segments = num_segments_tensor.flat<int>().data();
+	bool reset = reset_tensor.flat<bool>()(0);
+
+	// every label must lie in its example's range
+	std::vector<int> offsets(B + 1, 0);
+	for (int b=0; b<B; b++)
+	    offsets[b+1] = offsets[b] + num_segments[b];
+	for (int b=0; b<B; b++)
+	    for (int i=0; i<N; i++)
+		OP_REQUIRES(context, labels[b*N + i] >= offsets[b] && labels[b*N + i] < offsets[b+1],
+			    errors::InvalidArgument("TrackSegments found a label outside its example's num_segments"));
+
+	Tensor *track_ids_tensor = NULL;
+	OP_REQUIRES_OK(context, context->allocate_output(0, TensorShape{B,N}, &track_ids_tensor));
+	Tensor *segment_tracks_tensor = NULL;
+	OP_REQUIRES_OK(context, context->allocate_output(1, TensorShape{offsets[B]}, &segment_tracks_tensor));
+	Tensor *num_tracks_tensor = NULL;
+	OP_REQUIRES_OK(context, context->allocate_output(2, TensorShape{B}, &num_tracks_tensor));
+	int *track_ids = track_ids_tensor->flat<int>().data();
+	int *segment_tracks = segment_tracks_tensor->flat<int>().data();
+	int *num_tracks = num_tracks_tensor->flat<int>().data();
+
+	SegmentTracker *tracker = NULL;
+	OP_REQUIRES_OK(context, cinfo_.resource_manager()->LookupOrCreate<SegmentTracker>(
+			   cinfo_.container(), cinfo_.name(), &tracker, [](SegmentTracker **t){
+			       *t = new SegmentTracker();
+			       return Status::OK();
+			   }));
+	core::ScopedUnref unref(tracker);
+	mutex_lock l(tracker->mu);
+	if (reset || int(tracker->track_ids.size()) != B || (B > 0 && int(tracker->track_ids[0].size()) != N)){
+	    tracker->track_ids.assign(B, std::vector<int>());
+	    tracker->num_tracks.assign(B, 0);
+	}
+
+	// streams are independent
+	float iou_thresh = iou_thresh_;
+	auto track_examples = [&](int64 start, int64 limit){
+	    for (int64 b=start; b<limit; b++){
+		trackSegments(N, num_segments[b], offsets[b], iou_thresh, &labels[b*N], tracker->track_ids[b], tracker->num_tracks[b],
+			      &track_ids[b*N], &segment_tracks[offsets[b]]);
+		num_tracks[b] = tracker->num_tracks[b];
+	    }
+	};
+	auto worker_threads = *(context->device()->tensorflow_cpu_worker_threads());
+	Shard(worker_threads.num_threads, worker_threads.workers, B, int64(N)*8, track_examples);
+    }
+};
+
+REGISTER_KERNEL_BUILDER(Name("TrackSegments").Device(DEVICE_CPU), TrackSegmentsOp);
+
+using namespace std;
+
+// matches one frame's segments to the stream's tracks, starting new tracks for the rest
+static void trackSegments(int N, int S, int offset, float iou_thresh, const int *labels, std::vector<int> &prev_tracks, int &num_tracks,
+			  int *track_ids, int *segment_tracks){
+    std::vector<int> segment_ids(N);
+    for (int i=0; i<N; i++)
+	segment_ids[i] = labels[i] - offset;
+
+    std::vector<int> matches(S, -1);
+    if (!prev_tracks.empty())
+	matchSegmentsIoU(N, segment_ids.data(), S, prev_tracks.data(), num_tracks, iou_thresh, matches.data());
+    for (int s=0; s<S; s++)
+	segment_tracks[s] = (matches[s] >= 0) ? matches[s] : num_tracks++;
+
+    prev_tracks.resize(N);
+    for (int i=0; i<N; i++){
+	track_ids[i] = segment_tracks[segment_ids[i]];
+	prev_tracks[i] = track_ids[i];
+    }
+}
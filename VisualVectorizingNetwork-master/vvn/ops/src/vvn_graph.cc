@@ -0,0 +1,148 @@
+#include "vvn_graph.h"
+#include "graphs.h"
+#include "nndistance.h"
+#include "cpu_isa.h"
+#include <climits>
+#include <memory>
+#include <new>
+
+// C entry points of libvvn_graph; see vvn_graph.h. Arguments are checked
+// here so that the shared drivers in graphs.cc can assume valid buffers, as
+// they do behind the op kernels' checks.
+
+static bool validSize(int64_t a, int64_t b, int64_t c){
+    return a >= 0 && b >= 0 && c >= 0 && (a == 0 || b == 0 || c == 0 || a*b*c <= INT_MAX);
+}
+
+struct vvn_graph_context
+{
+    std::unique_ptr<StencilTopology> topology; // for the last (H,W,k) with (2k+1)**2 <= 64
+    GraphScratch scratch;
+    std::vector<float> nn_scratch;
+};
+
+// runs f, turning allocation failures into a status
+template <typename F>
+static int guarded(F f){
+    try{
+	f();
+    }
+    catch (const std::bad_alloc &){
+	return VVN_OUT_OF_MEMORY;
+    }
+    return VVN_OK;
+}
+
+template <typename E>
+static int labelProp(vvn_graph_context *ctx, int B, int H, int W, int k, int num_steps, bool defensive, uint32_t seed, int max_edges,
+		     const E *edges, int *labels, int *num_segments){
+    // PixGraph indexes an example's [H*W,K] edges and adjacency with ints
+    int64_t ksize = 2*int64_t(k) + 1;
+    if (!validSize(B, H, W) || H < 1 || W < 1 || k < 0 || !validSize(H, W, ksize) || !validSize(H, W, ksize*ksize) ||
+	ksize*ksize > max_edges || num_steps < 0)
+	return VVN_INVALID_ARGUMENT;
+    int K = ksize*ksize;
+    if (B == 0)
+	return VVN_OK;
+    if (!edges || !labels || !num_segments)
+	return VVN_INVALID_ARGUMENT;
+    return guarded([&](){
+	    // the tables only pay off across examples or calls, as in the LabelProp kernel
+	    std::unique_ptr<StencilTopology> owned_topology;
+	    std::unique_ptr<StencilTopology> &topology = ctx ? ctx->topology : owned_topology;
+	    if (K > 64)
+		topology.reset();
+	    else if (!topology || !topology->matches(H, W, k))
+		topology.reset(new StencilTopology(H, W, k));
+	    assignLabels(B, H, W, k, num_steps, defensive, topology.get(), edges, labels, num_segments, seed, NULL, NULL,
+			 ctx ? &ctx->scratch : NULL);
+	});
+}
+
+extern "C" {
+
+int vvn_graph_api_version(void){
+    return VVN_GRAPH_API_VERSION;
+}
+
+const char *vvn_graph_status_string(int status){
+    switch (status){
+    case VVN_OK: return "ok";
+    case VVN_INVALID_ARGUMENT: return "invalid argument";
+    case VVN_OUT_OF_MEMORY: return "out of memory";
+    default: return "unknown status";
+    }
+}
+
+const char *vvn_graph_isa(void){
+    return cpuIsaName(cpuIsa());
+}
+
+vvn_graph_context *vvn_graph_context_create(void){
+    return new (std::nothrow) vvn_graph_context();
+}
+
+void vvn_graph_context_destroy(vvn_graph_context *ctx){
+    delete ctx;
+}
+
+int vvn_connected_components(int B, int N, int C, const bool *edges, const bool *mask, int *ccids){
+    if (!validSize(B, N, N) || C < 0)
+	return VVN_INVALID_ARGUMENT;
+    if (int64_t(B)*N == 0)
+	return VVN_OK;
+    if (!edges || !mask || !ccids)
+	return VVN_INVALID_ARGUMENT;
+    return guarded([&](){ ccsearch(B, N, C, edges, mask, ccids); });
+}
+
+int vvn_label_prop(vvn_graph_context *ctx, int B, int H, int W, int k, int num_steps, bool defensive, uint32_t seed,
+		   const bool *edges, int *labels, int *num_segments){
+    return labelProp(ctx, B, H, W, k, num_steps, defensive, seed, INT_MAX, edges, labels, num_segments);
+}
+
+int vvn_label_prop_packed(vvn_graph_context *ctx, int B, int H, int W, int k, int num_steps, bool defensive, uint32_t seed,
+			  const uint64_t *edges, int *labels, int *num_segments){
+    return labelProp(ctx, B, H, W, k, num_steps, defensive, seed, 64, edges, labels, num_segments);
+}
+
+int vvn_label_prop_fc(vvn_graph_context *ctx, int B, int E, const int *num_nodes, const int *edges, int num_steps, bool sort_edges,
+		      uint32_t seed, int *labels, int *num_segments){
+    if (B < 0 || E < 0 || int64_t(E)*3 > INT_MAX || num_steps < 0)
+	return VVN_INVALID_ARGUMENT;
+    if (B == 0)
+	return E == 0 ? VVN_OK : VVN_INVALID_ARGUMENT;
+    if (!num_nodes || !num_segments || (E > 0 && !edges))
+	return VVN_INVALID_ARGUMENT;
+    int64_t total_nodes = 0;
+    for (int b=0; b<B; b++){
+	if (num_nodes[b] < 0)
+	    return VVN_INVALID_ARGUMENT;
+	total_nodes += num_nodes[b];
+    }
+    if (total_nodes > INT_MAX || (total_nodes > 0 && !labels))
+	return VVN_INVALID_ARGUMENT;
+    // every edge must join two nodes of its example, in example order unless sorted here
+    for (int e=0; e<E; e++){
+	int b = edges[e*3];
+	if (b < 0 || b >= B || (!sort_edges && e > 0 && b < edges[(e-1)*3]))
+	    return VVN_INVALID_ARGUMENT;
+	for (int i=1; i<3; i++)
+	    if (edges[e*3 + i] < 0 || edges[e*3 + i] >= num_nodes[b])
+		return VVN_INVALID_ARGUMENT;
+    }
+    return guarded([&](){ assignLabelsFC(B, E, num_nodes, edges, labels, num_segments, num_steps, sort_edges, seed, NULL, NULL,
+						   ctx ? &ctx->scratch : NULL); });
+}
+
+int vvn_nn_distance(vvn_graph_context *ctx, int B, int N, int M, int D, const float *xyz1, const float *xyz2, float *dist, int *idx){
+    if (!validSize(B, N, D) || !validSize(B, M, D) || D < 1)
+	return VVN_INVALID_ARGUMENT;
+    if (int64_t(B)*N == 0)
+	return VVN_OK;
+    if (M == 0 || !xyz1 || !xyz2 || !dist || !idx)
+	return VVN_INVALID_ARGUMENT;
+    return guarded([&](){ nnsearch(B, N, M, D, xyz1, xyz2, dist, idx, ctx ? &ctx->nn_scratch : NULL); });
+}
+
+}
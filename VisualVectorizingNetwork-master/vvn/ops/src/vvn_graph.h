@@ -0,0 +1,79 @@
+#ifndef VVN_GRAPH_H
+#define VVN_GRAPH_H
+
+#include <stdint.h>
+#ifndef __cplusplus
+#include <stdbool.h>
+#endif
+
+// C API of libvvn_graph, the graph algorithms behind the ConnectedComponents,
+// LabelProp, LabelPropFc and NnDistance ops, for use without TensorFlow (e.g.
+// by vvn_segment). All buffers are dense, row-major and owned by the caller;
+// outputs are written in place and have the shapes of the matching op
+// outputs. Calls share no state other than a context passed to them, so they
+// may run concurrently on different buffers and contexts. Labelprop shuffles
+// its sweeps from the given seed alone, so the same seed and inputs give the
+// same labels on every run and thread.
+// Every call returns VVN_OK or an error status, in which case the outputs
+// are unspecified.
+
+#define VVN_GRAPH_API_VERSION 4
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum
+{
+    VVN_OK = 0,
+    VVN_INVALID_ARGUMENT = 1,
+    VVN_OUT_OF_MEMORY = 2
+};
+
+int vvn_graph_api_version(void);
+const char *vvn_graph_status_string(int status);
+
+// the instruction set the kernels run at, "baseline", "avx2" or "avx512":
+// the best this CPU supports unless VVN_ISA forces a lower one when the
+// library is loaded
+const char *vvn_graph_isa(void);
+
+// Storage that labelprop and nn distance calls reuse instead of allocating
+// their graphs and transposed points, and the stencil tables of the last
+// (H,W,k) seen. A context is used by one call
+// at a time, e.g. one per thread; passing NULL instead allocates per call.
+// Returns NULL if out of memory.
+typedef struct vvn_graph_context vvn_graph_context;
+vvn_graph_context *vvn_graph_context_create(void);
+void vvn_graph_context_destroy(vvn_graph_context *ctx);
+
+// ccids[B,N] of the C largest components of edges[B,N,N] among the points
+// with mask[B,N] set, as ConnectedComponents
+int vvn_connected_components(int B, int N, int C, const bool *edges, const bool *mask, int *ccids);
+
+// labels[B,H*W] and num_segments[B] after num_steps of labelprop on stencil
+// edges[B,H*W,(2k+1)**2], as LabelProp, with each example's sweeps shuffled
+// from seed and its index in the batch
+int vvn_label_prop(vvn_graph_context *ctx, int B, int H, int W, int k, int num_steps, bool defensive, uint32_t seed,
+		   const bool *edges, int *labels, int *num_segments);
+
+// as vvn_label_prop on packed edges[B,H*W], bit e of each holding slot e of
+// the stencil (see PackStencilEdges); requires (2k+1)**2 <= 64
+int vvn_label_prop_packed(vvn_graph_context *ctx, int B, int H, int W, int k, int num_steps, bool defensive, uint32_t seed,
+			  const uint64_t *edges, int *labels, int *num_segments);
+
+// labels[sum(num_nodes)] and num_segments[B] after num_steps of labelprop on
+// the graphs joined by edges[E,3] = (example, sender, receiver), as LabelPropFc,
+// shuffled from seed as vvn_label_prop
+int vvn_label_prop_fc(vvn_graph_context *ctx, int B, int E, const int *num_nodes, const int *edges, int num_steps, bool sort_edges,
+		      uint32_t seed, int *labels, int *num_segments);
+
+// dist[B,N] and idx[B,N] of the nearest of the points xyz2[B,M,D] to each of
+// the points xyz1[B,N,D], as one direction of NnDistance
+int vvn_nn_distance(vvn_graph_context *ctx, int B, int N, int M, int D, const float *xyz1, const float *xyz2, float *dist, int *idx);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,165 @@
+#include "vvn_graph.h"
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Precomputes LabelProp segments for a whole dataset outside of training.
+// Reads F frames of stencil edges, either bools [F,H*W,(2k+1)**2] stored as
+// bytes or with --packed uint64 bitmasks [F,H*W] (see PackStencilEdges), as
+// written by numpy's tofile, and writes each frame's labels as int32
+// [F,H*W] to <out>.labels and its number of segments as int32 [F] to
+// <out>.num_segments. Unlike the LabelProp op, each frame's labels start at 0.
+// Frame f is shuffled from seed + f, so the output doesn't depend on the
+// number of threads or the block size.
+// Frames are read in blocks and segmented in parallel over threads, each
+// reusing one vvn_graph_context for all of its frames.
+//
+// usage: vvn_segment --height=H --width=W --k=K [--steps=10] [--defensive]
+//                    [--packed] [--seed=0] [--threads=N] [--block=256] <edges> <out>
+
+struct SegmentArgs
+{
+    int H = 0; int W = 0; int k = -1;
+    int num_steps = 10;
+    bool defensive = false;
+    bool packed = false;
+    int seed = 0;
+    int threads = 0;
+    int block = 256;
+    std::string edges_path;
+    std::string out_path;
+};
+
+static bool intOption(const std::string &arg, const char *name, int *value){
+    size_t len = std::strlen(name);
+    if (arg.compare(0, len, name) != 0)
+	return false;
+    *value = std::atoi(arg.c_str() + len);
+    return true;
+}
+
+static bool parseArgs(int argc, char **argv, SegmentArgs &args){
+    std::vector<std::string> paths;
+    for (int i=1; i<argc; i++){
+	std::string arg(argv[i]);
+	if (arg == "--defensive")
+	    args.defensive = true;
+	else if (arg == "--packed")
+	    args.packed = true;
+	else if (intOption(arg, "--height=", &args.H) || intOption(arg, "--width=", &args.W) || intOption(arg, "--k=", &args.k) ||
+		 intOption(arg, "--steps=", &args.num_steps) || intOption(arg, "--seed=", &args.seed) ||
+		 intOption(arg, "--threads=", &args.threads) ||
+		 intOption(arg, "--block=", &args.block))
+	    continue;
+	else if (arg.compare(0, 2, "--") == 0)
+	    return false;
+	else
+	    paths.push_back(arg);
+    }
+    if (paths.size() != 2 || args.H < 1 || args.W < 1 || args.k < 0 || args.num_steps < 0 || args.block < 1)
+	return false;
+    args.edges_path = paths[0];
+    args.out_path = paths[1];
+    if (args.threads < 1)
+	args.threads = std::max(1u, std::thread::hardware_concurrency());
+    return true;
+}
+
+int main(int argc, char **argv){
+    SegmentArgs args;
+    if (!parseArgs(argc, argv, args)){
+	fprintf(stderr, "usage: %s --height=H --width=W --k=K [--steps=10] [--defensive] [--packed] [--seed=0] [--threads=N] [--block=256] <edges> <out>\n", argv[0]);
+	return 1;
+    }
+    int N = args.H*args.W; int K = (2*args.k + 1)*(2*args.k + 1);
+    if (args.packed && K > 64){
+	fprintf(stderr, "vvn_segment: --packed requires (2k+1)**2 <= 64\n");
+	return 1;
+    }
+    size_t frame_bytes = args.packed ? size_t(N)*sizeof(uint64_t) : size_t(N)*K;
+
+    FILE *edges_file = fopen(args.edges_path.c_str(), "rb");
+    if (!edges_file){
+	fprintf(stderr, "vvn_segment: cannot open %s\n", args.edges_path.c_str());
+	return 1;
+    }
+    std::string labels_path = args.out_path + ".labels";
+    std::string segments_path = args.out_path + ".num_segments";
+    FILE *labels_file = fopen(labels_path.c_str(), "wb");
+    FILE *segments_file = fopen(segments_path.c_str(), "wb");
+    if (!labels_file || !segments_file){
+	fprintf(stderr, "vvn_segment: cannot write %s\n", args.out_path.c_str());
+	return 1;
+    }
+
+    std::vector<char> edges(frame_bytes*args.block);
+    std::vector<int> labels(size_t(N)*args.block);
+    std::vector<int> num_segments(args.block);
+    std::vector<vvn_graph_context*> contexts(args.threads);
+    for (int t=0; t<args.threads; t++){
+	contexts[t] = vvn_graph_context_create();
+	if (!contexts[t]){
+	    fprintf(stderr, "vvn_segment: %s\n", vvn_graph_status_string(VVN_OUT_OF_MEMORY));
+	    return 1;
+	}
+    }
+    long long num_frames = 0;
+    while (true){
+	size_t bytes = fread(edges.data(), 1, frame_bytes*args.block, edges_file);
+	size_t F = bytes / frame_bytes;
+	if (bytes % frame_bytes != 0){
+	    fprintf(stderr, "vvn_segment: %s ends with a partial frame of %zu bytes after frame %lld\n", args.edges_path.c_str(),
+		    bytes % frame_bytes, num_frames + (long long)F);
+	    return 1;
+	}
+	if (F == 0)
+	    break;
+
+	// frames are independent; each thread takes the next unsegmented one
+	std::atomic<int> next_frame(0);
+	std::atomic<int> status(VVN_OK);
+	auto segment_frames = [&](vvn_graph_context *ctx){
+	    for (int f=next_frame++; f<int(F); f=next_frame++){
+		const char *frame_edges = &edges[frame_bytes*f];
+		uint32_t seed = uint32_t(args.seed) + uint32_t(num_frames + f);
+		int s = args.packed ?
+		    vvn_label_prop_packed(ctx, 1, args.H, args.W, args.k, args.num_steps, args.defensive, seed,
+					  reinterpret_cast<const uint64_t*>(frame_edges), &labels[size_t(N)*f], &num_segments[f]) :
+		    vvn_label_prop(ctx, 1, args.H, args.W, args.k, args.num_steps, args.defensive, seed,
+				   reinterpret_cast<const bool*>(frame_edges), &labels[size_t(N)*f], &num_segments[f]);
+		if (s != VVN_OK)
+		    status = s;
+	    }
+	};
+	std::vector<std::thread> pool;
+	for (int t=1; t<std::min(args.threads, int(F)); t++)
+	    pool.push_back(std::thread(segment_frames, contexts[t]));
+	segment_frames(contexts[0]);
+	for (size_t t=0; t<pool.size(); t++)
+	    pool[t].join();
+	if (status != VVN_OK){
+	    fprintf(stderr, "vvn_segment: %s at frame %lld\n", vvn_graph_status_string(status), num_frames);
+	    return 1;
+	}
+
+	fwrite(labels.data(), sizeof(int)*N, F, labels_file);
+	fwrite(num_segments.data(), sizeof(int), F, segments_file);
+	num_frames += F;
+	if (F < size_t(args.block))
+	    break;
+    }
+    if (ferror(edges_file) || ferror(labels_file) || ferror(segments_file)){
+	fprintf(stderr, "vvn_segment: i/o error after %lld frames\n", num_frames);
+	return 1;
+    }
+    fclose(edges_file); fclose(labels_file); fclose(segments_file);
+    for (int t=0; t<args.threads; t++)
+	vvn_graph_context_destroy(contexts[t]);
+    fprintf(stderr, "vvn_segment: segmented %lld frames (%s)\n", num_frames, vvn_graph_isa());
+    return 0;
+}